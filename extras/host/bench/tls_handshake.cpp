@@ -0,0 +1,316 @@
+/****************************************************************************************************************************
+  tls_handshake.cpp
+
+  Host benchmark: connection set-up cost. Repeats AsyncSSLClient::connect(..., secure = true) against
+  the mbedTLS peer of tls_peer.cpp, one connection at a time, and prints one JSON object per case:
+
+    {"bench":"tls_handshake","version":"...","case":"ecdsa_p256","suite":"TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256",
+     "count":200,"ok":200,"resumed":0,"handshakes_per_s":310.2,"p50_us":3170,"p95_us":3391,"p99_us":3705,"max_us":4122,
+     "phases_p50_us":{"tcp_connect":95,"tls_setup":61,"client_hello":240,"server_flight1":1210,
+                      "client_flight2":1490,"server_finished":35,"client_finish":60},"status":"ok"}
+
+  Times are from connect() to onConnect(). handshakes_per_s is ok divided by their sum, i.e. serial
+  handshakes without the close. The phases add up to the total:
+
+    tcp_connect       connect() to TCP established, AsyncSSLConnMetrics::connect_us
+    tls_setup         tcp_ssl_new_client() / tcp_ssl_new_psk_client(), AsyncSSLConnMetrics::tls_setup_us
+    client_hello      ClientHello written by the client and parsed by the peer
+    server_flight1    the peer's ServerHello .. ServerHelloDone, incl. its key exchange signature
+    client_flight2    the client's certificate check, key exchange and Finished, until parsed by the peer
+    server_finished   the peer's ChangeCipherSpec and Finished
+    client_finish     until the client's onConnect()
+
+  Cases: RSA-2048 and ECDSA P-256 server certificates with ECDHE on P-256 or x25519 (mbedTLS's
+  preference), PSK via setPsk(), and ECDSA P-256 resumed with setSessionResumption() after one
+  unmeasured full handshake. The client is configured without a root CA, so the server's signature is
+  checked but not its chain. "resumed" counts the abbreviated handshakes: there server_flight1 is the
+  ServerHello .. Finished, client_flight2 the client's Finished and server_finished 0.
+
+    tls_handshake [--count N]
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "AsyncTCP_SSL.hpp"
+#include "AsyncTCP_SSL_Host.h"
+
+#include "tls_peer.h"
+
+#include "mbedtls/ssl_ciphersuites.h"
+
+#include <algorithm>
+#include <vector>
+
+#if !ASYNC_TCP_SSL_METRICS
+  #error tls_handshake needs ASYNC_TCP_SSL_METRICS for the TCP connect and setup times
+#endif
+
+#define BENCH_PORT              8444
+#define BENCH_COUNT             200
+#define BENCH_TIMEOUT_MS        10000
+
+#define BENCH_PSK_IDENT         "bench"
+#define BENCH_PSK_HEX           "000102030405060708090a0b0c0d0e0f"
+
+static const unsigned char bench_psk[] =
+{
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+typedef struct
+{
+  const char *  name;
+  const char *  suite;
+  bool          psk;
+  bool          resume;
+} bench_case_t;
+
+static const bench_case_t bench_cases[] =
+{
+  { "rsa2048",    "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256",    false, false },
+  { "ecdsa_p256", "TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256",  false, false },
+  { "psk",        "TLS-PSK-WITH-AES-128-GCM-SHA256",          true,  false },
+  { "resumed",    "TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256",  false, true  },
+};
+
+enum
+{
+  PHASE_TCP_CONNECT,
+  PHASE_TLS_SETUP,
+  PHASE_CLIENT_HELLO,
+  PHASE_SERVER_FLIGHT1,
+  PHASE_CLIENT_FLIGHT2,
+  PHASE_SERVER_FINISHED,
+  PHASE_CLIENT_FINISH,
+  PHASES
+};
+
+static const char * const phase_names[PHASES] =
+{
+  "tcp_connect", "tls_setup", "client_hello", "server_flight1", "client_flight2", "server_finished", "client_finish"
+};
+
+// Written by the async task in the client's callbacks, polled by main()
+static volatile uint64_t  bench_connected_us;
+static volatile bool      bench_disconnected;
+
+/////////////////////////////////////////////
+
+static uint32_t benchPercentile(std::vector<uint32_t>& values, unsigned percent)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+
+  std::sort(values.begin(), values.end());
+
+  return values[(values.size() - 1) * percent / 100];
+}
+
+/////////////////////////////////////////////
+
+static uint32_t benchSpan(uint64_t from, uint64_t to)
+{
+  return (to > from) ? (uint32_t) (to - from) : 0;
+}
+
+/////////////////////////////////////////////
+
+// One connect() to onConnect(), fills phases[] and counts resumed handshakes. Returns the total in us,
+// 0 if it failed
+static uint32_t benchHandshake(const bench_case_t& bench_case, uint32_t phases[PHASES], uint32_t& resumed)
+{
+  AsyncSSLClient * client = new AsyncSSLClient();
+
+  bench_connected_us  = 0;
+  bench_disconnected  = false;
+
+  if (bench_case.psk)
+  {
+    client->setPsk(BENCH_PSK_IDENT, BENCH_PSK_HEX);
+  }
+
+  client->setSessionResumption(bench_case.resume);
+
+  client->onConnect([](void* arg, AsyncSSLClient * c)
+  {
+    bench_connected_us = micros();
+  }, NULL);
+
+  client->onDisconnect([](void* arg, AsyncSSLClient * c)
+  {
+    bench_disconnected = true;
+  }, NULL);
+
+  tlsPeerReset();
+
+  uint64_t start  = micros();
+  uint32_t total  = 0;
+
+  if (client->connect(IPAddress(127, 0, 0, 1), BENCH_PORT, true))
+  {
+    uint32_t started = millis();
+
+    while (!bench_connected_us && !bench_disconnected && millis() - started < BENCH_TIMEOUT_MS)
+    {
+      delay(1);
+    }
+  }
+
+  if (bench_connected_us)
+  {
+    TlsPeerStats stats;
+
+    tlsPeerGetStats(stats);
+
+    const AsyncSSLConnMetrics& metrics = client->getConnMetrics();
+    uint64_t setup_done = start + metrics.connect_us + metrics.tls_setup_us;
+
+    total   = benchSpan(start, bench_connected_us);
+    resumed += stats.resumed;
+
+    phases[PHASE_TCP_CONNECT]     = metrics.connect_us;
+    phases[PHASE_TLS_SETUP]       = metrics.tls_setup_us;
+    phases[PHASE_CLIENT_HELLO]    = benchSpan(setup_done, stats.hello_us);
+    phases[PHASE_SERVER_FLIGHT1]  = benchSpan(stats.hello_us, stats.flight1_us);
+    phases[PHASE_CLIENT_FLIGHT2]  = benchSpan(stats.flight1_us, stats.flight2_us);
+    phases[PHASE_SERVER_FINISHED] = benchSpan(stats.flight2_us, stats.handshake_us);
+    phases[PHASE_CLIENT_FINISH]   = benchSpan(stats.handshake_us, bench_connected_us);
+  }
+
+  client->close(true);
+
+  uint32_t started = millis();
+
+  while (!bench_disconnected && millis() - started < 1000)
+  {
+    delay(1);
+  }
+
+  delete client;
+
+  return total;
+}
+
+/////////////////////////////////////////////
+
+static bool benchCase(const bench_case_t& bench_case, uint32_t count)
+{
+  int suite = mbedtls_ssl_get_ciphersuite_id(bench_case.suite);
+
+  if (suite == 0)
+  {
+    printf("{\"bench\":\"tls_handshake\",\"version\":\"%s\",\"case\":\"%s\",\"suite\":\"%s\",\"status\":\"unavailable\"}\n",
+           ASYNC_TCP_SSL_VERSION, bench_case.name, bench_case.suite);
+
+    return true;
+  }
+
+  TlsPeerConfig config = { suite, true, 0, 0, 0, NULL, NULL, 0 };
+
+  if (bench_case.psk)
+  {
+    config.psk_ident  = BENCH_PSK_IDENT;
+    config.psk        = bench_psk;
+    config.psk_len    = sizeof(bench_psk);
+  }
+
+  tlsPeerSet(config);
+
+  std::vector<uint32_t> totals;
+  std::vector<uint32_t> phases[PHASES];
+  uint64_t              sum     = 0;
+  uint32_t              resumed = 0;
+  uint32_t              times[PHASES];
+
+  // A session to resume
+  if (bench_case.resume)
+  {
+    uint32_t primed = 0;
+
+    benchHandshake(bench_case, times, primed);
+  }
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t total = benchHandshake(bench_case, times, resumed);
+
+    if (!total)
+    {
+      continue;
+    }
+
+    totals.push_back(total);
+    sum += total;
+
+    for (int p = 0; p < PHASES; p++)
+    {
+      phases[p].push_back(times[p]);
+    }
+  }
+
+  uint32_t ok = totals.size();
+
+  printf("{\"bench\":\"tls_handshake\",\"version\":\"%s\",\"case\":\"%s\",\"suite\":\"%s\",\"count\":%u,\"ok\":%u,"
+         "\"resumed\":%u,\"handshakes_per_s\":%.1f,\"p50_us\":%u,\"p95_us\":%u,\"p99_us\":%u,\"max_us\":%u,"
+         "\"phases_p50_us\":{",
+         ASYNC_TCP_SSL_VERSION, bench_case.name, bench_case.suite, count, ok, resumed, sum ? ok * 1e6 / sum : 0,
+         benchPercentile(totals, 50), benchPercentile(totals, 95), benchPercentile(totals, 99),
+         benchPercentile(totals, 100));
+
+  for (int p = 0; p < PHASES; p++)
+  {
+    printf("%s\"%s\":%u", p ? "," : "", phase_names[p], benchPercentile(phases[p], 50));
+  }
+
+  // A resumed case with full handshakes measures the wrong thing
+  bool passed = (ok == count) && (!bench_case.resume || resumed == ok);
+
+  printf("},\"status\":\"%s\"}\n", passed ? "ok" : "failed");
+  fflush(stdout);
+
+  return passed;
+}
+
+/////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+  uint32_t count = BENCH_COUNT;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--count") && i + 1 < argc)
+    {
+      count = strtoul(argv[++i], NULL, 0);
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--count N]\n", argv[0]);
+
+      return 2;
+    }
+  }
+
+  if (asyncTcpSslHostBegin() != 0 || !tlsPeerBegin(BENCH_PORT))
+  {
+    fprintf(stderr, "start-up failed\n");
+
+    return 1;
+  }
+
+  int failures = 0;
+
+  for (const bench_case_t& bench_case : bench_cases)
+  {
+    if (!benchCase(bench_case, count))
+    {
+      failures++;
+    }
+  }
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,532 @@
+/****************************************************************************************************************************
+  tls_peer.cpp
+
+  Host benchmarks: the local TLS peer, see tls_peer.h
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "tls_peer.h"
+
+#include "Arduino.h"
+
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+
+#include "mbedtls/certs.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_cache.h"
+#include "mbedtls/ssl_internal.h"
+#include "mbedtls/x509_crt.h"
+
+#define TLS_PEER_PAYLOAD    16384
+
+typedef struct
+{
+  struct tcp_pcb *    pcb;
+  mbedtls_ssl_context ssl;
+  struct pbuf *       rx;             // ciphertext not yet read by mbedTLS
+  bool                handshaken;
+  int                 stamped;        // furthest handshake state timed
+  bool                resumed;        // abbreviated handshake, other states
+  TlsPeerConfig       config;
+  uint32_t            to_send;
+  uint32_t            write_left;
+} tls_peer_conn_t;
+
+static mbedtls_entropy_context  _peer_entropy;
+static mbedtls_ctr_drbg_context _peer_drbg;
+static mbedtls_ssl_config       _peer_conf;
+static mbedtls_x509_crt         _peer_crt_rsa;
+static mbedtls_x509_crt         _peer_crt_ec;
+static mbedtls_pk_context       _peer_key_rsa;
+static mbedtls_pk_context       _peer_key_ec;
+static mbedtls_ssl_cache_context _peer_cache;
+
+static int                      _peer_suites[2];
+static TlsPeerConfig            _peer_config;
+static TlsPeerStats             _peer_stats;
+static unsigned char            _peer_payload[TLS_PEER_PAYLOAD];
+
+// Everything below runs with the tcpip core locked: in lwIP's callbacks, or under LOCK_TCPIP_CORE()
+
+/////////////////////////////////////////////
+
+static int _peer_bio_send(void * ctx, const unsigned char * buf, size_t len)
+{
+  tls_peer_conn_t * conn = (tls_peer_conn_t *) ctx;
+  size_t            room = tcp_sndbuf(conn->pcb);
+
+  if (len > room)
+  {
+    len = room;
+  }
+
+  if (len > 0xFFFF)
+  {
+    len = 0xFFFF;
+  }
+
+  if (len == 0 || tcp_write(conn->pcb, buf, len, TCP_WRITE_FLAG_COPY) != ERR_OK)
+  {
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+  }
+
+  return (int) len;
+}
+
+/////////////////////////////////////////////
+
+static int _peer_bio_recv(void * ctx, unsigned char * buf, size_t len)
+{
+  tls_peer_conn_t * conn = (tls_peer_conn_t *) ctx;
+
+  if (conn->rx == NULL)
+  {
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  }
+
+  if (len > conn->rx->tot_len)
+  {
+    len = conn->rx->tot_len;
+  }
+
+  u16_t copied = pbuf_copy_partial(conn->rx, buf, len, 0);
+
+  conn->rx = pbuf_free_header(conn->rx, copied);
+
+  tcp_recved(conn->pcb, copied);
+
+  return copied;
+}
+
+/////////////////////////////////////////////
+
+static err_t _peer_close(tls_peer_conn_t * conn, bool failed)
+{
+  struct tcp_pcb * pcb = conn->pcb;
+  err_t            err = ERR_OK;
+
+  if (failed)
+  {
+    _peer_stats.failures++;
+  }
+
+  if (pcb)
+  {
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_sent(pcb, NULL);
+    tcp_err(pcb, NULL);
+
+    if (tcp_close(pcb) != ERR_OK)
+    {
+      tcp_abort(pcb);
+      err = ERR_ABRT;
+    }
+  }
+
+  if (conn->rx)
+  {
+    pbuf_free(conn->rx);
+  }
+
+  mbedtls_ssl_free(&conn->ssl);
+  delete conn;
+
+  return err;
+}
+
+/////////////////////////////////////////////
+
+// mbedtls_ssl_handshake() one step at a time, to time the flights
+static int _peer_handshake(tls_peer_conn_t * conn)
+{
+  int ret = 0;
+
+  while (conn->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER)
+  {
+    ret = mbedtls_ssl_handshake_step(&conn->ssl);
+
+    int state = conn->ssl.state;
+
+    if (conn->ssl.handshake && conn->ssl.handshake->resume)
+    {
+      conn->resumed = true;
+    }
+
+    if (conn->stamped < MBEDTLS_SSL_SERVER_HELLO && state >= MBEDTLS_SSL_SERVER_HELLO)
+    {
+      _peer_stats.hello_us = micros();
+    }
+
+    if (conn->resumed)
+    {
+      // ServerHello, ChangeCipherSpec and Finished, then the client's ChangeCipherSpec and Finished
+      if (state == MBEDTLS_SSL_CLIENT_CHANGE_CIPHER_SPEC && _peer_stats.flight1_us < _peer_stats.hello_us)
+      {
+        _peer_stats.flight1_us = micros();
+      }
+    }
+    else
+    {
+      if (conn->stamped < MBEDTLS_SSL_CLIENT_CERTIFICATE && state >= MBEDTLS_SSL_CLIENT_CERTIFICATE)
+      {
+        _peer_stats.flight1_us = micros();
+      }
+
+      if (conn->stamped < MBEDTLS_SSL_SERVER_CHANGE_CIPHER_SPEC && state >= MBEDTLS_SSL_SERVER_CHANGE_CIPHER_SPEC)
+      {
+        _peer_stats.flight2_us = micros();
+      }
+    }
+
+    if (state == MBEDTLS_SSL_HANDSHAKE_OVER)
+    {
+      _peer_stats.handshake_us = micros();
+
+      if (conn->resumed)
+      {
+        _peer_stats.flight2_us = _peer_stats.handshake_us;
+        _peer_stats.resumed++;
+      }
+    }
+
+    if (state > conn->stamped)
+    {
+      conn->stamped = state;
+    }
+
+    if (ret != 0)
+    {
+      break;
+    }
+  }
+
+  return ret;
+}
+
+/////////////////////////////////////////////
+
+// Handshake, then sink what the client sends and stream config.source_bytes to it
+static err_t _peer_drive(tls_peer_conn_t * conn)
+{
+  int ret;
+
+  if (!conn->handshaken)
+  {
+    ret = _peer_handshake(conn);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      tcp_output(conn->pcb);
+
+      return ERR_OK;
+    }
+
+    if (ret != 0)
+    {
+      return _peer_close(conn, true);
+    }
+
+    conn->handshaken  = true;
+    conn->to_send     = conn->config.source_bytes;
+
+    _peer_stats.handshakes++;
+    _peer_stats.suite = mbedtls_ssl_get_ciphersuite_id(mbedtls_ssl_get_ciphersuite(&conn->ssl));
+  }
+
+  unsigned char buf[TLS_PEER_PAYLOAD];
+
+  while ((ret = mbedtls_ssl_read(&conn->ssl, buf, sizeof(buf))) > 0)
+  {
+    _peer_stats.bytes_in   += ret;
+    _peer_stats.last_in_us  = micros();
+  }
+
+  if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+  {
+    return _peer_close(conn, false);
+  }
+
+  if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    return _peer_close(conn, true);
+  }
+
+  while (conn->to_send)
+  {
+    if (!conn->write_left)
+    {
+      conn->write_left = (conn->to_send < conn->config.write_size) ? conn->to_send : conn->config.write_size;
+    }
+
+    uint32_t piece = (conn->write_left < conn->config.record_size) ? conn->write_left : conn->config.record_size;
+
+    // After WANT_WRITE mbedTLS wants the same call again, piece is recomputed unchanged
+    ret = mbedtls_ssl_write(&conn->ssl, _peer_payload, piece);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      break;
+    }
+
+    if (ret < 0)
+    {
+      return _peer_close(conn, true);
+    }
+
+    conn->write_left       -= ret;
+    conn->to_send          -= ret;
+    _peer_stats.bytes_out  += ret;
+
+    if (!conn->write_left)
+    {
+      tcp_output(conn->pcb);
+    }
+
+    if (!conn->to_send)
+    {
+      _peer_stats.source_done_us = micros();
+    }
+  }
+
+  tcp_output(conn->pcb);
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+static err_t _peer_recv(void * arg, struct tcp_pcb * pcb, struct pbuf * p, err_t err)
+{
+  tls_peer_conn_t * conn = (tls_peer_conn_t *) arg;
+
+  if (p == NULL)
+  {
+    return _peer_close(conn, false);
+  }
+
+  if (err != ERR_OK)
+  {
+    pbuf_free(p);
+
+    return err;
+  }
+
+  if (conn->rx)
+  {
+    pbuf_cat(conn->rx, p);
+  }
+  else
+  {
+    conn->rx = p;
+  }
+
+  return _peer_drive(conn);
+}
+
+/////////////////////////////////////////////
+
+static err_t _peer_sent(void * arg, struct tcp_pcb * pcb, u16_t len)
+{
+  tls_peer_conn_t * conn = (tls_peer_conn_t *) arg;
+
+  if (!conn->handshaken || !conn->to_send)
+  {
+    return ERR_OK;
+  }
+
+  return _peer_drive(conn);
+}
+
+/////////////////////////////////////////////
+
+static void _peer_error(void * arg, err_t err)
+{
+  tls_peer_conn_t * conn = (tls_peer_conn_t *) arg;
+
+  if (conn)
+  {
+    // lwIP freed the pcb already
+    conn->pcb = NULL;
+    _peer_close(conn, false);
+  }
+}
+
+/////////////////////////////////////////////
+
+static err_t _peer_accept(void * arg, struct tcp_pcb * pcb, err_t err)
+{
+  if (err != ERR_OK || pcb == NULL)
+  {
+    return ERR_VAL;
+  }
+
+  tls_peer_conn_t * conn = new tls_peer_conn_t();
+
+  conn->pcb     = pcb;
+  conn->config  = _peer_config;
+
+  mbedtls_ssl_init(&conn->ssl);
+
+  if (mbedtls_ssl_setup(&conn->ssl, &_peer_conf) != 0)
+  {
+    mbedtls_ssl_free(&conn->ssl);
+    delete conn;
+    tcp_abort(pcb);
+
+    return ERR_ABRT;
+  }
+
+  mbedtls_ssl_set_bio(&conn->ssl, conn, _peer_bio_send, _peer_bio_recv, NULL);
+
+  if (conn->config.nodelay)
+  {
+    tcp_nagle_disable(pcb);
+  }
+
+  tcp_arg(pcb, conn);
+  tcp_recv(pcb, _peer_recv);
+  tcp_sent(pcb, _peer_sent);
+  tcp_err(pcb, _peer_error);
+
+  _peer_stats.accepted++;
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+static bool _peer_load(mbedtls_x509_crt * crt, const char * crt_pem, size_t crt_len,
+                       mbedtls_pk_context * key, const char * key_pem, size_t key_len)
+{
+  mbedtls_x509_crt_init(crt);
+  mbedtls_pk_init(key);
+
+  return (mbedtls_x509_crt_parse(crt, (const unsigned char *) crt_pem, crt_len) == 0)
+         && (mbedtls_pk_parse_key(key, (const unsigned char *) key_pem, key_len, NULL, 0) == 0)
+         && (mbedtls_ssl_conf_own_cert(&_peer_conf, crt, key) == 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool tlsPeerBegin(uint16_t port)
+{
+  static const char pers[] = "async_tcp_ssl_bench_peer";
+
+  memset(_peer_payload, 'x', sizeof(_peer_payload));
+
+  mbedtls_entropy_init(&_peer_entropy);
+  mbedtls_ctr_drbg_init(&_peer_drbg);
+  mbedtls_ssl_config_init(&_peer_conf);
+
+  if (mbedtls_ctr_drbg_seed(&_peer_drbg, mbedtls_entropy_func, &_peer_entropy,
+                            (const unsigned char *) pers, sizeof(pers)) != 0)
+  {
+    return false;
+  }
+
+  if (mbedtls_ssl_config_defaults(&_peer_conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                  MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+  {
+    return false;
+  }
+
+  mbedtls_ssl_conf_rng(&_peer_conf, mbedtls_ctr_drbg_random, &_peer_drbg);
+
+  // Session ids only, the client's tickets are not used
+  mbedtls_ssl_cache_init(&_peer_cache);
+  mbedtls_ssl_conf_session_cache(&_peer_conf, &_peer_cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+
+  if (!_peer_load(&_peer_crt_rsa, mbedtls_test_srv_crt_rsa, mbedtls_test_srv_crt_rsa_len,
+                  &_peer_key_rsa, mbedtls_test_srv_key_rsa, mbedtls_test_srv_key_rsa_len)
+      || !_peer_load(&_peer_crt_ec, mbedtls_test_srv_crt_ec, mbedtls_test_srv_crt_ec_len,
+                     &_peer_key_ec, mbedtls_test_srv_key_ec, mbedtls_test_srv_key_ec_len))
+  {
+    return false;
+  }
+
+  LOCK_TCPIP_CORE();
+
+  struct tcp_pcb * pcb = tcp_new_ip_type(IPADDR_TYPE_V4);
+  bool             ok  = false;
+
+  if (pcb && tcp_bind(pcb, IP4_ADDR_ANY, port) == ERR_OK)
+  {
+    struct tcp_pcb * listener = tcp_listen(pcb);
+
+    if (listener)
+    {
+      tcp_accept(listener, _peer_accept);
+      ok = true;
+    }
+  }
+  else if (pcb)
+  {
+    tcp_close(pcb);
+  }
+
+  UNLOCK_TCPIP_CORE();
+
+  return ok;
+}
+
+/////////////////////////////////////////////
+
+void tlsPeerSet(const TlsPeerConfig& config)
+{
+  LOCK_TCPIP_CORE();
+
+  _peer_config = config;
+
+  if (_peer_config.write_size == 0)
+  {
+    _peer_config.write_size = TLS_PEER_PAYLOAD;
+  }
+
+  if (_peer_config.record_size == 0 || _peer_config.record_size > TLS_PEER_PAYLOAD)
+  {
+    _peer_config.record_size = TLS_PEER_PAYLOAD;
+  }
+
+  if (config.psk && config.psk_ident)
+  {
+    mbedtls_ssl_conf_psk(&_peer_conf, config.psk, config.psk_len, (const unsigned char *) config.psk_ident,
+                         strlen(config.psk_ident));
+  }
+
+  _peer_suites[0] = config.suite;
+  _peer_suites[1] = 0;
+
+  mbedtls_ssl_conf_ciphersuites(&_peer_conf, config.suite ? _peer_suites : mbedtls_ssl_list_ciphersuites());
+
+  UNLOCK_TCPIP_CORE();
+}
+
+/////////////////////////////////////////////
+
+void tlsPeerReset()
+{
+  LOCK_TCPIP_CORE();
+
+  memset(&_peer_stats, 0, sizeof(_peer_stats));
+
+  UNLOCK_TCPIP_CORE();
+}
+
+/////////////////////////////////////////////
+
+void tlsPeerGetStats(TlsPeerStats& stats)
+{
+  LOCK_TCPIP_CORE();
+
+  stats = _peer_stats;
+
+  UNLOCK_TCPIP_CORE();
+}
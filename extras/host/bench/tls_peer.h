@@ -0,0 +1,60 @@
+/****************************************************************************************************************************
+  tls_peer.h
+
+  Host benchmarks: a TLS server written directly on mbedTLS and lwIP's raw API, the local peer that
+  AsyncSSLClient connects to. It runs in the tcpip thread and uses mbedTLS's test certificates
+  (RSA-2048 and ECDSA P-256 together, mbedTLS picks the one matching the negotiated suite). It keeps
+  sessions, so that clients can resume them.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_BENCH_TLS_PEER_H
+#define ASYNC_TCP_SSL_BENCH_TLS_PEER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Applies to the connections accepted after tlsPeerSet()
+typedef struct
+{
+  int                   suite;          // only cipher suite accepted, 0 for mbedTLS's defaults
+  bool                  nodelay;        // Nagle off on the peer's side
+  uint32_t              source_bytes;   // plaintext streamed to the client once the handshake finished, 0 for none
+  uint32_t              write_size;     // the peer's application writes: one tcp_output() per write
+  uint32_t              record_size;    // plaintext per mbedtls_ssl_write(), i.e. per TLS record
+  const char *          psk_ident;      // for PSK suites, NULL for none
+  const unsigned char * psk;
+  size_t                psk_len;
+} TlsPeerConfig;
+
+// Since the last tlsPeerReset(). Times are micros()
+typedef struct
+{
+  uint32_t  accepted;
+  uint32_t  handshakes;
+  uint32_t  failures;         // handshake or record errors
+  uint32_t  resumed;          // abbreviated handshakes, with a session from the peer's cache
+  uint64_t  bytes_in;         // plaintext received
+  uint64_t  bytes_out;        // plaintext sent
+  uint64_t  hello_us;         // ClientHello parsed, in the last handshake
+  uint64_t  flight1_us;       // ServerHello .. ServerHelloDone handed to lwIP. Resumed: .. the server's Finished
+  uint64_t  flight2_us;       // the client's Finished parsed
+  uint64_t  handshake_us;     // end of the last handshake, the server's Finished handed to lwIP
+  uint64_t  last_in_us;       // last plaintext received
+  uint64_t  source_done_us;   // last source_bytes handed to lwIP
+  int       suite;            // negotiated in the last handshake
+} TlsPeerStats;
+
+// Loads the certificates and listens on 127.0.0.1. Call after asyncTcpSslHostBegin()
+bool  tlsPeerBegin(uint16_t port);
+
+void  tlsPeerSet(const TlsPeerConfig& config);
+void  tlsPeerReset();
+void  tlsPeerGetStats(TlsPeerStats& stats);
+
+#endif    // ASYNC_TCP_SSL_BENCH_TLS_PEER_H
@@ -0,0 +1,311 @@
+/****************************************************************************************************************************
+  tls_throughput.cpp
+
+  Host benchmark: sustained TLS upload and download through AsyncSSLClient over loopback, against the
+  mbedTLS peer of tls_peer.cpp. Upload goes through add() / send(), download through tcp_ssl_read()
+  and onData().
+
+  Sweeps cipher suite, Nagle (the client's and the peer's), application write size and TLS record
+  size, and prints one JSON object per run:
+
+    {"bench":"tls_throughput","version":"...","direction":"upload","suite":"TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256",
+     "nodelay":1,"write_size":4096,"record_size":1400,"bytes":1048576,"seconds":0.0815,"mb_per_s":12.866,
+     "records":750,"status":"ok"}
+
+  Each application write is split into records of record_size plaintext, one add() per record
+  (mbedtls_ssl_write() per record on the peer), followed by one send() (tcp_output() on the peer).
+  mb_per_s is plaintext, 10^6 bytes per second, from the end of the handshake to the last byte at the
+  receiver.
+
+    tls_throughput [--bytes N] [--quick]
+
+  --quick runs one suite with Nagle off. A record and its TLS overhead must fit in TCP_SND_BUF, so
+  records are 4096 bytes at most with include/lwipopts.h.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "AsyncTCP_SSL.hpp"
+#include "AsyncTCP_SSL_Host.h"
+
+#include "tls_peer.h"
+
+#include "mbedtls/ssl_ciphersuites.h"
+
+#define BENCH_PORT              8443
+#define BENCH_BYTES             (1024 * 1024)
+#define BENCH_TIMEOUT_MS        30000
+
+// Worst case TLS 1.2 record expansion of the suites below: header, CBC IV, SHA-384 MAC and padding
+#define BENCH_RECORD_OVERHEAD   96
+
+static const char * const bench_suites[] =
+{
+  "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256",
+  "TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256",
+  "TLS-ECDHE-RSA-WITH-CHACHA20-POLY1305-SHA256",
+  "TLS-ECDHE-RSA-WITH-AES-256-CBC-SHA384",
+};
+
+static const uint32_t bench_write_sizes[]   = { 1400, 4096, 16384 };
+static const uint32_t bench_record_sizes[]  = { 512, 1400, 4096 };
+
+static char bench_payload[4096];
+
+// One run at a time. Written by the async task in the client's callbacks, polled by main()
+static struct
+{
+  uint32_t          write_size;
+  uint32_t          record_size;
+  uint32_t          bytes;
+  uint32_t          to_add;       // upload: plaintext not yet added
+  uint32_t          write_left;   // upload: rest of the current application write
+  volatile uint32_t received;     // download: plaintext delivered to onData()
+  volatile uint64_t connected_us;
+  volatile uint64_t done_us;
+  volatile bool     disconnected;
+} bench_run;
+
+/////////////////////////////////////////////
+
+// Adds records while they fit in the send buffer, the next onAck() carries on
+static void benchPump(AsyncSSLClient* c)
+{
+  while (bench_run.to_add)
+  {
+    if (!bench_run.write_left)
+    {
+      bench_run.write_left = (bench_run.to_add < bench_run.write_size) ? bench_run.to_add : bench_run.write_size;
+    }
+
+    uint32_t piece = (bench_run.write_left < bench_run.record_size) ? bench_run.write_left : bench_run.record_size;
+
+    // mbedTLS must take the whole record in one go, a partial write fails the connection
+    if (c->space() < piece + BENCH_RECORD_OVERHEAD)
+    {
+      return;
+    }
+
+    if (c->add(bench_payload, piece) == 0)
+    {
+      return;
+    }
+
+    bench_run.write_left  -= piece;
+    bench_run.to_add      -= piece;
+
+    if (!bench_run.write_left)
+    {
+      c->send();
+    }
+  }
+}
+
+/////////////////////////////////////////////
+
+static void benchPrint(const char* direction, const char* suite, bool nodelay, uint32_t records,
+                       const char* status)
+{
+  double seconds = (bench_run.done_us > bench_run.connected_us) ?
+                   (bench_run.done_us - bench_run.connected_us) / 1e6 : 0;
+
+  // Longer than Serial.printf()'s buffer
+  printf("{\"bench\":\"tls_throughput\",\"version\":\"%s\",\"direction\":\"%s\",\"suite\":\"%s\","
+         "\"nodelay\":%d,\"write_size\":%u,\"record_size\":%u,\"bytes\":%u,\"seconds\":%.6f,"
+         "\"mb_per_s\":%.3f,\"records\":%u,\"status\":\"%s\"}\n",
+         ASYNC_TCP_SSL_VERSION, direction, suite, nodelay ? 1 : 0, bench_run.write_size,
+         bench_run.record_size, bench_run.bytes, seconds, seconds ? bench_run.bytes / seconds / 1e6 : 0,
+         records, status);
+  fflush(stdout);
+}
+
+/////////////////////////////////////////////
+
+static bool benchRun(bool upload, const char* suite_name, int suite, bool nodelay, uint32_t write_size,
+                     uint32_t record_size, uint32_t bytes)
+{
+  memset((void *) &bench_run, 0, sizeof(bench_run));
+
+  bench_run.write_size  = write_size;
+  bench_run.record_size = record_size;
+  bench_run.bytes       = bytes;
+  bench_run.to_add      = upload ? bytes : 0;
+
+  TlsPeerConfig config = { suite, nodelay, upload ? 0 : bytes, write_size, record_size };
+
+  tlsPeerSet(config);
+  tlsPeerReset();
+
+  AsyncSSLClient * client = new AsyncSSLClient();
+
+  client->setNoDelay(nodelay);
+
+  client->onConnect([](void* arg, AsyncSSLClient * c)
+  {
+    bench_run.connected_us = micros();
+    benchPump(c);
+  }, NULL);
+
+  client->onAck([](void* arg, AsyncSSLClient * c, size_t len, uint32_t time)
+  {
+    benchPump(c);
+  }, NULL);
+
+  client->onData([](void* arg, AsyncSSLClient * c, void* data, size_t len)
+  {
+    bench_run.received += len;
+
+    if (bench_run.received >= bench_run.bytes && !bench_run.done_us)
+    {
+      bench_run.done_us = micros();
+    }
+  }, NULL);
+
+  client->onDisconnect([](void* arg, AsyncSSLClient * c)
+  {
+    bench_run.disconnected = true;
+  }, NULL);
+
+  const char * status = "ok";
+
+  if (!client->connect(IPAddress(127, 0, 0, 1), BENCH_PORT, true))
+  {
+    status = "connect_failed";
+  }
+  else
+  {
+    TlsPeerStats  stats;
+    uint32_t      start = millis();
+
+    while (true)
+    {
+      tlsPeerGetStats(stats);
+
+      if (upload && stats.bytes_in >= bytes)
+      {
+        bench_run.done_us = stats.last_in_us;
+      }
+
+      if (bench_run.done_us)
+      {
+        break;
+      }
+
+      if (bench_run.disconnected || stats.failures)
+      {
+        status = "failed";
+        break;
+      }
+
+      if (millis() - start > BENCH_TIMEOUT_MS)
+      {
+        status = "timeout";
+        break;
+      }
+
+      delay(1);
+    }
+
+    // Download starts when the peer finished its side of the handshake
+    if (!upload && stats.handshake_us)
+    {
+      bench_run.connected_us = stats.handshake_us;
+    }
+  }
+
+#if ASYNC_TCP_SSL_METRICS
+  const AsyncSSLConnMetrics& metrics = client->getConnMetrics();
+  uint32_t records = upload ? metrics.tls.records_out : metrics.tls.records_in;
+#else
+  uint32_t records = 0;
+#endif
+
+  benchPrint(upload ? "upload" : "download", suite_name, nodelay, records, status);
+
+  client->close(true);
+
+  uint32_t start = millis();
+
+  while (!bench_run.disconnected && millis() - start < 1000)
+  {
+    delay(1);
+  }
+
+  delete client;
+
+  return (strcmp(status, "ok") == 0);
+}
+
+/////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+  uint32_t  bytes = BENCH_BYTES;
+  bool      quick = false;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--bytes") && i + 1 < argc)
+    {
+      bytes = strtoul(argv[++i], NULL, 0);
+    }
+    else if (!strcmp(argv[i], "--quick"))
+    {
+      quick = true;
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--bytes N] [--quick]\n", argv[0]);
+
+      return 2;
+    }
+  }
+
+  memset(bench_payload, 'x', sizeof(bench_payload));
+
+  if (asyncTcpSslHostBegin() != 0 || !tlsPeerBegin(BENCH_PORT))
+  {
+    fprintf(stderr, "start-up failed\n");
+
+    return 1;
+  }
+
+  int failures = 0;
+
+  for (size_t s = 0; s < (quick ? 1 : sizeof(bench_suites) / sizeof(bench_suites[0])); s++)
+  {
+    int suite = mbedtls_ssl_get_ciphersuite_id(bench_suites[s]);
+
+    if (suite == 0)
+    {
+      // Not in this mbedTLS configuration
+      continue;
+    }
+
+    for (int nodelay = quick ? 1 : 0; nodelay < 2; nodelay++)
+    {
+      for (uint32_t write_size : bench_write_sizes)
+      {
+        for (uint32_t record_size : bench_record_sizes)
+        {
+          if (record_size > write_size)
+          {
+            continue;
+          }
+
+          for (int upload = 1; upload >= 0; upload--)
+          {
+            if (!benchRun(upload, bench_suites[s], suite, nodelay, write_size, record_size, bytes))
+            {
+              failures++;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  return failures ? 1 : 0;
+}
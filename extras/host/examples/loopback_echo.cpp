@@ -0,0 +1,100 @@
+/****************************************************************************************************************************
+  loopback_echo.cpp
+
+  Host example: an AsyncSSLServer echoes what an AsyncSSLClient sends over lwIP's loopback
+  interface, then the library's metrics are printed. Plain TCP, the server side has no TLS.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "AsyncTCP_SSL.hpp"
+#include "AsyncTCP_SSL_Host.h"
+
+#define ECHO_PORT       8080
+#define ECHO_ROUNDS     100
+
+static const char     message[] = "Hello from AsyncTCP_SSL on the host";
+static volatile int   rounds    = 0;
+static volatile bool  done      = false;
+
+/////////////////////////////////////////////
+
+static void onServerClient(void* arg, AsyncSSLClient* client)
+{
+  client->onData([](void* arg, AsyncSSLClient * c, void* data, size_t len)
+  {
+    c->write((const char *) data, len);
+  }, NULL);
+
+  client->onDisconnect([](void* arg, AsyncSSLClient * c)
+  {
+    delete c;
+  }, NULL);
+}
+
+/////////////////////////////////////////////
+
+int main()
+{
+  if (asyncTcpSslHostBegin() != 0)
+  {
+    Serial.println("lwIP failed to start");
+
+    return 1;
+  }
+
+  Serial.println(ASYNC_TCP_SSL_VERSION);
+
+  AsyncSSLServer server(IPAddress(127, 0, 0, 1), ECHO_PORT);
+
+  server.onClient(onServerClient, NULL);
+  server.begin();
+
+  AsyncSSLClient client;
+
+  client.onConnect([](void* arg, AsyncSSLClient * c)
+  {
+    c->write(message, sizeof(message) - 1);
+  }, NULL);
+
+  client.onData([](void* arg, AsyncSSLClient * c, void* data, size_t len)
+  {
+    if (++rounds < ECHO_ROUNDS)
+      c->write(message, sizeof(message) - 1);
+    else
+      c->close();
+  }, NULL);
+
+  client.onDisconnect([](void* arg, AsyncSSLClient * c)
+  {
+    done = true;
+  }, NULL);
+
+  if (!client.connect(IPAddress(127, 0, 0, 1), ECHO_PORT))
+  {
+    Serial.println("connect failed");
+
+    return 1;
+  }
+
+  uint32_t start = millis();
+
+  while (!done && millis() - start < 10000)
+  {
+    delay(10);
+  }
+
+  AsyncSSLMetrics metrics = AsyncSSLClient::getMetrics();
+
+  Serial.printf("rounds %d, bytes out %u, bytes in %u, queue high water %u\n", rounds,
+                metrics.totals.bytes_out, metrics.totals.bytes_in, metrics.queue_high_water);
+
+  for (uint8_t i = 0; i < ASYNC_TCP_SSL_EVENT_TYPES; i++)
+  {
+    Serial.printf("  %-10s %u\n", AsyncSSLClient::eventToString(i), metrics.events[i]);
+  }
+
+  return (rounds == ECHO_ROUNDS) ? 0 : 1;
+}
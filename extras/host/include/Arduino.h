@@ -0,0 +1,180 @@
+/****************************************************************************************************************************
+  Arduino.h
+
+  Host shim: the part of the ESP32 Arduino core used by AsyncTCP_SSL and the host examples. Serial
+  prints to stdout.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_ARDUINO_H
+#define ASYNC_TCP_SSL_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+
+#define ARDUINO_BOARD   "POSIX host"
+
+#define DEC             10
+#define HEX             16
+#define OCT             8
+#define BIN             2
+
+unsigned long millis();
+unsigned long micros();
+void          delay(uint32_t ms);
+
+/////////////////////////////////////////////////
+
+class String
+{
+  public:
+    String(const char * str = "") : _str(str ? str : "") {}
+    String(const std::string& str) : _str(str) {}
+
+    const char *  c_str() const
+    {
+      return _str.c_str();
+    }
+
+    unsigned int  length() const
+    {
+      return _str.length();
+    }
+
+    String& operator += (const String& rhs)
+    {
+      _str += rhs._str;
+
+      return *this;
+    }
+
+    bool operator == (const String& rhs) const
+    {
+      return _str == rhs._str;
+    }
+
+  private:
+    std::string _str;
+};
+
+/////////////////////////////////////////////////
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t * buffer, size_t size);
+
+    size_t write(const char * str)
+    {
+      return str ? write((const uint8_t *) str, strlen(str)) : 0;
+    }
+
+    size_t print(const char * str);
+    size_t print(const String& str);
+    size_t print(char c);
+    size_t print(unsigned char value, int base = DEC);
+    size_t print(int value, int base = DEC);
+    size_t print(unsigned int value, int base = DEC);
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(long long value, int base = DEC);
+    size_t print(unsigned long long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+
+    size_t println();
+
+    template <typename T>
+    size_t println(const T& value)
+    {
+      return print(value) + println();
+    }
+
+    template <typename T>
+    size_t println(const T& value, int format)
+    {
+      return print(value, format) + println();
+    }
+
+    size_t printf(const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+  private:
+    size_t _print_number(unsigned long long value, int base, bool negative);
+};
+
+/////////////////////////////////////////////////
+
+class Stream : public Print
+{
+  public:
+    virtual int available()
+    {
+      return 0;
+    }
+
+    virtual int read()
+    {
+      return -1;
+    }
+
+    virtual size_t readBytes(char * buffer, size_t length)
+    {
+      size_t count = 0;
+
+      while (count < length)
+      {
+        int c = read();
+
+        if (c < 0)
+        {
+          break;
+        }
+
+        buffer[count++] = (char) c;
+      }
+
+      return count;
+    }
+};
+
+/////////////////////////////////////////////////
+
+class HardwareSerial : public Stream
+{
+  public:
+    void    begin(unsigned long baud) {}
+
+    size_t  write(uint8_t c);
+    size_t  write(const uint8_t * buffer, size_t size);
+
+    using Print::write;
+
+    operator bool() const
+    {
+      return true;
+    }
+};
+
+extern HardwareSerial Serial;
+
+#include "IPAddress.h"
+
+#endif    // ASYNC_TCP_SSL_HOST_ARDUINO_H
@@ -0,0 +1,28 @@
+/****************************************************************************************************************************
+  AsyncTCP_SSL_Host.h
+
+  Start-up of the host build, in place of what the ESP32 Arduino core and WiFi do on the device
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_H
+#define ASYNC_TCP_SSL_HOST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts lwIP's tcpip thread with the loopback interface, 127.0.0.1 and ::1. Call once before
+// using the library. Returns 0 on success
+int asyncTcpSslHostBegin(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif    // ASYNC_TCP_SSL_HOST_H
@@ -0,0 +1,77 @@
+/****************************************************************************************************************************
+  IPAddress.h
+
+  Host shim of the ESP32 Arduino core IPAddress, in network byte order like the original
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_IPADDRESS_H
+#define ASYNC_TCP_SSL_HOST_IPADDRESS_H
+
+#include <stdint.h>
+
+class String;
+
+class IPAddress
+{
+  public:
+    IPAddress()
+    {
+      _address.dword = 0;
+    }
+
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth)
+    {
+      _address.bytes[0] = first;
+      _address.bytes[1] = second;
+      _address.bytes[2] = third;
+      _address.bytes[3] = fourth;
+    }
+
+    IPAddress(uint32_t address)
+    {
+      _address.dword = address;
+    }
+
+    IPAddress(const uint8_t * address)
+    {
+      for (int i = 0; i < 4; i++)
+        _address.bytes[i] = address[i];
+    }
+
+    operator uint32_t() const
+    {
+      return _address.dword;
+    }
+
+    bool operator == (const IPAddress& addr) const
+    {
+      return _address.dword == addr._address.dword;
+    }
+
+    uint8_t operator [] (int index) const
+    {
+      return _address.bytes[index];
+    }
+
+    uint8_t& operator [] (int index)
+    {
+      return _address.bytes[index];
+    }
+
+    String toString() const;
+
+  private:
+    union
+    {
+      uint8_t   bytes[4];
+      uint32_t  dword;
+    } _address;
+};
+
+#endif    // ASYNC_TCP_SSL_HOST_IPADDRESS_H
@@ -0,0 +1,64 @@
+/****************************************************************************************************************************
+  IPv6Address.h
+
+  Host shim of the ESP32 Arduino core IPv6Address
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_IPV6ADDRESS_H
+#define ASYNC_TCP_SSL_HOST_IPV6ADDRESS_H
+
+#include <stdint.h>
+#include <string.h>
+
+class String;
+
+class IPv6Address
+{
+  public:
+    IPv6Address()
+    {
+      memset(_address.bytes, 0, sizeof(_address.bytes));
+    }
+
+    IPv6Address(const uint8_t * address)
+    {
+      memcpy(_address.bytes, address, sizeof(_address.bytes));
+    }
+
+    IPv6Address(const uint32_t * address)
+    {
+      memcpy(_address.bytes, address, sizeof(_address.bytes));
+    }
+
+    operator const uint8_t * () const
+    {
+      return _address.bytes;
+    }
+
+    operator const uint32_t * () const
+    {
+      return _address.dword;
+    }
+
+    bool operator == (const IPv6Address& addr) const
+    {
+      return memcmp(_address.bytes, addr._address.bytes, sizeof(_address.bytes)) == 0;
+    }
+
+    String toString() const;
+
+  private:
+    union
+    {
+      uint8_t   bytes[16];
+      uint32_t  dword[4];
+    } _address;
+};
+
+#endif    // ASYNC_TCP_SSL_HOST_IPV6ADDRESS_H
@@ -0,0 +1,21 @@
+/****************************************************************************************************************************
+  esp_err.h
+
+  Host shim of the ESP-IDF error codes
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_ESP_ERR_H
+#define ASYNC_TCP_SSL_HOST_ESP_ERR_H
+
+typedef int esp_err_t;
+
+#define ESP_OK          0
+#define ESP_FAIL        -1
+
+#endif    // ASYNC_TCP_SSL_HOST_ESP_ERR_H
@@ -0,0 +1,34 @@
+/****************************************************************************************************************************
+  esp_task_wdt.h
+
+  Host shim: there is no task watchdog, subscribing always succeeds
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_ESP_TASK_WDT_H
+#define ASYNC_TCP_SSL_HOST_ESP_TASK_WDT_H
+
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+static inline esp_err_t esp_task_wdt_add(TaskHandle_t task)
+{
+  return ESP_OK;
+}
+
+static inline esp_err_t esp_task_wdt_delete(TaskHandle_t task)
+{
+  return ESP_OK;
+}
+
+static inline esp_err_t esp_task_wdt_reset(void)
+{
+  return ESP_OK;
+}
+
+#endif    // ASYNC_TCP_SSL_HOST_ESP_TASK_WDT_H
@@ -0,0 +1,28 @@
+/****************************************************************************************************************************
+  esp_timer.h
+
+  Host shim: microseconds since an arbitrary point, from CLOCK_MONOTONIC
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_ESP_TIMER_H
+#define ASYNC_TCP_SSL_HOST_ESP_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+static inline int64_t esp_timer_get_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif    // ASYNC_TCP_SSL_HOST_ESP_TIMER_H
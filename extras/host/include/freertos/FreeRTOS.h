@@ -0,0 +1,68 @@
+/****************************************************************************************************************************
+  freertos/FreeRTOS.h
+
+  Host shim: the part of the FreeRTOS / ESP-IDF port API used by AsyncTCP_SSL, on POSIX threads.
+  Ticks are milliseconds, priorities and core affinity are accepted and ignored.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_FREERTOS_H
+#define ASYNC_TCP_SSL_HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int           BaseType_t;
+typedef unsigned int  UBaseType_t;
+typedef uint32_t      TickType_t;
+
+typedef struct host_task *      TaskHandle_t;
+typedef struct host_queue *     QueueHandle_t;
+typedef struct host_semaphore * SemaphoreHandle_t;
+typedef QueueHandle_t           xQueueHandle;
+
+typedef void (* TaskFunction_t)(void *);
+
+#define pdPASS                  1
+#define pdFAIL                  0
+#define pdTRUE                  1
+#define pdFALSE                 0
+
+#define configTICK_RATE_HZ      1000
+#define portTICK_PERIOD_MS      (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY           ((TickType_t) 0xFFFFFFFFUL)
+#define pdMS_TO_TICKS(ms)       ((TickType_t) (ms))
+
+#define tskIDLE_PRIORITY        0
+#define tskNO_AFFINITY          0x7FFFFFFF
+
+/////////////////////////////////////////////////
+
+// ESP-IDF spinlocks nest on the same core, a recursive mutex does the same on the host
+typedef struct
+{
+  pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED    { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+
+#define portENTER_CRITICAL(mux)         pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux)          pthread_mutex_unlock(&(mux)->mutex)
+#define portENTER_CRITICAL_ISR(mux)     portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux)      portEXIT_CRITICAL(mux)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif    // ASYNC_TCP_SSL_HOST_FREERTOS_H
@@ -0,0 +1,35 @@
+/****************************************************************************************************************************
+  freertos/queue.h
+
+  Host shim, see freertos/FreeRTOS.h. Items are copied, like in FreeRTOS.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_QUEUE_H
+#define ASYNC_TCP_SSL_HOST_QUEUE_H
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+void          vQueueDelete(QueueHandle_t queue);
+BaseType_t    xQueueSend(QueueHandle_t queue, const void * item, TickType_t ticks);
+BaseType_t    xQueueSendToBack(QueueHandle_t queue, const void * item, TickType_t ticks);
+BaseType_t    xQueueSendToFront(QueueHandle_t queue, const void * item, TickType_t ticks);
+BaseType_t    xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticks);
+BaseType_t    xQueuePeek(QueueHandle_t queue, void * item, TickType_t ticks);
+UBaseType_t   uxQueueMessagesWaiting(QueueHandle_t queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif    // ASYNC_TCP_SSL_HOST_QUEUE_H
@@ -0,0 +1,41 @@
+/****************************************************************************************************************************
+  freertos/task.h
+
+  Host shim, see freertos/FreeRTOS.h. A task is a detached pthread.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_TASK_H
+#define ASYNC_TCP_SSL_HOST_TASK_H
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+BaseType_t    xTaskCreateUniversal(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+                                   UBaseType_t priority, TaskHandle_t * handle, BaseType_t core);
+BaseType_t    xTaskCreatePinnedToCore(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+                                      UBaseType_t priority, TaskHandle_t * handle, BaseType_t core);
+BaseType_t    xTaskCreate(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+                          UBaseType_t priority, TaskHandle_t * handle);
+void          vTaskDelete(TaskHandle_t task);
+void          vTaskDelay(TickType_t ticks);
+TaskHandle_t  xTaskGetCurrentTaskHandle(void);
+char *        pcTaskGetTaskName(TaskHandle_t task);
+TickType_t    xTaskGetTickCount(void);
+
+BaseType_t    xTaskNotifyGive(TaskHandle_t task);
+uint32_t      ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif    // ASYNC_TCP_SSL_HOST_TASK_H
@@ -0,0 +1,76 @@
+/****************************************************************************************************************************
+  lwipopts.h
+
+  lwIP options of the host build: the unix port with its tcpip thread and a loopback interface only.
+  TCP buffers follow the ESP32 Arduino core defaults, so that loopback numbers compare to the device.
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_LWIPOPTS_H
+#define ASYNC_TCP_SSL_HOST_LWIPOPTS_H
+
+#include <stdlib.h>
+
+#define NO_SYS                          0
+#define SYS_LIGHTWEIGHT_PROT            1
+#define LWIP_TCPIP_CORE_LOCKING         1
+
+// Like on ESP32, where the check is off by default, the library sets tcp_arg() & co. from its async task
+#define LWIP_ASSERT_CORE_LOCKED()
+#define LWIP_SOCKET                     0
+#define LWIP_NETCONN                    0
+#define LWIP_NETIF_API                  0
+
+#define LWIP_IPV4                       1
+#define LWIP_IPV6                       1
+#define LWIP_TCP                        1
+#define LWIP_UDP                        1
+#define LWIP_DNS                        1
+#define LWIP_ICMP                       1
+
+// "localhost" resolves without a DNS server
+#define DNS_LOCAL_HOSTLIST              1
+#define DNS_LOCAL_HOSTLIST_INIT         { DNS_LOCAL_HOSTLIST_ELEM("localhost", IPADDR4_INIT_BYTES(127, 0, 0, 1)) }
+
+#define LWIP_HAVE_LOOPIF                1
+#define LWIP_NETIF_LOOPBACK             1
+#define LWIP_LOOPBACK_MAX_PBUFS         0
+
+#define MEM_ALIGNMENT                   8
+#define MEM_SIZE                        (4 * 1024 * 1024)
+#define PBUF_POOL_SIZE                  1024
+#define MEMP_NUM_PBUF                   1024
+#define MEMP_NUM_TCP_PCB                64      // CONFIG_LWIP_MAX_ACTIVE_TCP in sdkconfig.h
+#define MEMP_NUM_TCP_PCB_LISTEN         16
+#define MEMP_NUM_TCP_SEG                2048
+#define MEMP_NUM_TCPIP_MSG_API          64
+#define MEMP_NUM_TCPIP_MSG_INPKT        256
+#define MEMP_NUM_SYS_TIMEOUT            (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 8)
+
+#define TCP_MSS                         1436
+#define TCP_SND_BUF                     5744
+#define TCP_WND                         5744
+#define TCP_SND_QUEUELEN                ((4 * (TCP_SND_BUF) + (TCP_MSS - 1)) / (TCP_MSS))
+#define TCP_LISTEN_BACKLOG              1
+#define LWIP_TCP_KEEPALIVE              1
+
+#define TCPIP_MBOX_SIZE                 256
+#define TCPIP_THREAD_STACKSIZE          65536
+#define TCPIP_THREAD_PRIO               1
+#define DEFAULT_THREAD_STACKSIZE        65536
+#define DEFAULT_RAW_RECVMBOX_SIZE       64
+#define DEFAULT_UDP_RECVMBOX_SIZE       64
+#define DEFAULT_TCP_RECVMBOX_SIZE       64
+#define DEFAULT_ACCEPTMBOX_SIZE         64
+
+#define LWIP_RAND()                     ((u32_t) rand())
+
+#define LWIP_STATS                      0
+#define LWIP_DEBUG                      0
+
+#endif    // ASYNC_TCP_SSL_HOST_LWIPOPTS_H
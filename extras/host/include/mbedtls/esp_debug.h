@@ -0,0 +1,13 @@
+/****************************************************************************************************************************
+  mbedtls/esp_debug.h
+
+  Host shim: ESP-IDF's mbedtls debug hook, mbedtls_debug_set_threshold() and the config's f_dbg do the same on a PC
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#define mbedtls_esp_enable_debug_log(conf, threshold)
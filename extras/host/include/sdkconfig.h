@@ -0,0 +1,23 @@
+/****************************************************************************************************************************
+  sdkconfig.h
+
+  Host shim: the ESP-IDF options AsyncTCP_SSL reads, matching include/lwipopts.h
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
+
+#ifndef ASYNC_TCP_SSL_HOST_SDKCONFIG_H
+#define ASYNC_TCP_SSL_HOST_SDKCONFIG_H
+
+#define CONFIG_LWIP_MAX_ACTIVE_TCP      64
+#define CONFIG_LWIP_IPV6                1
+
+// No watchdog on the host
+#define CONFIG_ASYNC_TCP_RUNNING_CORE   -1
+#define CONFIG_ASYNC_TCP_USE_WDT        0
+
+#endif    // ASYNC_TCP_SSL_HOST_SDKCONFIG_H
@@ -0,0 +1,11 @@
+/****************************************************************************************************************************
+  ssl_client.h
+
+  Host shim: WiFiClientSecure's header is included by AsyncTCP_SSL.hpp but nothing of it is used
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#pragma once
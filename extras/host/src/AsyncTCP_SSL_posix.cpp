@@ -0,0 +1,12 @@
+/****************************************************************************************************************************
+  AsyncTCP_SSL_posix.cpp
+
+  The one translation unit which includes AsyncTCP_SSL.h, as a sketch would. Host programs include
+  AsyncTCP_SSL.hpp, see examples/multiFileProject
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "AsyncTCP_SSL.h"
@@ -0,0 +1,260 @@
+/****************************************************************************************************************************
+  arduino_posix.cpp
+
+  Host shim: time, Print / Serial and the IP address classes of the ESP32 Arduino core, see include/Arduino.h
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "Arduino.h"
+#include "IPv6Address.h"
+
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////
+
+HardwareSerial Serial;
+
+/////////////////////////////////////////////
+
+static uint64_t _now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Like on the ESP32, time counts from start-up
+static const uint64_t _boot_us = _now_us();
+
+/////////////////////////////////////////////
+
+unsigned long millis()
+{
+  return (unsigned long) ((_now_us() - _boot_us) / 1000);
+}
+
+/////////////////////////////////////////////
+
+unsigned long micros()
+{
+  return (unsigned long) (_now_us() - _boot_us);
+}
+
+/////////////////////////////////////////////
+
+void delay(uint32_t ms)
+{
+  vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Print
+ * */
+
+size_t Print::write(const uint8_t * buffer, size_t size)
+{
+  size_t n = 0;
+
+  while (size--)
+  {
+    n += write(*buffer++);
+  }
+
+  return n;
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(const char * str)
+{
+  return write(str);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(const String& str)
+{
+  return write(str.c_str());
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(char c)
+{
+  return write((uint8_t) c);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::_print_number(unsigned long long value, int base, bool negative)
+{
+  char buf[8 * sizeof(value) + 2];
+  char * str = &buf[sizeof(buf) - 1];
+
+  if (base < 2)
+  {
+    base = 10;
+  }
+
+  *str = '\0';
+
+  do
+  {
+    int digit = value % base;
+
+    *--str = (digit < 10) ? '0' + digit : 'A' + digit - 10;
+    value /= base;
+  } while (value);
+
+  if (negative)
+  {
+    *--str = '-';
+  }
+
+  return write(str);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(unsigned char value, int base)
+{
+  return _print_number(value, base, false);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(int value, int base)
+{
+  return (base == DEC) ? print((long long) value, base) : _print_number((unsigned int) value, base, false);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(unsigned int value, int base)
+{
+  return _print_number(value, base, false);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(long value, int base)
+{
+  return (base == DEC) ? print((long long) value, base) : _print_number((unsigned long) value, base, false);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(unsigned long value, int base)
+{
+  return _print_number(value, base, false);
+}
+
+/////////////////////////////////////////////
+
+// Negative numbers only get a sign in decimal, other bases print the two's complement of the type like Arduino
+size_t Print::print(long long value, int base)
+{
+  if (base == DEC && value < 0)
+  {
+    return _print_number(0ULL - (unsigned long long) value, base, true);
+  }
+
+  return _print_number((unsigned long long) value, base, false);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(unsigned long long value, int base)
+{
+  return _print_number(value, base, false);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::print(double value, int digits)
+{
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "%.*f", digits, value);
+
+  return write(buf);
+}
+
+/////////////////////////////////////////////
+
+size_t Print::println()
+{
+  return write("\r\n");
+}
+
+/////////////////////////////////////////////
+
+size_t Print::printf(const char * format, ...)
+{
+  char    buf[256];
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+
+  if (len < 0)
+  {
+    return 0;
+  }
+
+  return write((const uint8_t *) buf, ((size_t) len < sizeof(buf)) ? len : sizeof(buf) - 1);
+}
+
+/////////////////////////////////////////////
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return write(&c, 1);
+}
+
+/////////////////////////////////////////////
+
+size_t HardwareSerial::write(const uint8_t * buffer, size_t size)
+{
+  return fwrite(buffer, 1, size, stdout);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   IP Addresses
+ * */
+
+String IPAddress::toString() const
+{
+  char buf[16];
+
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", _address.bytes[0], _address.bytes[1], _address.bytes[2], _address.bytes[3]);
+
+  return String(buf);
+}
+
+/////////////////////////////////////////////
+
+String IPv6Address::toString() const
+{
+  char buf[40];
+
+  snprintf(buf, sizeof(buf), "%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x",
+           _address.bytes[0], _address.bytes[1], _address.bytes[2], _address.bytes[3],
+           _address.bytes[4], _address.bytes[5], _address.bytes[6], _address.bytes[7],
+           _address.bytes[8], _address.bytes[9], _address.bytes[10], _address.bytes[11],
+           _address.bytes[12], _address.bytes[13], _address.bytes[14], _address.bytes[15]);
+
+  return String(buf);
+}
@@ -0,0 +1,543 @@
+/****************************************************************************************************************************
+  freertos_posix.cpp
+
+  Host shim: FreeRTOS tasks, queues and semaphores on POSIX threads, see include/freertos/FreeRTOS.h
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <time.h>
+
+/////////////////////////////////////////////
+
+struct host_task
+{
+  std::string             name;
+  TaskFunction_t          fn;
+  void *                  arg;
+  pthread_t               thread;
+
+  std::mutex              lock;
+  std::condition_variable notified;
+  uint32_t                notify_count;
+};
+
+struct host_queue
+{
+  std::mutex              lock;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<std::vector<uint8_t>> items;
+  size_t                  length;
+  size_t                  item_size;
+};
+
+struct host_semaphore
+{
+  std::mutex              lock;
+  std::condition_variable available;
+  UBaseType_t             count;
+  UBaseType_t             max_count;
+  bool                    mutex;        // owned by the taker
+  TaskHandle_t            owner;
+  UBaseType_t             depth;        // recursive takes by the owner
+};
+
+/////////////////////////////////////////////
+
+static thread_local host_task * _current_task = NULL;
+
+// Waits until pred() holds or the ticks ran out. portMAX_DELAY waits forever
+template <typename Pred>
+static bool _wait(std::unique_lock<std::mutex>& lock, std::condition_variable& cond, TickType_t ticks, Pred pred)
+{
+  if (ticks == portMAX_DELAY)
+  {
+    cond.wait(lock, pred);
+
+    return true;
+  }
+
+  return cond.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), pred);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Tasks
+ * */
+
+static void * _task_entry(void * param)
+{
+  host_task * task = (host_task *) param;
+
+  _current_task = task;
+
+  pthread_setname_np(pthread_self(), task->name.substr(0, 15).c_str());
+
+  task->fn(task->arg);
+
+  // A FreeRTOS task must not return, treat it like vTaskDelete(NULL)
+  return NULL;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xTaskCreateUniversal(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+                                UBaseType_t priority, TaskHandle_t * handle, BaseType_t core)
+{
+  host_task * task = new host_task();
+
+  task->name          = name ? name : "";
+  task->fn            = fn;
+  task->arg           = arg;
+  task->notify_count  = 0;
+
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  // FreeRTOS counts the stack in bytes on ESP32, leave some room for the host's larger frames
+  pthread_attr_setstacksize(&attr, (stack < 16384 ? 16384 : stack) * 2);
+
+  if (handle)
+  {
+    *handle = task;
+  }
+
+  if (pthread_create(&task->thread, &attr, _task_entry, task) != 0)
+  {
+    pthread_attr_destroy(&attr);
+
+    if (handle)
+    {
+      *handle = NULL;
+    }
+
+    delete task;
+
+    return pdFAIL;
+  }
+
+  pthread_attr_destroy(&attr);
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+                                   UBaseType_t priority, TaskHandle_t * handle, BaseType_t core)
+{
+  return xTaskCreateUniversal(fn, name, stack, arg, priority, handle, core);
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char * name, uint32_t stack, void * arg,
+                       UBaseType_t priority, TaskHandle_t * handle)
+{
+  return xTaskCreateUniversal(fn, name, stack, arg, priority, handle, tskNO_AFFINITY);
+}
+
+/////////////////////////////////////////////
+
+// Only deleting the calling task is supported, which is all the library does
+void vTaskDelete(TaskHandle_t task)
+{
+  if (!task || task == _current_task)
+  {
+    pthread_exit(NULL);
+  }
+}
+
+/////////////////////////////////////////////
+
+void vTaskDelay(TickType_t ticks)
+{
+  if (!ticks)
+  {
+    sched_yield();
+
+    return;
+  }
+
+  struct timespec ts;
+
+  ts.tv_sec  = (ticks * portTICK_PERIOD_MS) / 1000;
+  ts.tv_nsec = ((ticks * portTICK_PERIOD_MS) % 1000) * 1000000L;
+
+  while (nanosleep(&ts, &ts) != 0)
+    ;
+}
+
+/////////////////////////////////////////////
+
+// Threads not started by xTaskCreate(), main() and the lwIP thread, get a handle on first use
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  if (!_current_task)
+  {
+    char name[16] = "";
+
+    _current_task = new host_task();
+    _current_task->fn           = NULL;
+    _current_task->arg          = NULL;
+    _current_task->thread       = pthread_self();
+    _current_task->notify_count = 0;
+
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    _current_task->name = name;
+  }
+
+  return _current_task;
+}
+
+/////////////////////////////////////////////
+
+char * pcTaskGetTaskName(TaskHandle_t task)
+{
+  if (!task)
+  {
+    task = xTaskGetCurrentTaskHandle();
+  }
+
+  return (char *) task->name.c_str();
+}
+
+/////////////////////////////////////////////
+
+TickType_t xTaskGetTickCount(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (TickType_t) (ts.tv_sec * configTICK_RATE_HZ + ts.tv_nsec / (1000000000L / configTICK_RATE_HZ));
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  {
+    std::lock_guard<std::mutex> guard(task->lock);
+
+    task->notify_count++;
+  }
+
+  task->notified.notify_one();
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+  host_task * task = xTaskGetCurrentTaskHandle();
+
+  std::unique_lock<std::mutex> lock(task->lock);
+
+  _wait(lock, task->notified, ticks, [task] { return task->notify_count > 0; });
+
+  uint32_t count = task->notify_count;
+
+  if (count)
+  {
+    task->notify_count = clear ? 0 : count - 1;
+  }
+
+  return count;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Queues
+ * */
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  host_queue * queue = new host_queue();
+
+  queue->length     = length;
+  queue->item_size  = item_size;
+
+  return queue;
+}
+
+/////////////////////////////////////////////
+
+void vQueueDelete(QueueHandle_t queue)
+{
+  delete queue;
+}
+
+/////////////////////////////////////////////
+
+static BaseType_t _queue_send(QueueHandle_t queue, const void * item, TickType_t ticks, bool front)
+{
+  std::unique_lock<std::mutex> lock(queue->lock);
+
+  if (!_wait(lock, queue->not_full, ticks, [queue] { return queue->items.size() < queue->length; }))
+  {
+    return pdFAIL;
+  }
+
+  std::vector<uint8_t> copy((const uint8_t *) item, (const uint8_t *) item + queue->item_size);
+
+  if (front)
+    queue->items.push_front(std::move(copy));
+  else
+    queue->items.push_back(std::move(copy));
+
+  lock.unlock();
+  queue->not_empty.notify_one();
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void * item, TickType_t ticks)
+{
+  return _queue_send(queue, item, ticks, false);
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void * item, TickType_t ticks)
+{
+  return _queue_send(queue, item, ticks, false);
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void * item, TickType_t ticks)
+{
+  return _queue_send(queue, item, ticks, true);
+}
+
+/////////////////////////////////////////////
+
+static BaseType_t _queue_receive(QueueHandle_t queue, void * item, TickType_t ticks, bool remove)
+{
+  std::unique_lock<std::mutex> lock(queue->lock);
+
+  if (!_wait(lock, queue->not_empty, ticks, [queue] { return !queue->items.empty(); }))
+  {
+    return pdFAIL;
+  }
+
+  memcpy(item, queue->items.front().data(), queue->item_size);
+
+  if (!remove)
+  {
+    return pdPASS;
+  }
+
+  queue->items.pop_front();
+
+  lock.unlock();
+  queue->not_full.notify_one();
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticks)
+{
+  return _queue_receive(queue, item, ticks, true);
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void * item, TickType_t ticks)
+{
+  return _queue_receive(queue, item, ticks, false);
+}
+
+/////////////////////////////////////////////
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  std::lock_guard<std::mutex> guard(queue->lock);
+
+  return queue->items.size();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Semaphores
+ * */
+
+static SemaphoreHandle_t _semaphore_new(UBaseType_t max_count, UBaseType_t initial_count, bool mutex)
+{
+  host_semaphore * sem = new host_semaphore();
+
+  sem->count      = initial_count;
+  sem->max_count  = max_count;
+  sem->mutex      = mutex;
+  sem->owner      = NULL;
+  sem->depth      = 0;
+
+  return sem;
+}
+
+/////////////////////////////////////////////
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+  return _semaphore_new(1, 0, false);
+}
+
+/////////////////////////////////////////////
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+  return _semaphore_new(1, 1, true);
+}
+
+/////////////////////////////////////////////
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+  return _semaphore_new(1, 1, true);
+}
+
+/////////////////////////////////////////////
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+  return _semaphore_new(max_count, initial_count, false);
+}
+
+/////////////////////////////////////////////
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+  delete sem;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(sem->lock);
+
+  if (!_wait(lock, sem->available, ticks, [sem] { return sem->count > 0; }))
+  {
+    return pdFAIL;
+  }
+
+  sem->count--;
+
+  if (sem->mutex)
+  {
+    sem->owner = xTaskGetCurrentTaskHandle();
+  }
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+  {
+    std::lock_guard<std::mutex> guard(sem->lock);
+
+    if (sem->count >= sem->max_count)
+    {
+      return pdFAIL;
+    }
+
+    sem->count++;
+    sem->owner = NULL;
+  }
+
+  sem->available.notify_one();
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+  std::unique_lock<std::mutex> lock(sem->lock);
+
+  if (sem->owner == self)
+  {
+    sem->depth++;
+
+    return pdPASS;
+  }
+
+  if (!_wait(lock, sem->available, ticks, [sem] { return sem->count > 0; }))
+  {
+    return pdFAIL;
+  }
+
+  sem->count--;
+  sem->owner = self;
+  sem->depth = 1;
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+  {
+    std::lock_guard<std::mutex> guard(sem->lock);
+
+    if (sem->owner != xTaskGetCurrentTaskHandle())
+    {
+      return pdFAIL;
+    }
+
+    if (--sem->depth)
+    {
+      return pdPASS;
+    }
+
+    sem->owner = NULL;
+    sem->count++;
+  }
+
+  sem->available.notify_one();
+
+  return pdPASS;
+}
+
+/////////////////////////////////////////////
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t sem)
+{
+  std::lock_guard<std::mutex> guard(sem->lock);
+
+  return sem->count;
+}
@@ -0,0 +1,48 @@
+/****************************************************************************************************************************
+  lwip_posix.c
+
+  Host start-up: lwIP runs its tcpip thread from the unix port, see include/AsyncTCP_SSL_Host.h
+
+  AsyncTCP_SSL is a library for ESP32
+
+  Built by Khoi Hoang https://github.com/khoih-prog/AsyncTCP_SSL
+ *****************************************************************************************************************************/
+
+#include "AsyncTCP_SSL_Host.h"
+
+#include "lwip/tcpip.h"
+#include "lwip/sys.h"
+
+/////////////////////////////////////////////
+
+static void _tcpip_ready(void * arg)
+{
+  sys_sem_signal((sys_sem_t *) arg);
+}
+
+/////////////////////////////////////////////
+
+int asyncTcpSslHostBegin(void)
+{
+  static int started = 0;
+  sys_sem_t  ready;
+
+  if (started)
+  {
+    return 0;
+  }
+
+  if (sys_sem_new(&ready, 0) != ERR_OK)
+  {
+    return -1;
+  }
+
+  // lwip_init() inside adds the loopback netif, no other interface is needed
+  tcpip_init(_tcpip_ready, &ready);
+  sys_sem_wait(&ready);
+  sys_sem_free(&ready);
+
+  started = 1;
+
+  return 0;
+}
@@ -50,7 +50,8 @@
 #ifndef ASYNCTCP_SSL_HPP
 #define ASYNCTCP_SSL_HPP
 
-#if !defined(ESP32)
+// ASYNC_TCP_SSL_HOST builds against the POSIX shims of extras/host, for tests and benchmarks on a PC
+#if !( defined(ESP32) || defined(ASYNC_TCP_SSL_HOST) )
   #error This AsyncTCP_SSL library is supporting only ESP32
 #endif
 
@@ -72,6 +73,7 @@
 #include "sdkconfig.h"
 #include <functional>
 #include <string>
+#include <new>
 
 // in ./libraries/WiFiClientSecure/src/ssl_client.h for ESP32
 #include <ssl_client.h>
@@ -83,8 +85,13 @@ extern "C"
   #include "freertos/FreeRTOS.h"
   #include "freertos/semphr.h"
   #include "lwip/pbuf.h"
+  #include "lwip/ip_addr.h"
 }
 
+#if LWIP_IPV6
+  #include "IPv6Address.h"
+#endif
+
 #include "AsyncTCP_SSL_Debug.h"
 
 /*****************************************************
@@ -117,11 +124,136 @@ enum tcp_state
 
 /////////////////////////////////////////////////
 
-// Make ASYNC_QUEUE_LENGTH adjustable in sketch. Default 512
+// Make ASYNC_QUEUE_LENGTH adjustable in sketch. Default 512, for the normal priority class
 #ifndef ASYNC_QUEUE_LENGTH
   #define ASYNC_QUEUE_LENGTH 		512
 #endif
 
+// Queues of the interactive and bulk classes. Connection events go to the scheduler entries, so these
+// only carry the DNS results of their clients and, interactive, LWIP_TCP_CLEAR. Default 64 and 32
+#ifndef ASYNC_QUEUE_LENGTH_INTERACTIVE
+  #define ASYNC_QUEUE_LENGTH_INTERACTIVE  64
+#endif
+
+#ifndef ASYNC_QUEUE_LENGTH_BULK
+  #define ASYNC_QUEUE_LENGTH_BULK         32
+#endif
+
+// Event priority classes, see AsyncSSLClient::setPriority(). The async task serves interactive
+// events first, then normal, then bulk
+#define ASYNC_PRIORITY_NORMAL         0
+#define ASYNC_PRIORITY_INTERACTIVE    1
+#define ASYNC_PRIORITY_BULK           2
+#define ASYNC_PRIORITY_CLASSES        3
+
+// A class with events waiting is served anyway after higher ones went ahead of it this many times
+// in a row, so bulk transfers slow down but don't stall. Default 8
+#ifndef ASYNC_TCP_SSL_PRIORITY_AGING
+  #define ASYNC_TCP_SSL_PRIORITY_AGING  8
+#endif
+
+// Within a class, connections take turns. Each turn allows this many bytes of received data, other
+// events count ASYNC_TCP_SSL_EVENT_COST bytes each. Default 4096
+#ifndef ASYNC_TCP_SSL_QUANTUM
+  #define ASYNC_TCP_SSL_QUANTUM         4096
+#endif
+
+#ifndef ASYNC_TCP_SSL_EVENT_COST
+  #define ASYNC_TCP_SSL_EVENT_COST      64
+#endif
+
+// Connections with events waiting that get their own turns. Any more share the last one
+#ifndef ASYNC_TCP_SSL_SCHED_ENTRIES
+  #define ASYNC_TCP_SSL_SCHED_ENTRIES   (2 * CONFIG_LWIP_MAX_ACTIVE_TCP)
+#endif
+
+// Events a connection may have waiting before its received data is left with lwIP, which offers it
+// again later and so slows the peer down. Default 32
+#ifndef ASYNC_TCP_SSL_SCHED_EVENTS
+  #define ASYNC_TCP_SSL_SCHED_EVENTS    32
+#endif
+
+// Library-wide DNS result cache, shared by all AsyncSSLClient. Default 8 names, 0 to disable
+#ifndef ASYNC_DNS_CACHE_SIZE
+  #define ASYNC_DNS_CACHE_SIZE      8
+#endif
+
+// Longer host names bypass the cache. Default 64
+#ifndef ASYNC_DNS_CACHE_NAME_LEN
+  #define ASYNC_DNS_CACHE_NAME_LEN  64
+#endif
+
+// Clients accepted by AsyncSSLServer come from a static pool of this many objects instead of the heap.
+// Connections beyond it are refused. Default 0, pool disabled
+#ifndef ASYNC_TCP_SSL_CLIENT_POOL_SIZE
+  #define ASYNC_TCP_SSL_CLIENT_POOL_SIZE    0
+#endif
+
+// Max TLS handshakes in flight library-wide, further secure connects wait in FIFO order. Default 0, no limit
+#ifndef ASYNC_TCP_SSL_MAX_HANDSHAKES
+  #define ASYNC_TCP_SSL_MAX_HANDSHAKES      0
+#endif
+
+// How long a connection may wait for its handshake turn, in milliseconds. Default 10000
+#ifndef ASYNC_TCP_SSL_HANDSHAKE_WAIT
+  #define ASYNC_TCP_SSL_HANDSHAKE_WAIT      10000
+#endif
+
+// Resolution of the rx, ack and handshake timeouts in milliseconds. Default 50
+#ifndef ASYNC_TCP_SSL_TIMER_TICK
+  #define ASYNC_TCP_SSL_TIMER_TICK          50
+#endif
+
+// Slots of the timer wheel, longer timeouts take several turns. Default 64
+#ifndef ASYNC_TCP_SSL_TIMER_SLOTS
+  #define ASYNC_TCP_SSL_TIMER_SLOTS         64
+#endif
+
+// Per-connection traffic and handshake counters, see AsyncSSLClient::getConnMetrics(). The global
+// counters of AsyncSSLClient::getMetrics() are always kept. Default 1
+#ifndef ASYNC_TCP_SSL_METRICS
+  #define ASYNC_TCP_SSL_METRICS             1
+#endif
+
+// Buckets of the per event type dispatch latency histograms, see AsyncSSLClient::getEventLatency().
+// Bucket i counts [2^(i-1), 2^i) microseconds, so 20 reach beyond 250 ms. Default 20, 0 disables
+#ifndef ASYNC_TCP_SSL_LATENCY_BUCKETS
+  #define ASYNC_TCP_SSL_LATENCY_BUCKETS     20
+#endif
+
+// Default listen backlog of AsyncSSLServer, see AsyncSSLServer::setBacklog()
+#ifndef ASYNC_TCP_SSL_SERVER_BACKLOG
+  #define ASYNC_TCP_SSL_SERVER_BACKLOG      5
+#endif
+
+// Number of address families a client may resolve and connect over
+#if LWIP_IPV6
+  #define ASYNC_IP_FAMILIES         2
+#else
+  #define ASYNC_IP_FAMILIES         1
+#endif
+
+#define ASYNC_IP_FAMILY_V4          0
+#define ASYNC_IP_FAMILY_V6          1
+
+// connect(host) resolves IPv6 and IPv4 in parallel and races a connect attempt per family,
+// the first one to connect wins. Default on when lwIP has IPv6
+#ifndef ASYNC_TCP_SSL_HAPPY_EYEBALLS
+  #define ASYNC_TCP_SSL_HAPPY_EYEBALLS    LWIP_IPV6
+#endif
+
+// RFC 8305 Connection Attempt Delay: the attempt over the other family waits this long for the first
+// one to connect, in ms. Default 250
+#ifndef ASYNC_TCP_SSL_ATTEMPT_DELAY
+  #define ASYNC_TCP_SSL_ATTEMPT_DELAY     250
+#endif
+
+#if (ASYNC_TCP_SSL_HAPPY_EYEBALLS && !LWIP_IPV6)
+  #undef ASYNC_TCP_SSL_HAPPY_EYEBALLS
+  #define ASYNC_TCP_SSL_HAPPY_EYEBALLS    0
+  #warning ASYNC_TCP_SSL_HAPPY_EYEBALLS needs LWIP_IPV6, disabled
+#endif
+
 // Make ASYNC_TCP_PRIORITY user-adjustable in sketch. Default 10, can't be less than 4
 #if !defined(CONFIG_ASYNC_TCP_PRIORITY)
   #define CONFIG_ASYNC_TCP_PRIORITY 	(10)
@@ -138,21 +270,214 @@ enum tcp_state
 #define ASYNC_WRITE_FLAG_MORE   0x02    //will not send PSH flag, meaning that there should be more data to be sent before the application should react.
 #define SSL_HANDSHAKE_TIMEOUT   5000    // timeout to complete SSL handshake
 
+// Upper bound of sizeof(AsyncSSLClient), checked at compile time. In pointer-sized words, so it also holds on 64-bit hosts
+#ifndef ASYNC_TCP_SSL_CLIENT_SIZE_BUDGET
+  #define ASYNC_TCP_SSL_CLIENT_SIZE_BUDGET    (32 * sizeof(void*))
+#endif
+
+// Pending write completion tokens per client, see AsyncSSLClient::add(). Past that, the newest token
+// also stands for the writes before it, which get no onWriteComplete() of their own
+#ifndef ASYNC_TCP_SSL_WRITE_TOKENS
+  #define ASYNC_TCP_SSL_WRITE_TOKENS          8
+#endif
+
+// Plaintext per record of AsyncSSLClient::stream() at most, the size of its staging buffer
+#ifndef ASYNC_TCP_SSL_STREAM_CHUNK
+  #define ASYNC_TCP_SSL_STREAM_CHUNK          2048
+#endif
+
+// Define to 1 to have the compiler print sizeof(AsyncSSLClient) as a warning
+#ifndef ASYNC_TCP_SSL_SIZE_REPORT
+  #define ASYNC_TCP_SSL_SIZE_REPORT           0
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////////////////
 
 class AsyncSSLClient;
 
+// End of a write in the connection's outgoing TCP stream, ciphertext and handshake included. Compare
+// tokens with (int32_t) (a - b), they wrap around
+typedef uint32_t AsyncSSLWriteToken;
+
+// Token add() sets for 0-RTT data: the server may refuse it and get it again after the handshake, so it
+// has no end in the stream yet. writeComplete() is false for it
+#define ASYNC_WRITE_TOKEN_NONE    0
+
 typedef std::function<void(void*, AsyncSSLClient*)> AcConnectHandlerSSL;
 typedef std::function<void(void*, AsyncSSLClient*, size_t len, uint32_t time)> AcAckHandlerSSL;
 typedef std::function<void(void*, AsyncSSLClient*, int8_t error)> AcErrorHandlerSSL;
 typedef std::function<void(void*, AsyncSSLClient*, void *data, size_t len)> AcDataHandlerSSL;
 typedef std::function<void(void*, AsyncSSLClient*, struct pbuf *pb)> AcPacketHandlerSSL;
 typedef std::function<void(void*, AsyncSSLClient*, uint32_t time)> AcTimeoutHandlerSSL;
+typedef std::function<void(void*, AsyncSSLClient*, AsyncSSLWriteToken token)> AcWriteHandlerSSL;
+
+// stream() source: fills buf with up to len bytes and returns how many, 0 if it has none right now
+// (asked again on the next ACK or poll) or -1 at the end
+typedef std::function<int(void*, AsyncSSLClient*, uint8_t* buf, size_t len)> AcStreamSourceSSL;
+// complete: all of the stream ACKed, false if the connection closed before
+typedef std::function<void(void*, AsyncSSLClient*, bool complete)> AcStreamDoneHandlerSSL;
+
+/////////////////////////////////////////////////
+
+// Allocation-free alternative to the onXxx() std::function callbacks. Override what you need and
+// pass it to AsyncSSLClient::setHandler(). One handler can serve any number of clients.
+class AsyncSSLClientHandler
+{
+  public:
+    virtual ~AsyncSSLClientHandler() {}
+
+    virtual void onConnect(AsyncSSLClient* client) {}                               //on successful connect
+    virtual void onDisconnect(AsyncSSLClient* client) {}                            //disconnected
+    virtual void onAck(AsyncSSLClient* client, size_t len, uint32_t time) {}        //ack received
+    virtual void onError(AsyncSSLClient* client, int8_t error) {}                   //unsuccessful connect or error
+    virtual void onData(AsyncSSLClient* client, void *data, size_t len) {}          //data received (if onPacket returns false)
+    virtual bool onPacket(AsyncSSLClient* client, struct pbuf *pb)                  //data received, return true to own pb
+    {
+      return false;
+    }
+    virtual void onTimeout(AsyncSSLClient* client, uint32_t time) {}                //ack timeout
+    virtual void onPoll(AsyncSSLClient* client) {}                                  //every 125ms when connected
+    virtual void onWriteComplete(AsyncSSLClient* client, AsyncSSLWriteToken token) {}  //all of a write from add() ACKed
+};
+
+class AsyncSSLCallbacks;
+class AsyncSSLServer;
+struct AsyncSSLSendState;
+struct AsyncSSLAdmission;
+
+// Tag for new (AsyncSSLClientPool()) AsyncSSLClient(...), which takes the object from the client pool
+// and yields NULL when it's empty
+struct AsyncSSLClientPool {};
+
+/////////////////////////////////////////////////
+
+// TLS credentials and handshake preferences. Usually the same for all clients, so one instance can be
+// shared with setConfig(). Neither the struct nor the data it points to is copied
+typedef struct
+{
+  const char* root_ca;
+  size_t      root_ca_len;
+  const char* cli_cert;
+  size_t      cli_cert_len;
+  const char* cli_key;
+  size_t      cli_key_len;
+  const char* psk_ident;
+  const char* psk;
+  const int*  ciphersuites;             // offered suites in order of preference, 0-terminated, NULL for mbedTLS's defaults
+  const mbedtls_ecp_group_id* curves;   // ECDHE curves in order of preference, MBEDTLS_ECP_DP_NONE-terminated, NULL for defaults
+  const uint8_t* ca_bundle;             // trusted roots made by utils/gen_ca_bundle.py, read in place (flash or mmap)
+  size_t      ca_bundle_len;
+  bool        verify_cache;             // remember verified server certificates, see AsyncSSLClient::setVerifyCache()
+  bool        resume;                   // resume the last session with the same server, see AsyncSSLClient::setSessionResumption()
+  bool        early_data;               // TLS 1.3 0-RTT data on resumption, see AsyncSSLClient::setEarlyData()
+  bool        false_start;              // onConnect() before the server's Finished, see AsyncSSLClient::setFalseStart()
+} AsyncSSLConfig;
+
+/////////////////////////////////////////////////
+
+// Snapshot of the DNS cache counters, see AsyncSSLClient::getDnsStats()
+typedef struct
+{
+  uint32_t hits;            // connect(host) served from the cache
+  uint32_t misses;          // connect(host) which started a new lookup
+  uint32_t coalesced;       // connect(host) which joined a lookup already in flight
+  uint32_t bypassed;        // connect(host) which couldn't use the cache (name too long or cache full)
+  uint32_t failures;        // lookups finished without an address
+  uint32_t lookups;         // lookups finished
+  uint32_t latency_total;   // sum of lookup latencies, in ms
+  uint32_t latency_max;     // slowest lookup, in ms
+} AsyncSSLDnsStats;
+
+/////////////////////////////////////////////////
+
+// Counters of the verified certificate cache, see AsyncSSLClient::getVerifyCacheStats()
+typedef tcp_ssl_verify_stats_t AsyncSSLVerifyStats;
+
+/////////////////////////////////////////////////
+
+// Event types of the async task, and the tcpip_api_call() wrappers, as counted by AsyncSSLMetrics
+#define ASYNC_TCP_SSL_EVENT_TYPES   12
+
+typedef enum
+{
+  ASYNC_API_OUTPUT,
+  ASYNC_API_WRITE,
+  ASYNC_API_RECVED,
+  ASYNC_API_CLOSE,
+  ASYNC_API_ABORT,
+  ASYNC_API_CONNECT,
+  ASYNC_API_BIND,
+  ASYNC_API_LISTEN,
+  ASYNC_API_RACE,
+  ASYNC_API_SEQ,
+  ASYNC_API_POLL,
+  ASYNC_API_CALL_TYPES
+} async_api_call_t;
+
+// Traffic of one connection, or of all of them in AsyncSSLMetrics::totals. For TLS connections
+// bytes_in / bytes_out count ciphertext, plain_in / plain_out what the application read and wrote
+typedef struct
+{
+  uint32_t bytes_in;          // TCP payload received
+  uint32_t bytes_out;         // TCP payload queued for sending
+  uint32_t plain_in;          // delivered to onData() / onPacket()
+  uint32_t plain_out;         // accepted by add() / write()
+  tcp_ssl_counters_t tls;     // TLS records, handshake records excluded
+  uint32_t handshake_ms;      // duration of the TLS handshake, 0 until it finished (unused in totals)
+  uint32_t connect_us;        // connect() to TCP established (unused in totals)
+  uint32_t tls_setup_us;      // tcp_ssl_new_client() or tcp_ssl_new_psk_client() (unused in totals)
+} AsyncSSLConnMetrics;
+
+// Snapshot of the library-wide counters, see AsyncSSLClient::getMetrics()
+typedef struct
+{
+  AsyncSSLConnMetrics totals;       // traffic of all connections
+  uint32_t handshakes_started;
+  uint32_t handshakes_ok;
+  uint32_t handshakes_failed;       // TLS errors and connections closed before the handshake finished
+  uint32_t handshake_ms_total;      // sum of successful handshake durations, in ms
+  uint32_t handshake_ms_max;        // slowest successful handshake, in ms
+  uint32_t queue_depth;             // events waiting for the async task right now
+  uint32_t queue_high_water;        // deepest the event queues have been, all classes together
+  uint32_t queue_failures;          // events which couldn't be queued
+  uint32_t queue_aged;              // events served ahead of a higher class by ASYNC_TCP_SSL_PRIORITY_AGING
+  uint32_t queue_class_depth[ASYNC_PRIORITY_CLASSES];   // queue_depth by ASYNC_PRIORITY_xxx class
+  uint32_t queue_refused;           // received data left with lwIP, as its connection had ASYNC_TCP_SSL_SCHED_EVENTS waiting
+  uint32_t log_dropped;             // log records dropped as the log ring was full
+  uint32_t events[ASYNC_TCP_SSL_EVENT_TYPES];    // events handled, by type (LWIP_TCP_SENT first)
+  uint32_t api_calls[ASYNC_API_CALL_TYPES];     // tcpip_api_call() round trips, by async_api_call_t
+} AsyncSSLMetrics;
+
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
+
+// Dispatch latency of one event type. Bucket 0 counts 0 us, bucket i [2^(i-1), 2^i) us and the
+// last one everything above
+typedef struct
+{
+  uint32_t queued[ASYNC_TCP_SSL_LATENCY_BUCKETS];     // from the LwIP callback until the async task picked it up
+  uint32_t handler[ASYNC_TCP_SSL_LATENCY_BUCKETS];    // time spent handling it
+  uint32_t queued_max;                                // worst queue latency, in us
+  uint32_t handler_max;                               // slowest handler, in us
+} AsyncSSLEventLatency;
+
+#endif
 
 /////////////////////////////////////////////////
 
 struct tcp_pcb;
 struct ip_addr;
+struct tcpip_api_call_data;
+
+// Called by tcp_mbedtls.c to queue ciphertext
+extern "C" esp_err_t _tcp_write4ssl(tcp_pcb * pcb, const char* data, size_t size, uint8_t apiflags, void* client,
+                                    uint32_t* end);
+
+// One connect attempt of a dual-stack connect(host). Used as the lwIP arg of its pcb until it wins
+typedef struct
+{
+  AsyncSSLClient* client;
+  tcp_pcb*        pcb;
+} AsyncSSLConnectAttempt;
 
 //////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -173,11 +498,31 @@ class AsyncSSLClient
     }
 
     bool    connect(IPAddress ip, uint16_t port, bool secure = false);
+#if LWIP_IPV6
+    bool    connect(IPv6Address ip, uint16_t port, bool secure = false);
+#endif
     bool    connect(const char* host, uint16_t port,  bool secure = false);
     void    setRootCa(const char* rootca, const size_t len);
     void    setClientCert(const char* cli_cert, const size_t len);
     void    setClientKey(const char* cli_key, const size_t len);
     void    setPsk(const char* psk_ident, const char* psk);
+    void    setCipherSuites(const int* suites);               //e.g. { MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256, 0 }, must outlive the client
+    void    setCurves(const mbedtls_ecp_group_id* curves);    //e.g. { MBEDTLS_ECP_DP_CURVE25519, MBEDTLS_ECP_DP_SECP256R1, MBEDTLS_ECP_DP_NONE }
+    bool    setCaBundle(const uint8_t* bundle, size_t len);   //from utils/gen_ca_bundle.py, not copied. false if malformed
+    void    setVerifyCache(bool enable);                      //skip the chain check for a server certificate verified before
+    void    setSessionResumption(bool enable);                //abbreviated handshake with a server connected to before
+    void    setEarlyData(bool enable);                        //with resumption: add() before onConnect() sends TLS 1.3 0-RTT data. Replayable, idempotent requests only
+    void    setFalseStart(bool enable);                       //TLS 1.2 with ECDHE/DHE and AEAD: onConnect() one round trip earlier
+    void    setConfig(const AsyncSSLConfig* config);   //shared config instead of the 11 setters above, must outlive the client
+    void    setPriority(uint8_t priority);             //ASYNC_PRIORITY_INTERACTIVE, _NORMAL or _BULK. Before connect()
+
+    uint8_t getPriority()
+    {
+      return _priority;
+    }
+
+    const char* getCipherSuite();   //negotiated suite, e.g. "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256", NULL before onConnect()
+    const char* getTlsVersion();    //negotiated protocol, e.g. "TLSv1.3", NULL before onConnect()
 
     void    close(bool now = false);
     void    stop();
@@ -185,13 +530,25 @@ class AsyncSSLClient
     bool    free();
 
     bool    canSend();        //ack is not pending
-    size_t  add(const char* data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY); //add for sending
+    //add for sending. With token: set when anything was added, onWriteComplete() follows once the
+    //peer ACKed all of its ciphertext. Not for 0-RTT data, which the server may refuse and get again:
+    //that gets ASYNC_WRITE_TOKEN_NONE
+    size_t  add(const char* data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY, AsyncSSLWriteToken* token = NULL);
     bool    send();           //send all data added with the method above
+    bool    writeComplete(AsyncSSLWriteToken token);   //ACKed, polling alternative to onWriteComplete(). false once disconnected
+
+    //sends everything the source has, one record at a time as the window opens, then calls done.
+    //Once TCP is connected: during the TLS handshake, data goes out after onConnect(). false before
+    //that, or if a stream is running already
+    bool    stream(AcStreamSourceSSL source, AcStreamDoneHandlerSSL done = NULL, void* arg = 0);
+    bool    stream(Stream& source, AcStreamDoneHandlerSSL done = NULL, void* arg = 0);   //until available() is 0, e.g. a File
+    bool    streaming();      //a stream() is not done yet
 
     virtual size_t  space();  //space available in the TCP window
     //write equals add()+send()
     virtual size_t  write(const char* data);
     virtual size_t  write(const char* data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY); //only when canSend() == true
+    size_t  write(const char* data, size_t size, uint8_t apiflags, AsyncSSLWriteToken* token);
 
     uint8_t state();
     bool    connecting();
@@ -222,6 +579,12 @@ class AsyncSSLClient
     IPAddress localIP();
     uint16_t  localPort();
 
+#if LWIP_IPV6
+    bool        isIPv6();
+    IPv6Address remoteIP6();
+    IPv6Address localIP6();
+#endif
+
     void    onConnect(AcConnectHandlerSSL cb, void* arg = 0);      //on successful connect
     void    onDisconnect(AcConnectHandlerSSL cb, void* arg = 0);   //disconnected
     void    onAck(AcAckHandlerSSL cb, void* arg = 0);              //ack received
@@ -230,10 +593,21 @@ class AsyncSSLClient
     void    onPacket(AcPacketHandlerSSL cb, void* arg = 0);        //data received
     void    onTimeout(AcTimeoutHandlerSSL cb, void* arg = 0);      //ack timeout
     void    onPoll(AcConnectHandlerSSL cb, void* arg = 0);         //every 125ms when connected
+    void    onWriteComplete(AcWriteHandlerSSL cb, void* arg = 0);  //tokens from add(), oldest first
+
+    // Replaces the onXxx() callbacks above. NULL goes back to them. The handler must outlive the client.
+    // Its onPoll() is only called with poll = true
+    void    setHandler(AsyncSSLClientHandler* handler, bool poll = false);
+    AsyncSSLClientHandler* getHandler()
+    {
+      return _handler;
+    }
 
     void    ackPacket(struct pbuf * pb);//ack pbuf from onPacket
     size_t  ack(size_t len); //ack data that you have not acked using the method below
     
+    // Secure connections: counts the plaintext of the current onData call, its ciphertext is held out
+    // of the TCP window until ack(). Outside the callbacks, ack() leaves the release to the async task
     void ackLater() 
     {
       _ack_pcb = false;  //will not ack the current packet. Call from onData
@@ -242,19 +616,67 @@ class AsyncSSLClient
     const char *  errorToString(int8_t error);
     const char *  stateToString();
 
+    static AsyncSSLDnsStats getDnsStats();
+    static void   clearDnsCache();
+
+    static AsyncSSLVerifyStats getVerifyCacheStats();
+    static void   clearVerifyCache();   //forget the verified certificates, e.g. after a CA was distrusted
+    static void   clearSessionCache();  //forget the saved TLS sessions, the next connections do full handshakes
+
+    static void     setMaxHandshakes(uint16_t max_handshakes);    //concurrent TLS handshakes, 0 = no limit
+    static void     setHandshakeWait(uint32_t timeout);           //max wait for a handshake turn in milliseconds
+    static uint16_t handshakesInFlight();
+
+    static AsyncSSLMetrics  getMetrics();
+    static void             resetMetrics();   //zeroes the global counters, per-connection ones stay
+
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
+    static bool         getEventLatency(uint8_t event, AsyncSSLEventLatency& latency);   //false if event is out of range
+    static void         resetEventLatency();
+#endif
+    static const char*  eventToString(uint8_t event);   //name of an event type, as indexed in the histograms and metrics
+
+#if ASYNC_TCP_SSL_METRICS
+    const AsyncSSLConnMetrics& getConnMetrics()
+    {
+      return _metrics;
+    }
+#endif
+
+#if (ASYNC_TCP_SSL_CLIENT_POOL_SIZE > 0)
+    // delete works the same for pooled and heap clients
+    static void*  operator new(size_t size);
+    static void*  operator new(size_t size, const std::nothrow_t&) noexcept;
+    static void*  operator new(size_t size, const AsyncSSLClientPool&) noexcept;
+    static void   operator delete(void* ptr);
+    static void   operator delete(void* ptr, const std::nothrow_t&) noexcept;
+    static void   operator delete(void* ptr, const AsyncSSLClientPool&) noexcept;
+    static size_t poolAvailable();    //free clients left in the pool
+#endif
+
     //Do not use any of the functions below!
     static int8_t _s_poll(void *arg, struct tcp_pcb *tpcb);
     static int8_t _s_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, int8_t err);
     static int8_t _s_fin(void *arg, struct tcp_pcb *tpcb, int8_t err);
     static int8_t _s_lwip_fin(void *arg, struct tcp_pcb *tpcb, int8_t err);
     static void   _s_error(void *arg, int8_t err);
-    static int8_t _s_sent(void *arg, struct tcp_pcb *tpcb, uint16_t len);
+    static int8_t _s_sent(void *arg, struct tcp_pcb *tpcb, uint16_t len, uint32_t acked);
     static int8_t _s_connected(void* arg, void* tpcb, int8_t err);
-    static void   _s_dns_found(const char *name, struct ip_addr *ipaddr, void *arg);
-    
+    static void   _s_dns_found(const char *name, struct ip_addr *ipaddr, void *arg, uint8_t resolved);
+    static void   _s_dns_cache_found(const char *name, struct ip_addr *ipaddr, void *entry);
+
+    // Happy Eyeballs, in LwIP Thread
+    static int8_t _s_race_connected(void* arg, tcp_pcb* tpcb, int8_t err);
+    static void   _s_race_error(void *arg, int8_t err);
+    static int8_t _s_race_api(struct tcpip_api_call_data *api_call_msg);
+
     static void _s_data(void *arg, struct tcp_pcb *tcp, uint8_t * data, size_t len);
     static void _s_handshake(void *arg, struct tcp_pcb *tcp, struct tcp_ssl_pcb* ssl);
     static void _s_ssl_error(void *arg, struct tcp_pcb *tcp, int8_t err);
+    static void _s_handshake_turn();
+    static void _s_ack(void *arg, size_t len);
+    static TickType_t _s_timers(uint32_t now);
+    static uint16_t*  _s_sched_index(void *arg);
 
     int8_t      _recv(tcp_pcb* pcb, pbuf* pb, int8_t err);
     
@@ -264,72 +686,118 @@ class AsyncSSLClient
     }
 
     //KH
-    int8_t getClosed_Slot() 
+    int32_t getClosed_Slot() 
     {
       return _closed_slot;
     }
     //////
 
   protected:
-    tcp_pcb*        _pcb;
-    std::string     _hostname;
-    int8_t          _closed_slot;
+    // Ordered by size so that no padding is wasted. The single-byte flags are plain bytes, not
+    // bitfields, because they are written from different tasks
 
-    AcConnectHandlerSSL   _connect_cb;
-    void*                 _connect_cb_arg;
-    AcConnectHandlerSSL   _discard_cb;
-    void*                 _discard_cb_arg;
-    AcAckHandlerSSL       _sent_cb;
-    void*                 _sent_cb_arg;
-    AcErrorHandlerSSL     _error_cb;
-    void*                 _error_cb_arg;
-    AcDataHandlerSSL      _recv_cb;
-    void*                 _recv_cb_arg;
-    AcPacketHandlerSSL    _pb_cb;
-    void*                 _pb_cb_arg;
-    AcTimeoutHandlerSSL   _timeout_cb;
-    void*                 _timeout_cb_arg;
-    AcConnectHandlerSSL   _poll_cb;
-    void*                 _poll_cb_arg;
+    tcp_pcb*                _pcb;
+    char*                   _hostname;      // for SNI and certificate check, owned
+    int32_t                 _closed_slot;   // (generation << 16) | index, see the Closed Slots comment
+
+    AsyncSSLClientHandler*  _handler;
+    AsyncSSLCallbacks*      _callbacks;     // allocated on the first onXxx() call, backs the std::function API
+    AsyncSSLSendState*      _tx_state;      // allocated on the first add() with a token or stream()
+
+    const AsyncSSLConfig*   _config;        // TLS credentials, shared or owned (see _owns_config)
+    AsyncSSLAdmission*      _admission;     // admission count of the server which accepted this client
+    AsyncSSLClient*         _hs_next;       // next client waiting for a handshake turn
+    AsyncSSLClient*         _tw_next;       // timer wheel slot list
+    AsyncSSLClient*         _tw_prev;
 
-    bool      _pcb_busy;
     uint32_t  _pcb_sent_at;
-    bool      _ack_pcb;
     uint32_t  _rx_ack_len;
     uint32_t  _rx_last_packet;
     uint32_t  _rx_since_timeout;
     uint32_t  _ack_timeout;
+    uint32_t  _tw_deadline;     // when the timer wheel looks at this client next, if _tw_armed
+    uint32_t  _hs_started_at;   // millis() when the TLS handshake started, 0 when none is running
+
+#if ASYNC_TCP_SSL_METRICS
+    AsyncSSLConnMetrics _metrics;
+#endif
+
+    // DNS cache entry this client waits on, and next waiter of the same entry, per address family
+    void*           _dns_entry[ASYNC_IP_FAMILIES];
+    AsyncSSLClient* _dns_next[ASYNC_IP_FAMILIES];
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+    // Dual-stack connect(host) state, only touched in LwIP Thread once the lookups started
+    AsyncSSLConnectAttempt  _attempts[ASYNC_IP_FAMILIES];
+#endif
+
     uint16_t  _connect_port;
 
-    ////// SSL
-    size_t  _root_ca_len;
-    char*   _root_ca;
-    size_t  _cli_cert_len;
-    char*   _cli_cert;
-    size_t  _cli_key_len;
-    char*   _cli_key;
-    bool    _pcb_secure;
-    bool    _handshake_done;
-    
-    const char* _psk_ident;
-    const char* _psk;
-    //////
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+    uint8_t   _race_pending;    // bitmask of families still resolving
+    bool      _race_won;
+    bool      _race_delayed;    // an attempt waits for ASYNC_TCP_SSL_ATTEMPT_DELAY, see _race_step()
+#endif
+
+    bool      _pcb_busy;
+    bool      _ack_pcb;
+    bool      _pcb_secure;
+    bool      _handshake_done;
+    bool      _owns_config;
+    uint8_t   _hs_state;      // handshake limit: none, waiting or holding a turn
+    bool      _tw_armed;
+    bool      _poll_enabled;  // tcp_poll is only registered for clients with an onPoll handler
+    uint8_t   _priority;      // ASYNC_PRIORITY_xxx class of the events, read in LwIP Thread
+    uint16_t  _sched_index;   // scheduler entry it last queued events to, see _sched_entry()
 
     int8_t  _close();
+    AsyncSSLCallbacks*  _legacy_callbacks();
+    AsyncSSLConfig*     _own_config();
+    void    _set_hostname(const char* host);
     void    _free_closed_slot();
     void    _allocate_closed_slot();
     int8_t  _connected(void* pcb, int8_t err);
     void    _error(int8_t err);
     int8_t  _poll(tcp_pcb* pcb);
-    int8_t  _sent(tcp_pcb* pcb, uint16_t len);
+    void    _set_poll(tcp_pcb* pcb);
+    void    _update_poll(bool now = false);
+    void    _timers();
+    void    _timer_arm();
+    void    _timer_cancel();
+    int8_t  _sent(tcp_pcb* pcb, uint16_t len, uint32_t acked);
+    AsyncSSLSendState*  _send_state();
+    void    _track_write(AsyncSSLWriteToken* token, uint32_t end);
+    void    _writes_acked(uint32_t acked);
+    bool    _stream_pump();
+    size_t  _add(const char* data, size_t size, uint8_t apiflags, AsyncSSLWriteToken* token, bool* failed);
+    bool    _output();
+    void    _stream_end(bool complete);
     int8_t  _fin(tcp_pcb* pcb, int8_t err);
     int8_t  _lwip_fin(tcp_pcb* pcb, int8_t err);
-    void    _dns_found(struct ip_addr *ipaddr);
-    
+    bool    _connect(struct ip_addr *addr, uint16_t port, bool secure);
+    bool    _connect_pending();
+    void    _dns_found(struct ip_addr *ipaddr, uint8_t resolved);
+    int8_t  _dns_cache_lookup(const char* host, struct ip_addr *addr, uint8_t family);
+    void    _dns_cache_cancel();
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+    bool    _race_step(struct ip_addr *addr, uint8_t resolved);
+    bool    _race(struct ip_addr *addr, uint8_t resolved);
+    void    _race_cancel();
+#endif
+
     ////// SSL
     void    _ssl_error(int8_t err);
+    int8_t  _start_tls();
+    bool    _handshake_acquire();
+    void    _handshake_release();
+    void    _handshake_finished(bool ok);
     //////
 
+    friend class AsyncSSLServer;
+    friend esp_err_t _tcp_write4ssl(tcp_pcb * pcb, const char* data, size_t size, uint8_t apiflags, void* client,
+                                    uint32_t* end);
+
   public:
     AsyncSSLClient* prev;
     AsyncSSLClient* next;
@@ -343,7 +811,10 @@ class AsyncSSLServer
 {
   public:
     AsyncSSLServer(IPAddress addr, uint16_t port);
-    AsyncSSLServer(uint16_t port);
+#if LWIP_IPV6
+    AsyncSSLServer(IPv6Address addr, uint16_t port);
+#endif
+    AsyncSSLServer(uint16_t port);      //IPv4 and IPv6 when lwIP has IPv6
     ~AsyncSSLServer();
     
     void onClient(AcConnectHandlerSSL cb, void* arg);
@@ -358,6 +829,19 @@ class AsyncSSLServer
     bool    getNoDelay();
     uint8_t status();
 
+    /*
+       Admission control, checked in _accept before any client object is created. Refused
+       connections are reset. Accepted clients count until they are deleted. They share the
+       count with the server, not the server itself: either may be deleted first.
+     * */
+    void    setBacklog(uint8_t backlog);                            //pending connections lwIP queues, call before begin()
+    void    setMaxClients(uint16_t max_clients);                    //concurrent accepted clients, 0 = no limit
+    void    setAcceptRate(uint16_t per_second, uint16_t burst);     //token bucket on accepts, 0 = no limit
+    void    setPriorityNetwork(IPAddress network, IPAddress mask, uint16_t reserved);   //reserved clients and no rate limit for this IPv4 network
+
+    uint16_t  activeClients();
+    uint32_t  refusedClients();
+
     //Do not use any of the functions below!
     static int8_t _s_accept(void *arg, tcp_pcb* newpcb, int8_t err);
     static int8_t _s_accepted(void *arg, AsyncSSLClient* client);
@@ -365,6 +849,10 @@ class AsyncSSLServer
   protected:
     uint16_t  _port;
     IPAddress _addr;
+#if LWIP_IPV6
+    IPv6Address _addr6;
+#endif
+    uint8_t   _addr_type;
     bool      _noDelay;
     
     tcp_pcb*              _pcb;
@@ -372,8 +860,28 @@ class AsyncSSLServer
     AcConnectHandlerSSL   _connect_cb;   
     void*                 _connect_cb_arg;
 
+    // Admission control. Only _admission is touched outside LwIP Thread
+    uint32_t  _priority_net;
+    uint32_t  _priority_mask;
+    uint32_t  _tokens;            // in 1/1000 accepts
+    uint32_t  _tokens_at;
+    uint32_t  _refused;
+    uint16_t  _rate;
+    uint16_t  _burst;
+    uint16_t  _max_clients;
+    uint16_t  _reserved_clients;
+    uint8_t   _backlog;
+
+    AsyncSSLAdmission*    _admission;   // shared with the accepted clients, from begin()
+
     int8_t _accept(tcp_pcb* newpcb, int8_t err);
     int8_t _accepted(AsyncSSLClient* client);
+    bool   _admit(tcp_pcb* pcb);
+    void   _release();
+
+    static void _detach(AsyncSSLAdmission* admission, bool client);
+
+    friend class AsyncSSLClient;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -50,6 +50,30 @@
 
 /////////////////////////////////////////////////////////
 
+// Log records go to a ring buffer of this many bytes, and a low priority task prints them. Records
+// which don't fit are dropped, logging never blocks. 0 prints synchronously to DBG_PORT_ATCP instead.
+// Default 2048
+#ifndef ASYNC_TCP_SSL_LOG_RING
+  #define ASYNC_TCP_SSL_LOG_RING        2048
+#endif
+
+// Nothing is logged at level 0, so neither the ring nor its task are built
+#if (_ASYNC_TCP_SSL_LOGLEVEL_ <= 0)
+  #undef  ASYNC_TCP_SSL_LOG_RING
+  #define ASYNC_TCP_SSL_LOG_RING        0
+#endif
+
+// Priority of the task which prints the log ring. Default 1
+#ifndef ASYNC_TCP_SSL_LOG_PRIORITY
+  #define ASYNC_TCP_SSL_LOG_PRIORITY    1
+#endif
+
+#if (ASYNC_TCP_SSL_LOG_RING & (ASYNC_TCP_SSL_LOG_RING - 1))
+  #error ASYNC_TCP_SSL_LOG_RING must be a power of 2
+#endif
+
+/////////////////////////////////////////////////////////
+
 #define ATCP_PRINT_MARK      ATCP_PRINT("[ATCP] ")
 #define ATCP_PRINT_SP        DBG_PORT_ATCP.print(" ")
 #define ATCP_PRINT_SP0X      DBG_PORT_ATCP.print(" 0x")
@@ -59,47 +83,220 @@
 
 /////////////////////////////////////////////////////////
 
-#define ATCP_LOGERROR(x)         if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT_MARK; ATCP_PRINTLN(x); }
-#define ATCP_LOGERROR0(x)        if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT(x); }
-#define ATCP_LOGERROR1(x,y)      if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINTLN(y); }
-#define ATCP_HEXLOGERROR1(x,y)   if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINTLN(y, HEX); }
-#define ATCP_LOGERROR2(x,y,z)    if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINTLN(z); }
-#define ATCP_HEXLOGERROR2(x,y,z) if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINT(y, HEX); ATCP_PRINT_SP0X; ATCP_PRINTLN(z, HEX); }
-#define ATCP_LOGERROR3(x,y,z,w)  if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINTLN(w); }
-#define ATCP_LOGERROR5(x,y,z,w,xx,yy)  if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINT(w); ATCP_PRINT_SP; ATCP_PRINT(xx); ATCP_PRINT_SP; ATCP_PRINTLN(yy); }
+/*
+   Log Records
+
+   A log call is packed into a record: the first macro argument, which must be a string literal since
+   only its pointer is kept, and the other arguments tagged with their type. Strings are copied, up to
+   ATCP_LOG_STR_MAX characters. Whether the record is printed right away or goes through the ring is
+   up to _atcp_log_record().
+ * */
+
+#include <string.h>
+#include <type_traits>
+
+#define ATCP_LOG_MARK         0x01    // starts with "[ATCP] "
+#define ATCP_LOG_NEWLINE      0x02
+#define ATCP_LOG_HEX          0x04    // arguments as " 0x" and hex
+
+#define ATCP_LOG_ARG_INT      'i'
+#define ATCP_LOG_ARG_UINT     'u'
+#define ATCP_LOG_ARG_FLOAT    'f'
+#define ATCP_LOG_ARG_STR      's'
+
+#define ATCP_LOG_STR_MAX      31
+#define ATCP_LOG_RECORD_MAX   160
+
+typedef struct
+{
+  uint16_t      size;     // header and arguments, in bytes
+  uint8_t       flags;
+  uint8_t       nargs;
+  const char *  text;
+} atcp_log_record_t;
+
+// Defined in AsyncTCP_SSL_Impl.h
+void _atcp_log_record(const atcp_log_record_t * record);
+
+/////////////////////////////////////////////////////////
+
+class ATCP_LogPacker
+{
+  public:
+    ATCP_LogPacker(uint8_t flags, const char * text)
+    {
+      _record()->flags  = flags;
+      _record()->nargs  = 0;
+      _record()->text   = text;
+      _pos              = sizeof(atcp_log_record_t);
+    }
+
+    void add(const char * str)
+    {
+      if (!str)
+      {
+        str = "(null)";
+      }
+
+      size_t len = strlen(str);
+
+      if (len > ATCP_LOG_STR_MAX)
+      {
+        len = ATCP_LOG_STR_MAX;
+      }
+
+      if (_room(2 + len))
+      {
+        _bytes()[_pos++] = ATCP_LOG_ARG_STR;
+        _bytes()[_pos++] = (uint8_t) len;
+        memcpy(&_bytes()[_pos], str, len);
+        _pos += len;
+        _record()->nargs++;
+      }
+    }
+
+    void add(const String& str)
+    {
+      add(str.c_str());
+    }
+
+    void add(double value)
+    {
+      float f = value;
+
+      _put(ATCP_LOG_ARG_FLOAT, &f);
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type add(T value)
+    {
+      if (std::is_signed<T>::value)
+      {
+        int32_t v = (int32_t) value;
+
+        _put(ATCP_LOG_ARG_INT, &v);
+      }
+      else
+      {
+        uint32_t v = (uint32_t) value;
+
+        _put(ATCP_LOG_ARG_UINT, &v);
+      }
+    }
+
+    template <typename T>
+    void add(const T * ptr)
+    {
+      uint32_t v = (uint32_t) (uintptr_t) ptr;
+
+      _put(ATCP_LOG_ARG_UINT, &v);
+    }
+
+    void pack() {}
+
+    template <typename T, typename... Rest>
+    void pack(const T& first, const Rest&... rest)
+    {
+      add(first);
+      pack(rest...);
+    }
+
+    void send()
+    {
+      _record()->size = _pos;
+      _atcp_log_record(_record());
+    }
+
+  private:
+    // 4-byte aligned so that the header can be read in place
+    uint32_t  _words[ATCP_LOG_RECORD_MAX / 4];
+    uint16_t  _pos;
+
+    uint8_t * _bytes()
+    {
+      return (uint8_t *) _words;
+    }
+
+    atcp_log_record_t * _record()
+    {
+      return (atcp_log_record_t *) _words;
+    }
+
+    bool _room(size_t len)
+    {
+      return (_pos + len <= ATCP_LOG_RECORD_MAX);
+    }
+
+    void _put(uint8_t type, const void * value)
+    {
+      if (_room(5))
+      {
+        _bytes()[_pos++] = type;
+        memcpy(&_bytes()[_pos], value, 4);
+        _pos += 4;
+        _record()->nargs++;
+      }
+    }
+};
+
+/////////////////////////////////////////////////////////
+
+template <typename... Args>
+inline void _atcp_log(uint8_t flags, const char * text, const Args&... args)
+{
+  ATCP_LogPacker packer(flags, text);
+
+  packer.pack(args...);
+  packer.send();
+}
+
+#define ATCP_LOG_LINE(...)      _atcp_log(ATCP_LOG_MARK | ATCP_LOG_NEWLINE, __VA_ARGS__)
+#define ATCP_LOG_HEXLINE(...)   _atcp_log(ATCP_LOG_MARK | ATCP_LOG_NEWLINE | ATCP_LOG_HEX, __VA_ARGS__)
+#define ATCP_LOG_PART(x)        _atcp_log(0, x)
+
+/////////////////////////////////////////////////////////
+
+#define ATCP_LOGERROR(x)                if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_LINE(x); }
+#define ATCP_LOGERROR0(x)               if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_PART(x); }
+#define ATCP_LOGERROR1(x,y)             if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_LINE(x, y); }
+#define ATCP_HEXLOGERROR1(x,y)          if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_HEXLINE(x, y); }
+#define ATCP_LOGERROR2(x,y,z)           if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_LINE(x, y, z); }
+#define ATCP_HEXLOGERROR2(x,y,z)        if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_HEXLINE(x, y, z); }
+#define ATCP_LOGERROR3(x,y,z,w)         if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_LINE(x, y, z, w); }
+#define ATCP_LOGERROR5(x,y,z,w,xx,yy)   if(_ASYNC_TCP_SSL_LOGLEVEL_>0) { ATCP_LOG_LINE(x, y, z, w, xx, yy); }
 
 /////////////////////////////////////////////////////////
 
-#define ATCP_LOGWARN(x)          if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT_MARK; ATCP_PRINTLN(x); }
-#define ATCP_LOGWARN0(x)         if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT(x); }
-#define ATCP_LOGWARN1(x,y)       if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINTLN(y); }
-#define ATCP_HEXLOGWARN1(x,y)    if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINTLN(y, HEX); }
-#define ATCP_LOGWARN2(x,y,z)     if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINTLN(z); }
-#define ATCP_HEXLOGWARN2(x,y,z)  if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINT(y, HEX); ATCP_PRINT_SP0X; ATCP_PRINTLN(z, HEX); }
-#define ATCP_LOGWARN3(x,y,z,w)   if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINTLN(w); }
-#define ATCP_LOGWARN5(x,y,z,w,xx,yy)  if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINT(w); ATCP_PRINT_SP; ATCP_PRINT(xx); ATCP_PRINT_SP; ATCP_PRINTLN(yy); }
+#define ATCP_LOGWARN(x)                 if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_LINE(x); }
+#define ATCP_LOGWARN0(x)                if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_PART(x); }
+#define ATCP_LOGWARN1(x,y)              if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_LINE(x, y); }
+#define ATCP_HEXLOGWARN1(x,y)           if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_HEXLINE(x, y); }
+#define ATCP_LOGWARN2(x,y,z)            if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_LINE(x, y, z); }
+#define ATCP_HEXLOGWARN2(x,y,z)         if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_HEXLINE(x, y, z); }
+#define ATCP_LOGWARN3(x,y,z,w)          if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_LINE(x, y, z, w); }
+#define ATCP_LOGWARN5(x,y,z,w,xx,yy)    if(_ASYNC_TCP_SSL_LOGLEVEL_>1) { ATCP_LOG_LINE(x, y, z, w, xx, yy); }
 
 /////////////////////////////////////////////////////////
 
-#define ATCP_LOGINFO(x)          if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT_MARK; ATCP_PRINTLN(x); }
-#define ATCP_LOGINFO0(x)         if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT(x); }
-#define ATCP_LOGINFO1(x,y)       if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINTLN(y); }
-#define ATCP_HEXLOGINFO1(x,y)    if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINTLN(y, HEX); }
-#define ATCP_LOGINFO2(x,y,z)     if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINTLN(z); }
-#define ATCP_HEXLOGINFO2(x,y,z)  if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINT(y, HEX); ATCP_PRINT_SP0X; ATCP_PRINTLN(z, HEX); }
-#define ATCP_LOGINFO3(x,y,z,w)   if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINTLN(w); }
-#define ATCP_LOGINFO5(x,y,z,w,xx,yy)  if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINT(w); ATCP_PRINT_SP; ATCP_PRINT(xx); ATCP_PRINT_SP; ATCP_PRINTLN(yy); }
+#define ATCP_LOGINFO(x)                 if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_LINE(x); }
+#define ATCP_LOGINFO0(x)                if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_PART(x); }
+#define ATCP_LOGINFO1(x,y)              if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_LINE(x, y); }
+#define ATCP_HEXLOGINFO1(x,y)           if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_HEXLINE(x, y); }
+#define ATCP_LOGINFO2(x,y,z)            if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_LINE(x, y, z); }
+#define ATCP_HEXLOGINFO2(x,y,z)         if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_HEXLINE(x, y, z); }
+#define ATCP_LOGINFO3(x,y,z,w)          if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_LINE(x, y, z, w); }
+#define ATCP_LOGINFO5(x,y,z,w,xx,yy)    if(_ASYNC_TCP_SSL_LOGLEVEL_>2) { ATCP_LOG_LINE(x, y, z, w, xx, yy); }
 
 /////////////////////////////////////////////////////////
 
-#define ATCP_LOGDEBUG(x)         if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT_MARK; ATCP_PRINTLN(x); }
-#define ATCP_LOGDEBUG0(x)        if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT(x); }
-#define ATCP_LOGDEBUG1(x,y)      if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINTLN(y); }
-#define ATCP_HEXLOGDEBUG1(x,y)   if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINTLN(y, HEX); }
-#define ATCP_LOGDEBUG2(x,y,z)    if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINTLN(z); }
-#define ATCP_HEXLOGDEBUG2(x,y,z) if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP0X; ATCP_PRINT(y, HEX); ATCP_PRINT_SP0X; ATCP_PRINTLN(z, HEX); }
-#define ATCP_LOGDEBUG3(x,y,z,w)  if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINTLN(w); }
-#define ATCP_LOGDEBUG5(x,y,z,w,xx,yy)  if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_PRINT_MARK; ATCP_PRINT(x); ATCP_PRINT_SP; ATCP_PRINT(y); ATCP_PRINT_SP; ATCP_PRINT(z); ATCP_PRINT_SP; ATCP_PRINT(w); ATCP_PRINT_SP; ATCP_PRINT(xx); ATCP_PRINT_SP; ATCP_PRINTLN(yy); }
+#define ATCP_LOGDEBUG(x)                if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_LINE(x); }
+#define ATCP_LOGDEBUG0(x)               if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_PART(x); }
+#define ATCP_LOGDEBUG1(x,y)             if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_LINE(x, y); }
+#define ATCP_HEXLOGDEBUG1(x,y)          if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_HEXLINE(x, y); }
+#define ATCP_LOGDEBUG2(x,y,z)           if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_LINE(x, y, z); }
+#define ATCP_HEXLOGDEBUG2(x,y,z)        if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_HEXLINE(x, y, z); }
+#define ATCP_LOGDEBUG3(x,y,z,w)         if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_LINE(x, y, z, w); }
+#define ATCP_LOGDEBUG5(x,y,z,w,xx,yy)   if(_ASYNC_TCP_SSL_LOGLEVEL_>3) { ATCP_LOG_LINE(x, y, z, w, xx, yy); }
 
 /////////////////////////////////////////////////////////
 
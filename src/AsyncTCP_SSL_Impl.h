@@ -52,6 +52,8 @@
 
 #include "Arduino.h"
 
+#include <new>
+
 #include "AsyncTCP_SSL_Debug.h"
 
 extern "C"
@@ -64,6 +66,7 @@ extern "C"
 }
 
 #include "esp_task_wdt.h"
+#include "esp_timer.h"
 
 #define CONFIG_ASYNC_TCP_STACK      (2*8192)
 
@@ -90,13 +93,21 @@ typedef enum
   LWIP_TCP_CLEAR,
   LWIP_TCP_ACCEPT,
   LWIP_TCP_CONNECTED,
-  LWIP_TCP_DNS
+  LWIP_TCP_DNS,
+  LWIP_TCP_HANDSHAKE,
+  LWIP_TCP_TIMER,
+  LWIP_TCP_ACK
 } lwip_event_t;
 
-typedef struct
+typedef struct lwip_event_packet
 {
   lwip_event_t event;
   void *arg;
+  struct lwip_event_packet * next;    // in the FIFO of a scheduler entry
+
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
+  uint32_t queued_at;     // esp_timer microseconds when it was queued, wraps after 71 minutes
+#endif
 
   union
   {
@@ -115,6 +126,7 @@ typedef struct
     {
       tcp_pcb * pcb;
       uint16_t len;
+      uint32_t acked;     // pcb->lastack, read on the lwIP thread
     } sent;
 
     struct
@@ -140,1734 +152,5191 @@ typedef struct
       AsyncSSLClient * client;
     } accept;
 
+    struct
+    {
+      size_t len;
+    } ack;
+
     struct
     {
       const char * name;
       ip_addr_t addr;
+      bool cached;        // arg is a DNS cache entry, not a client
+      uint8_t resolved;   // uncached: bitmask of the families the lookup was for, see _dns_found()
     } dns;
   };
 } lwip_event_packet_t;
 
 /////////////////////////////////////////////////
 
-static xQueueHandle _async_queue;
+/*
+   Event Queues
+
+   One queue per priority class, for the events which don't belong to a connection's scheduler
+   entry (see Fair Scheduling below). Producers give _async_queue_sem after each event, the service
+   task picks the class: the first one in _async_class_order with events, unless a lower one has
+   been passed over ASYNC_TCP_SSL_PRIORITY_AGING times in a row. LWIP_TCP_CLEAR goes to the front of
+   the interactive queue, so it's handled before any other event of its client.
+ * */
+
+static xQueueHandle       _async_queues[ASYNC_PRIORITY_CLASSES];
+static SemaphoreHandle_t  _async_queue_sem  = NULL;   // counts queued events, at least
+static uint32_t           _async_queued     = 0;      // events queued and not yet taken or dropped, atomic
+static uint8_t            _async_passed[ASYNC_PRIORITY_CLASSES];    // only touched by the service task
+
+static const uint8_t      _async_class_order[ASYNC_PRIORITY_CLASSES] =
+{
+  ASYNC_PRIORITY_INTERACTIVE, ASYNC_PRIORITY_NORMAL, ASYNC_PRIORITY_BULK
+};
+
+/*
+   Fair Scheduling
+
+   The events of a connection (connected, recv, fin, sent, poll and error) don't go to the class
+   queue but to the FIFO of a scheduler entry, which the client holds while it has events waiting.
+   Entries with events are on the ready ring of their class and take turns, deficit round robin:
+   a turn adds ASYNC_TCP_SSL_QUANTUM to the entry's allowance, each event takes its cost from it and
+   the turn ends when the next one costs more than is left. A peer flooding the client gets one
+   quantum per round like everybody else, so quiet connections don't wait behind it.
+
+   When all entries are taken, further clients share the last ones, one per class. A client only gets
+   an entry of its own once none of its events wait in the shared one, so its events stay in order.
+   The client keeps the index of its entry, and free entries are on a stack, so queueing an event
+   doesn't search the table.
+
+   LWIP_TCP_CLEAR also drops the client's events right away, from the task which closes it: the rest
+   of a turn must not reach a client onDisconnect() deleted.
+ * */
+
+#define SCHED_OWNED         (ASYNC_TCP_SSL_SCHED_ENTRIES - ASYNC_PRIORITY_CLASSES)
+#define SCHED_SHARED(cls)   (SCHED_OWNED + (cls))
+#define SCHED_NONE          0xFFFF
+
+static_assert((ASYNC_TCP_SSL_SCHED_ENTRIES > ASYNC_PRIORITY_CLASSES) && (ASYNC_TCP_SSL_SCHED_ENTRIES < SCHED_NONE),
+              "ASYNC_TCP_SSL_SCHED_ENTRIES must be above ASYNC_PRIORITY_CLASSES and fit a uint16_t");
+
+typedef struct
+{
+  void *                owner;      // client holding the entry, NULL if it's free or shared
+  lwip_event_packet_t * head;
+  lwip_event_packet_t * tail;
+  uint16_t              count;
+  uint8_t               cls;        // ready ring it's on
+  bool                  ready;      // on its ready ring, or having its turn
+  int32_t               deficit;    // allowance left, only touched by the service task
+} sched_entry_t;
+
+static sched_entry_t  _sched[ASYNC_TCP_SSL_SCHED_ENTRIES];
+static uint16_t       _sched_ring[ASYNC_PRIORITY_CLASSES][ASYNC_TCP_SSL_SCHED_ENTRIES];
+static uint16_t       _sched_ring_head[ASYNC_PRIORITY_CLASSES];
+static uint16_t       _sched_ring_count[ASYNC_PRIORITY_CLASSES];
+static uint32_t       _sched_waiting[ASYNC_PRIORITY_CLASSES];   // events in the FIFOs, by class
+static int            _sched_turn = -1;                         // entry having its turn, service task only
+static uint16_t       _sched_free[SCHED_OWNED];                 // stack of entries given back
+static uint16_t       _sched_free_count;
+static uint16_t       _sched_fresh;                             // entries below it were handed out before
+static portMUX_TYPE   _sched_mux  = portMUX_INITIALIZER_UNLOCKED;
+
 static TaskHandle_t _async_service_task_handle = NULL;
 
-static SemaphoreHandle_t _slots_lock;
+/*
+   Closed Slots
+
+   A slot handle is (generation << 16) | index. The generation of a slot is odd while it's allocated and
+   is bumped again when it's freed, so a handle stops validating as soon as its slot is released, even
+   if the index gets reused right away. Free slots form a lock-free stack whose head carries a tag in
+   the upper 16 bits against ABA.
+
+   Freeing keeps the handle in the client with CLOSED_SLOT_STALE set, so calls racing the free still
+   fail the check. INVALID_CLOSED_SLOT only means the client never had a slot (outgoing connections).
+ * */
+
 const int _number_of_closed_slots = CONFIG_LWIP_MAX_ACTIVE_TCP;
-static int _closed_slots[_number_of_closed_slots];
+
+#define CLOSED_SLOT_NONE          0xFFFF
+#define CLOSED_SLOT_INDEX(h)      ((uint32_t)(h) & 0xFFFF)
+#define CLOSED_SLOT_GEN(h)        (((uint32_t)(h) >> 16) & 0x7FFF)
+#define CLOSED_SLOT_STALE         0x80000000      // freed, the handle only fails _closed_slot_open()
+
+static uint32_t _closed_slots[_number_of_closed_slots];     // generation of each slot
+static uint16_t _closed_next[_number_of_closed_slots];      // free stack links
+static uint32_t _closed_head;                               // (tag << 16) | index of the top free slot
 
 /////////////////////////////////////////////
 
-static int _closed_index = []()
+static bool _closed_slots_ready = []()
 {
-  _slots_lock = xSemaphoreCreateBinary();
-  xSemaphoreGive(_slots_lock);
-
   for (int i = 0; i < _number_of_closed_slots; ++ i)
   {
-    _closed_slots[i] = 1;
+    _closed_next[i] = (i + 1 < _number_of_closed_slots) ? i + 1 : CLOSED_SLOT_NONE;
   }
 
-  return 1;
+  _closed_head = 0;
+
+  return true;
 }
 ();
 
 /////////////////////////////////////////////
 
-static inline bool _init_async_event_queue()
+// True if nothing was ever allocated (outgoing pcb) or the slot is still held by its client
+static inline bool _closed_slot_open(int32_t closed_slot)
 {
-  if (!_async_queue)
+  if (closed_slot == INVALID_CLOSED_SLOT)
   {
-    _async_queue = xQueueCreate(ASYNC_QUEUE_LENGTH, sizeof(lwip_event_packet_t *));
+    return true;
+  }
 
-    if (!_async_queue)
-    {
-      return false;
-    }
+  if ((uint32_t) closed_slot & CLOSED_SLOT_STALE)
+  {
+    return false;
   }
 
-  return true;
+  return ((__atomic_load_n(&_closed_slots[CLOSED_SLOT_INDEX(closed_slot)], __ATOMIC_ACQUIRE) & 0x7FFF)
+          == CLOSED_SLOT_GEN(closed_slot));
 }
 
 /////////////////////////////////////////////
 
-static inline bool _send_async_event(lwip_event_packet_t ** e)
+/*
+   DNS Cache
+
+   lwIP keeps every record for its own TTL but doesn't pass that TTL to the found callback, so a
+   resolved entry here is never served on its own: each hit asks dns_gethostbyname() again, which
+   answers synchronously from lwIP's table while the record is alive and starts a new query once it
+   expired. This layer only coalesces lookups and keeps the stats. While a lookup is in flight, other
+   clients asking for the same name are chained on the entry's waiters list instead of issuing their
+   own query, and all of them get the result when the single LWIP_TCP_DNS event is handled.
+
+   _dns_cache_lock guards the cache and _dns_stats, it exists without the cache too.
+ * */
+
+// Lookup family: ASYNC_IP_FAMILY_V4, ASYNC_IP_FAMILY_V6 or whatever lwIP resolves first
+#define ASYNC_IP_FAMILY_ANY     2
+
+#if (ASYNC_DNS_CACHE_SIZE > 0)
+
+typedef enum
 {
-  return _async_queue && xQueueSend(_async_queue, e, portMAX_DELAY) == pdPASS;
-}
+  DNS_ENTRY_FREE,
+  DNS_ENTRY_PENDING,
+  DNS_ENTRY_RESOLVED
+} dns_entry_state_t;
+
+typedef struct
+{
+  char              name[ASYNC_DNS_CACHE_NAME_LEN];
+  ip_addr_t         addr;
+  uint8_t           state;
+  uint8_t           family;
+  uint32_t          stamp;      // lookup start while pending, resolve time once resolved
+  AsyncSSLClient *  waiters;
+} dns_cache_entry_t;
+
+static dns_cache_entry_t  _dns_cache[ASYNC_DNS_CACHE_SIZE];
+
+#endif
+
+static SemaphoreHandle_t  _dns_cache_lock = xSemaphoreCreateRecursiveMutex();
+static AsyncSSLDnsStats   _dns_stats;
 
 /////////////////////////////////////////////
 
-static inline bool _prepend_async_event(lwip_event_packet_t ** e)
+/*
+   Handshake Limit
+
+   At most _hs_max secure connections run their TLS handshake at once, the others wait in a FIFO
+   linked through AsyncSSLClient::_hs_next. A finished handshake doesn't hand its turn over directly:
+   the turn stays counted in _hs_turns and the async task starts the first waiter after its current
+   event, woken by a LWIP_TCP_HANDSHAKE event when the turn was freed in another task. Waiters unlink
+   themselves when they go away. The lock is recursive and held while the async task starts a waiter,
+   so a client closed or deleted in another task right then waits for _start_tls() to return.
+ * */
+
+typedef enum
 {
-  return _async_queue && xQueueSendToFront(_async_queue, e, portMAX_DELAY) == pdPASS;
-}
+  HS_NONE,        // not limited, or done
+  HS_WAITING,     // in the FIFO
+  HS_HOLDING      // handshake running, counted in _hs_active
+} hs_state_t;
+
+static SemaphoreHandle_t  _hs_lock          = xSemaphoreCreateRecursiveMutex();
+static uint16_t           _hs_max           = ASYNC_TCP_SSL_MAX_HANDSHAKES;
+static uint16_t           _hs_active        = 0;
+static uint16_t           _hs_turns         = 0;      // freed turns still counted in _hs_active, for the waiters
+static uint32_t           _hs_wait_timeout  = ASYNC_TCP_SSL_HANDSHAKE_WAIT;
+static AsyncSSLClient *   _hs_head          = NULL;
+static AsyncSSLClient *   _hs_tail          = NULL;
+
+/////////////////////////////////////////////
+
+/*
+   Timer Wheel
+
+   Every client with a running rx, ack, handshake or handshake-wait timeout sits in the slot of its
+   earliest deadline, (deadline / ASYNC_TCP_SSL_TIMER_TICK) % ASYNC_TCP_SSL_TIMER_SLOTS. Deadlines
+   further away than one turn stay in their slot until their turn comes. The service task walks
+   the slots between its last visit and now, and waits on the event queue only until the next tick.
+
+   Activity moves deadlines later, which isn't tracked: the client is checked at the old deadline
+   and re-armed then. Only a deadline that becomes earlier moves the client right away.
+ * */
+
+static AsyncSSLClient *   _tw_slots[ASYNC_TCP_SSL_TIMER_SLOTS];
+static uint32_t           _tw_tick    = 0;      // next tick to visit
+static uint32_t           _tw_count   = 0;      // armed clients
+static portMUX_TYPE       _tw_mux     = portMUX_INITIALIZER_UNLOCKED;
 
 /////////////////////////////////////////////
 
-static inline bool _get_async_event(lwip_event_packet_t ** e)
+/*
+   Metrics
+
+   Counters bumped from more than one task (LwIP Thread, async task, application) use relaxed atomic
+   adds, the rest are plain increments. Nothing is locked, so a snapshot isn't consistent across
+   counters. The TLS record totals are kept in tcp_mbedtls.c.
+ * */
+
+static_assert(LWIP_TCP_ACK + 1 == ASYNC_TCP_SSL_EVENT_TYPES, "ASYNC_TCP_SSL_EVENT_TYPES is out of date");
+
+static AsyncSSLMetrics    _async_metrics;
+
+#define ASYNC_METRIC_ADD(counter, n)    __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// Adds to a traffic counter of the client and to the totals
+#if ASYNC_TCP_SSL_METRICS
+  #define ASYNC_CONN_METRIC_ADD(client, field, n)   \
+    do { (client)->_metrics.field += (n); ASYNC_METRIC_ADD(_async_metrics.totals.field, (n)); } while (0)
+#else
+  #define ASYNC_CONN_METRIC_ADD(client, field, n)   ASYNC_METRIC_ADD(_async_metrics.totals.field, (n))
+#endif
+
+static inline void _metric_max(uint32_t * counter, uint32_t value)
 {
-  return _async_queue && xQueueReceive(_async_queue, e, portMAX_DELAY) == pdPASS;
+  uint32_t seen = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+  while (value > seen && !__atomic_compare_exchange_n(counter, &seen, value, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
 }
 
 /////////////////////////////////////////////
 
-static bool _remove_events_with_arg(void * arg)
+/*
+   Log Ring
+
+   Log records (see AsyncTCP_SSL_Debug.h) are copied into _log_ring under a spinlock, which is held
+   for the copy only. A low priority task takes them out the same way and prints them. Positions run
+   free and wrap through the mask, records may wrap around the end of the ring.
+
+   The task sleeps on its notification while the ring is empty. Only the record which makes it
+   non-empty notifies: the task doesn't sleep again before the ring is empty, and a notification
+   given meanwhile is kept until it does.
+ * */
+
+static void _atcp_log_print(const atcp_log_record_t * record)
 {
-  lwip_event_packet_t * first_packet = NULL;
-  lwip_event_packet_t * packet       = NULL;
+  const uint8_t * arg = (const uint8_t *) record + sizeof(atcp_log_record_t);
+  bool            hex = (record->flags & ATCP_LOG_HEX);
 
-  if (!_async_queue)
+  if (record->flags & ATCP_LOG_MARK)
   {
-    return false;
+    ATCP_PRINT_MARK;
   }
 
-  //figure out which is the first packet so we can keep the order
-  while (!first_packet)
+  ATCP_PRINT(record->text);
+
+  for (uint8_t i = 0; i < record->nargs; i++)
   {
-    if (xQueueReceive(_async_queue, &first_packet, 0) != pdPASS)
+    uint8_t type = *arg++;
+
+    if (hex)
+      ATCP_PRINT_SP0X;
+    else
+      ATCP_PRINT_SP;
+
+    if (type == ATCP_LOG_ARG_STR)
     {
-      return false;
+      char str[ATCP_LOG_STR_MAX + 1];
+      uint8_t len = *arg++;
+
+      memcpy(str, arg, len);
+      str[len] = 0;
+      arg += len;
+
+      ATCP_PRINT(str);
+
+      continue;
     }
 
-    //discard packet if matching
-    if ((int)first_packet->arg == (int)arg)
+    uint32_t value;
+
+    memcpy(&value, arg, sizeof(value));
+    arg += sizeof(value);
+
+    if (hex)
     {
-      free(first_packet);
-      first_packet = NULL;
-      //return first packet to the back of the queue
+      ATCP_PRINT(value, HEX);
     }
-    else if (xQueueSend(_async_queue, &first_packet, portMAX_DELAY) != pdPASS)
+    else if (type == ATCP_LOG_ARG_INT)
     {
-      return false;
+      ATCP_PRINT((int32_t) value);
     }
-  }
-
-  while (xQueuePeek(_async_queue, &packet, 0) == pdPASS && packet != first_packet)
-  {
-    if (xQueueReceive(_async_queue, &packet, 0) != pdPASS)
+    else if (type == ATCP_LOG_ARG_FLOAT)
     {
-      return false;
-    }
+      float f;
 
-    if ((int)packet->arg == (int)arg)
-    {
-      free(packet);
-      packet = NULL;
+      memcpy(&f, &value, sizeof(f));
+      ATCP_PRINT(f);
     }
-    else if (xQueueSend(_async_queue, &packet, portMAX_DELAY) != pdPASS)
+    else
     {
-      return false;
+      ATCP_PRINT(value);
     }
   }
 
-  return true;
+  if (record->flags & ATCP_LOG_NEWLINE)
+  {
+    ATCP_PRINTLN();
+  }
 }
 
 /////////////////////////////////////////////
 
-static void _handle_async_event(lwip_event_packet_t * e)
+#if (ASYNC_TCP_SSL_LOG_RING > 0)
+
+#define LOG_RING_MASK     (ASYNC_TCP_SSL_LOG_RING - 1)
+
+static uint8_t            _log_ring[ASYNC_TCP_SSL_LOG_RING];
+static uint32_t           _log_head         = 0;      // where the next record goes
+static uint32_t           _log_tail         = 0;      // next record to print
+static uint32_t           _log_lost         = 0;      // dropped since the last report
+static portMUX_TYPE       _log_mux          = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t       _log_task_handle  = NULL;
+
+/////////////////////////////////////////////
+
+static inline void _log_ring_put(uint32_t pos, const void * src, size_t len)
 {
-  ATCP_LOGDEBUG1("_handle_async_event: Task Name = ", pcTaskGetTaskName(xTaskGetCurrentTaskHandle()));
+  size_t first = ASYNC_TCP_SSL_LOG_RING - (pos & LOG_RING_MASK);
 
-  if (e->event == LWIP_TCP_CLEAR)
-  {
-    _remove_events_with_arg(e->arg);
-  }
-  else if (e->event == LWIP_TCP_RECV)
-  {
-    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_RECV =", (uint32_t) e->recv.pcb);
-    AsyncSSLClient::_s_recv(e->arg, e->recv.pcb, e->recv.pb, e->recv.err);
-  }
-  else if (e->event == LWIP_TCP_FIN)
-  {
-    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_FIN =", (uint32_t) e->fin.pcb);
-    AsyncSSLClient::_s_fin(e->arg, e->fin.pcb, e->fin.err);
-  }
-  else if (e->event == LWIP_TCP_SENT)
+  if (first > len)
   {
-    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_SENT =", (uint32_t) e->sent.pcb);
-    AsyncSSLClient::_s_sent(e->arg, e->sent.pcb, e->sent.len);
+    first = len;
   }
-  else if (e->event == LWIP_TCP_POLL)
+
+  memcpy(&_log_ring[pos & LOG_RING_MASK], src, first);
+  memcpy(_log_ring, (const uint8_t *) src + first, len - first);
+}
+
+/////////////////////////////////////////////
+
+static inline void _log_ring_get(uint32_t pos, void * dst, size_t len)
+{
+  size_t first = ASYNC_TCP_SSL_LOG_RING - (pos & LOG_RING_MASK);
+
+  if (first > len)
   {
-    ATCP_HEXLOGDEBUG1("_handle_async_event: LWIP_TCP_POLL =", (uint32_t) e->poll.pcb);
-    AsyncSSLClient::_s_poll(e->arg, e->poll.pcb);
+    first = len;
   }
-  else if (e->event == LWIP_TCP_ERROR)
+
+  memcpy(dst, &_log_ring[pos & LOG_RING_MASK], first);
+  memcpy((uint8_t *) dst + first, _log_ring, len - first);
+}
+
+/////////////////////////////////////////////
+
+// Called by the ATCP_LOG* macros, from any task
+void _atcp_log_record(const atcp_log_record_t * record)
+{
+  bool queued = false;
+  bool wake   = false;
+
+  portENTER_CRITICAL(&_log_mux);
+
+  if (record->size <= ASYNC_TCP_SSL_LOG_RING - (_log_head - _log_tail))
   {
-    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_ERROR =", (uint32_t) e->arg);
-    ATCP_LOGINFO1("_handle_async_event: LWIP_TCP_ERROR = ", e->error.err);
-    AsyncSSLClient::_s_error(e->arg, e->error.err);
+    wake = (_log_head == _log_tail);
+
+    _log_ring_put(_log_head, record, record->size);
+    _log_head += record->size;
+    queued = true;
   }
-  else if (e->event == LWIP_TCP_CONNECTED)
+  else
   {
-    ATCP_HEXLOGINFO2("_handle_async_event: LWIP_TCP_CONNECTED =", (uint32_t) e->arg, (uint32_t) e->connected.pcb);
-    ATCP_LOGINFO1("_handle_async_event: LWIP_TCP_CONNECTED = ", e->connected.err);
-    AsyncSSLClient::_s_connected(e->arg, e->connected.pcb, e->connected.err);
+    _log_lost++;
   }
-  else if (e->event == LWIP_TCP_ACCEPT)
+
+  portEXIT_CRITICAL(&_log_mux);
+
+  if (!queued)
   {
-    ATCP_HEXLOGINFO2("_handle_async_event: LWIP_TCP_ACCEPT =", (uint32_t) e->arg, (uint32_t) e->accept.client);
-    AsyncSSLServer::_s_accepted(e->arg, e->accept.client);
+    ASYNC_METRIC_ADD(_async_metrics.log_dropped, 1);
   }
-  else if (e->event == LWIP_TCP_DNS)
+  else if (wake && _log_task_handle)
   {
-    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_DNS =", (uint32_t) e->arg);
-    ATCP_LOGINFO3("_handle_async_event: LWIP_TCP_DNS, name =", e->dns.name, ", IP =", ipaddr_ntoa(&e->dns.addr));
-    AsyncSSLClient::_s_dns_found(e->dns.name, &e->dns.addr, e->arg);
+    xTaskNotifyGive(_log_task_handle);
   }
-
-  free((void*)(e));
 }
 
 /////////////////////////////////////////////
 
-static void _async_service_task(void *pvParameters)
+static void _log_drain_task(void * pvParameters)
 {
-  lwip_event_packet_t * packet = NULL;
+  uint32_t words[ATCP_LOG_RECORD_MAX / 4];
+  atcp_log_record_t * record = (atcp_log_record_t *) words;
 
   for (;;)
   {
-    if (_get_async_event(&packet))
-    {
-#if CONFIG_ASYNC_TCP_USE_WDT
-
-      if (esp_task_wdt_add(NULL) != ESP_OK)
-      {
-        ATCP_LOGERROR("Failed to add async task to WDT");
-      }
+    bool      found = false;
+    uint32_t  lost  = 0;
 
-#endif
+    portENTER_CRITICAL(&_log_mux);
 
-      if (packet)
-        _handle_async_event(packet);
-      else
-      {
-        ATCP_LOGERROR("_async_service_task, NUL packet");
-      }
+    if (_log_head != _log_tail)
+    {
+      _log_ring_get(_log_tail, record, sizeof(atcp_log_record_t));
+      _log_ring_get(_log_tail, record, record->size);
+      _log_tail += record->size;
+      found = true;
+    }
+    else
+    {
+      lost = _log_lost;
+      _log_lost = 0;
+    }
 
-#if CONFIG_ASYNC_TCP_USE_WDT
+    portEXIT_CRITICAL(&_log_mux);
 
-      if (esp_task_wdt_delete(NULL) != ESP_OK)
-      {
-        ATCP_LOGERROR("Failed to remove loop task from WDT");
-      }
+    if (found)
+    {
+      _atcp_log_print(record);
 
-#endif
+      continue;
     }
-  }
-
-  vTaskDelete(NULL);
-  _async_service_task_handle = NULL;
-}
-
-/////////////////////////////////////////////
 
-/*
-  static void _stop_async_task(){
-    if(_async_service_task_handle){
-        vTaskDelete(_async_service_task_handle);
-        _async_service_task_handle = NULL;
+    if (lost)
+    {
+      ATCP_PRINT_MARK;
+      ATCP_PRINT(lost);
+      ATCP_PRINTLN(" log records dropped, ring full");
     }
+
+    // Nothing left, the next record notifies
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
   }
-*/
+}
 
 /////////////////////////////////////////////
 
-static bool _start_async_task()
+static bool _start_log_task()
 {
-  if (!_init_async_event_queue())
+  if (!_log_task_handle)
   {
-    return false;
+    xTaskCreateUniversal(_log_drain_task, "async_tcp_log", 3072, NULL, ASYNC_TCP_SSL_LOG_PRIORITY,
+                         &_log_task_handle, tskNO_AFFINITY);
   }
 
-  if (!_async_service_task_handle)
-  {
-    xTaskCreateUniversal(_async_service_task, "async_tcp_ssl", CONFIG_ASYNC_TCP_STACK, NULL, CONFIG_ASYNC_TCP_PRIORITY,
-                         &_async_service_task_handle, CONFIG_ASYNC_TCP_RUNNING_CORE);
+  return (_log_task_handle != NULL);
+}
 
-    if (!_async_service_task_handle)
-    {
-      return false;
-    }
-  }
+/////////////////////////////////////////////
 
-  return true;
+#else
+
+// Called by the ATCP_LOG* macros, prints right away
+void _atcp_log_record(const atcp_log_record_t * record)
+{
+  _atcp_log_print(record);
 }
 
 /////////////////////////////////////////////
 
-/*
-   LwIP Callbacks
-
-   The following "_tcp_*" functions are called by LwIP on its thread. They all do nothing but
-   package the callback info into an event, which is queued for the async event task (see above).
- * */
+#endif
 
-static int8_t _tcp_clear_events(void * arg)
+static inline bool _ip_addr_valid(const ip_addr_t * addr)
 {
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
-  e->event = LWIP_TCP_CLEAR;
-  e->arg = arg;
+#if LWIP_IPV6
 
-  if (!_prepend_async_event(&e))
+  if (IP_IS_V6(addr))
   {
-    free((void*)(e));
+    return (addr->u_addr.ip6.addr[0] || addr->u_addr.ip6.addr[1] || addr->u_addr.ip6.addr[2] || addr->u_addr.ip6.addr[3]);
   }
 
-  return ERR_OK;
+#endif
+
+  return (addr->u_addr.ip4.addr != 0);
 }
 
 /////////////////////////////////////////////
 
-static int8_t _tcp_connected(void * arg, tcp_pcb * pcb, int8_t err)
+// By ASYNC_PRIORITY_xxx class
+static const uint16_t _async_queue_length[ASYNC_PRIORITY_CLASSES] =
 {
-  ATCP_HEXLOGDEBUG1("_tcp_connected: pcb =", (uint32_t) pcb);
+  ASYNC_QUEUE_LENGTH, ASYNC_QUEUE_LENGTH_INTERACTIVE, ASYNC_QUEUE_LENGTH_BULK
+};
 
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
-  e->event = LWIP_TCP_CONNECTED;
-  e->arg = arg;
-  e->connected.pcb = pcb;
-  e->connected.err = err;
+/////////////////////////////////////////////
 
-  if (!_prepend_async_event(&e))
+static inline bool _init_async_event_queue()
+{
+  for (int i = 0; i < ASYNC_PRIORITY_CLASSES; i++)
   {
-    free((void*)(e));
+    if (!_async_queues[i])
+    {
+      _async_queues[i] = xQueueCreate(_async_queue_length[i], sizeof(lwip_event_packet_t *));
+
+      if (!_async_queues[i])
+      {
+        return false;
+      }
+    }
   }
 
-  return ERR_OK;
+  if (!_async_queue_sem)
+  {
+    _async_queue_sem = xSemaphoreCreateCounting(ASYNC_QUEUE_LENGTH + ASYNC_QUEUE_LENGTH_INTERACTIVE + ASYNC_QUEUE_LENGTH_BULK, 0);
+  }
+
+  return (_async_queue_sem != NULL);
 }
 
 /////////////////////////////////////////////
 
-static int8_t _tcp_poll(void * arg, struct tcp_pcb * pcb)
+static inline uint32_t _async_class_depth(uint8_t cls)
 {
-  ATCP_HEXLOGDEBUG1("_tcp_poll: pcb =", (uint32_t) pcb);
+  return (_async_queues[cls] ? uxQueueMessagesWaiting(_async_queues[cls]) : 0) + _sched_waiting[cls];
+}
 
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
-  e->event = LWIP_TCP_POLL;
-  e->arg = arg;
-  e->poll.pcb = pcb;
+/////////////////////////////////////////////
 
-  if (!_send_async_event(&e))
+static inline bool _queued_async_event(bool queued)
+{
+  if (queued)
   {
-    free((void*)(e));
+    xSemaphoreGive(_async_queue_sem);
+
+    _metric_max(&_async_metrics.queue_high_water, __atomic_add_fetch(&_async_queued, 1, __ATOMIC_RELAXED));
+  }
+  else
+  {
+    ASYNC_METRIC_ADD(_async_metrics.queue_failures, 1);
   }
 
-  return ERR_OK;
+  return queued;
 }
 
 /////////////////////////////////////////////
 
-static int8_t _tcp_recv(void * arg, struct tcp_pcb * pcb, struct pbuf *pb, int8_t err)
+// Class of the events of a client, arg of the LwIP callbacks
+static inline uint8_t _async_class(void * arg)
 {
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
-  e->arg = arg;
+  return arg ? reinterpret_cast<AsyncSSLClient *>(arg)->getPriority() : ASYNC_PRIORITY_NORMAL;
+}
 
-  if (pb)
-  {
-    ATCP_HEXLOGDEBUG1("_tcp_recv: pcb =", (uint32_t) pcb);
+/////////////////////////////////////////////
 
-    e->event = LWIP_TCP_RECV;
-    e->recv.pcb = pcb;
-    e->recv.pb = pb;
-    e->recv.err = err;
-  }
-  else
-  {
-    ATCP_HEXLOGDEBUG1("_tcp_recv: failed, pcb =", (uint32_t) pcb);
+/*
+   Event Latency
 
-    e->event = LWIP_TCP_FIN;
-    e->fin.pcb = pcb;
-    e->fin.err = err;
-    //close the PCB in LwIP thread
-    AsyncSSLClient::_s_lwip_fin(e->arg, e->fin.pcb, e->fin.err);
-  }
+   Every packet is stamped when it's queued. The async task puts the time it waited and the time its
+   handler took into log2 buckets of the event type. _latency_mux keeps getEventLatency() and
+   resetEventLatency() from other tasks from seeing or wiping a half-done update.
+ * */
 
-  if (!_send_async_event(&e))
-  {
-    free((void*)(e));
-  }
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
 
-  return ERR_OK;
-}
+static AsyncSSLEventLatency _event_latency[ASYNC_TCP_SSL_EVENT_TYPES];
+static portMUX_TYPE         _latency_mux = portMUX_INITIALIZER_UNLOCKED;
 
 /////////////////////////////////////////////
 
-static int8_t _tcp_sent(void * arg, struct tcp_pcb * pcb, uint16_t len)
+static inline void _latency_add(uint32_t * buckets, uint32_t * max, uint32_t us)
 {
-  ATCP_HEXLOGDEBUG1("_tcp_sent: pcb =", (uint32_t) pcb);
+  uint32_t bucket = us ? 32 - __builtin_clz(us) : 0;
 
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
-  e->event = LWIP_TCP_SENT;
-  e->arg = arg;
-  e->sent.pcb = pcb;
-  e->sent.len = len;
+  portENTER_CRITICAL(&_latency_mux);
 
-  if (!_send_async_event(&e))
+  buckets[(bucket < ASYNC_TCP_SSL_LATENCY_BUCKETS) ? bucket : ASYNC_TCP_SSL_LATENCY_BUCKETS - 1]++;
+
+  if (us > *max)
   {
-    free((void*)(e));
+    *max = us;
   }
 
-  return ERR_OK;
+  portEXIT_CRITICAL(&_latency_mux);
 }
 
 /////////////////////////////////////////////
 
-static void _tcp_error(void * arg, int8_t err)
+#endif
+
+static inline void _stamp_async_event(lwip_event_packet_t * e)
 {
-  ATCP_HEXLOGDEBUG1("_tcp_error: arg =", (uint32_t) arg);
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
+  e->queued_at = (uint32_t) esp_timer_get_time();
+#endif
+}
 
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
-  e->event = LWIP_TCP_ERROR;
-  e->arg = arg;
-  e->error.err = err;
+/////////////////////////////////////////////
 
-  if (!_send_async_event(&e))
-  {
-    free((void*)(e));
-  }
+static inline bool _send_async_event(lwip_event_packet_t ** e, uint8_t cls = ASYNC_PRIORITY_NORMAL)
+{
+  xQueueHandle queue = _async_queues[cls];
+
+  _stamp_async_event(*e);
+
+  return queue && _queued_async_event(xQueueSend(queue, e, portMAX_DELAY) == pdPASS);
 }
 
 /////////////////////////////////////////////
 
-static void _tcp_dns_found(const char * name, struct ip_addr * ipaddr, void * arg)
+static inline bool _prepend_async_event(lwip_event_packet_t ** e, uint8_t cls = ASYNC_PRIORITY_NORMAL)
 {
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  xQueueHandle queue = _async_queues[cls];
 
-  ATCP_LOGDEBUG3("_tcp_dns_found: name =", name, ", IP =", ipaddr_ntoa(ipaddr));
-  ATCP_HEXLOGDEBUG1("_tcp_dns_found: arg =", (uint32_t) arg);
+  _stamp_async_event(*e);
 
-  e->event = LWIP_TCP_DNS;
-  e->arg = arg;
-  e->dns.name = name;
+  return queue && _queued_async_event(xQueueSendToFront(queue, e, portMAX_DELAY) == pdPASS);
+}
 
-  if (ipaddr)
-  {
-    memcpy(&e->dns.addr, ipaddr, sizeof(struct ip_addr));
-  }
-  else
-  {
-    memset(&e->dns.addr, 0, sizeof(e->dns.addr));
-  }
+/////////////////////////////////////////////
 
-  if (!_send_async_event(&e))
-  {
-    free((void*)(e));
-  }
+static inline void _sched_ring_push(uint8_t cls, uint16_t index)
+{
+  _sched_ring[cls][(_sched_ring_head[cls] + _sched_ring_count[cls]) % ASYNC_TCP_SSL_SCHED_ENTRIES] = index;
+  _sched_ring_count[cls]++;
 }
 
 /////////////////////////////////////////////
 
-//Used to switch out from LwIP thread
-static int8_t _tcp_accept(void * arg, AsyncSSLClient * client)
+// Under _sched_mux: the client's own entry, a free one or the shared one of its class
+static int _sched_entry(void * arg, uint8_t cls)
 {
-  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
-  e->event = LWIP_TCP_ACCEPT;
-  e->arg = arg;
-  e->accept.client = client;
+  uint16_t * index = AsyncSSLClient::_s_sched_index(arg);
 
-  if (!_prepend_async_event(&e))
+  if (*index < SCHED_OWNED)
   {
-    free((void*)(e));
-
-    // KH Test Memory Leak
-    if (client)
+    if (_sched[*index].owner == arg)
     {
-      ATCP_LOGDEBUG("AsyncTCP_SSL: _tcp_accept: Delete Client");
-      delete (client);
-      client = nullptr;
+      return *index;
+    }
+  }
+  else if (*index != SCHED_NONE)
+  {
+    // Only taken when the table is full
+    for (lwip_event_packet_t * p = _sched[*index].head; p; p = p->next)
+    {
+      if (p->arg == arg)
+      {
+        return *index;
+      }
     }
-
-    //////
   }
 
-  return ERR_OK;
-}
+  if (_sched_free_count)
+  {
+    *index = _sched_free[--_sched_free_count];
+  }
+  else if (_sched_fresh < SCHED_OWNED)
+  {
+    *index = _sched_fresh++;
+  }
+  else
+  {
+    *index = SCHED_SHARED(cls);
 
-//////////////////////////////////////////////////////////////////////////////////////////
+    return *index;
+  }
 
-/*
-   TCP/IP API Calls
+  _sched[*index].owner = arg;
 
-   The following functions provide stubs to call into LwIP's TCP api functions on the LwIP thread
-   itself. This ensures there are no race conditions between the application and LwIP.
-   The way it works is that the `_tcp_xxx` functions synchronously call the corresponding
-   `_tcp_xxx_api` functions on the LwIP thread using a `tcp_api_call` mechanism provided by LwIP.
-   The `_tcp_xxx_api` function then finally calls the actual `tcp_xxx` function in LwIP and returns
-   the result.
- * */
+  return *index;
+}
 
-#include "lwip/priv/tcpip_priv.h"
+/////////////////////////////////////////////
 
-typedef struct
+// Queues an event of the client e->arg. ERR_MEM, with nothing queued, if the client has
+// ASYNC_TCP_SSL_SCHED_EVENTS waiting and the event may be refused
+static int8_t _sched_event(lwip_event_packet_t * e, bool refusable)
 {
-  struct tcpip_api_call_data call;
-  tcp_pcb * pcb;
-  int8_t closed_slot;
-  int8_t err;
-
-  union
+  if (!e->arg)
   {
-    struct
-    {
-      const char* data;
-      size_t size;
-      uint8_t apiflags;
-    } write;
+    return _send_async_event(&e) ? ERR_OK : ERR_MEM;
+  }
 
-    size_t received;
+  uint8_t cls = _async_class(e->arg);
 
-    struct
-    {
-      ip_addr_t * addr;
-      uint16_t port;
-      tcp_connected_fn cb;
-    } connect;
+  e->next = NULL;
+  _stamp_async_event(e);
 
-    struct
-    {
-      ip_addr_t * addr;
-      uint16_t port;
-    } bind;
+  portENTER_CRITICAL(&_sched_mux);
 
-    uint8_t backlog;
-  };
-} tcp_api_call_t;
+  int             index = _sched_entry(e->arg, cls);
+  sched_entry_t * entry = &_sched[index];
 
-/////////////////////////////////////////////
+  if (refusable && entry->count >= ASYNC_TCP_SSL_SCHED_EVENTS)
+  {
+    portEXIT_CRITICAL(&_sched_mux);
 
-static err_t _tcp_output_api(struct tcpip_api_call_data *api_call_msg)
-{
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+    ASYNC_METRIC_ADD(_async_metrics.queue_refused, 1);
 
-  msg->err = ERR_CONN;
+    return ERR_MEM;
+  }
 
-  if (msg->closed_slot == INVALID_CLOSED_SLOT || !_closed_slots[msg->closed_slot])
+  if (entry->tail)
   {
-    msg->err = tcp_output(msg->pcb);
+    entry->tail->next = e;
+  }
+  else
+  {
+    entry->head = e;
   }
 
-  return msg->err;
-}
-
-/////////////////////////////////////////////
+  entry->tail = e;
+  entry->count++;
 
-static esp_err_t _tcp_output(tcp_pcb * pcb, int8_t closed_slot)
-{
-  if (!pcb)
+  if (!entry->ready)
   {
-    return ERR_CONN;
+    entry->ready  = true;
+    entry->cls    = cls;
+
+    _sched_ring_push(cls, index);
   }
 
-  tcp_api_call_t msg;
+  _sched_waiting[entry->cls]++;
 
-  msg.pcb         = pcb;
-  msg.closed_slot = closed_slot;
+  portEXIT_CRITICAL(&_sched_mux);
 
-  tcpip_api_call(_tcp_output_api, (struct tcpip_api_call_data*)&msg);
+  _queued_async_event(true);
 
-  return msg.err;
+  return ERR_OK;
 }
 
 /////////////////////////////////////////////
 
-static err_t _tcp_write_api(struct tcpip_api_call_data *api_call_msg)
+// An event dropped unhandled leaves _async_queued, a LWIP_TCP_RECV still owns its pbuf. Not under a portMUX
+static void _drop_async_event(lwip_event_packet_t * e)
 {
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
-
-  msg->err = ERR_CONN;
+  __atomic_fetch_sub(&_async_queued, 1, __ATOMIC_RELAXED);
 
-  if (msg->closed_slot == INVALID_CLOSED_SLOT || !_closed_slots[msg->closed_slot])
+  if (e->event == LWIP_TCP_RECV && e->recv.pb)
   {
-    msg->err = tcp_write(msg->pcb, msg->write.data, msg->write.size, msg->write.apiflags);
+    pbuf_free(e->recv.pb);
   }
 
-  return msg->err;
+  free(e);
 }
 
 /////////////////////////////////////////////
 
-static esp_err_t _tcp_write(tcp_pcb * pcb, int8_t closed_slot, const char* data, size_t size, uint8_t apiflags)
+static inline int32_t _sched_cost(lwip_event_packet_t * e)
 {
-  if (!pcb)
-  {
-    return ERR_CONN;
-  }
-
-  tcp_api_call_t msg;
-
-  msg.pcb            = pcb;
-  msg.closed_slot    = closed_slot;
-  msg.write.data     = data;
-  msg.write.size     = size;
-  msg.write.apiflags = apiflags;
-
-  tcpip_api_call(_tcp_write_api, (struct tcpip_api_call_data*)&msg);
-
-  return msg.err;
+  return (e->event == LWIP_TCP_RECV && e->recv.pb) ? e->recv.pb->tot_len : ASYNC_TCP_SSL_EVENT_COST;
 }
 
 /////////////////////////////////////////////
 
-static err_t _tcp_recved_api(struct tcpip_api_call_data *api_call_msg)
+// In the async task: the next event of the entry having its turn, false when the turn is over
+static bool _sched_take(lwip_event_packet_t ** e)
 {
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+  sched_entry_t * entry = &_sched[_sched_turn];
 
-  msg->err = ERR_CONN;
+  portENTER_CRITICAL(&_sched_mux);
+
+  lwip_event_packet_t * head = entry->head;
 
-  if (msg->closed_slot == INVALID_CLOSED_SLOT || !_closed_slots[msg->closed_slot])
+  if (head && _sched_cost(head) <= entry->deficit)
   {
-    msg->err = 0;
+    entry->deficit -= _sched_cost(head);
+    entry->head     = head->next;
 
-    tcp_recved(msg->pcb, msg->received);
-  }
+    if (!entry->head)
+    {
+      entry->tail = NULL;
+    }
 
-  return msg->err;
-}
+    entry->count--;
+    _sched_waiting[entry->cls]--;
 
-/////////////////////////////////////////////
+    portEXIT_CRITICAL(&_sched_mux);
 
-static esp_err_t _tcp_recved(tcp_pcb * pcb, int8_t closed_slot, size_t len)
-{
-  if (!pcb)
+    *e = head;
+
+    return true;
+  }
+
+  if (head)
   {
-    return ERR_CONN;
+    // To the back of the ring, with what's left of the allowance
+    _sched_ring_push(entry->cls, _sched_turn);
   }
+  else
+  {
+    if (entry->owner)
+    {
+      _sched_free[_sched_free_count++] = _sched_turn;
+    }
 
-  tcp_api_call_t msg;
+    entry->owner    = NULL;
+    entry->ready    = false;
+    entry->deficit  = 0;
+  }
 
-  msg.pcb         = pcb;
-  msg.closed_slot = closed_slot;
-  msg.received    = len;
+  _sched_turn = -1;
 
-  tcpip_api_call(_tcp_recved_api, (struct tcpip_api_call_data*)&msg);
+  portEXIT_CRITICAL(&_sched_mux);
 
-  return msg.err;
+  return false;
 }
 
 /////////////////////////////////////////////
 
-static err_t _tcp_close_api(struct tcpip_api_call_data *api_call_msg)
+// Any task: drops the events of a client which went away. Emptied entries stay on their ready ring
+// until their turn gives them back, also the one having its turn now
+static void _sched_remove(void * arg)
 {
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+  lwip_event_packet_t * removed = NULL;
 
-  msg->err = ERR_CONN;
+  portENTER_CRITICAL(&_sched_mux);
 
-  if (msg->closed_slot == INVALID_CLOSED_SLOT || !_closed_slots[msg->closed_slot])
+  for (int i = 0; i < ASYNC_TCP_SSL_SCHED_ENTRIES; i++)
   {
-    msg->err = tcp_close(msg->pcb);
-  }
+    sched_entry_t *         entry = &_sched[i];
+    lwip_event_packet_t **  link  = &entry->head;
 
-  return msg->err;
-}
+    entry->tail = NULL;
+
+    while (*link)
+    {
+      lwip_event_packet_t * p = *link;
+
+      if (p->arg == arg)
+      {
+        *link   = p->next;
+        p->next = removed;
+        removed = p;
+
+        entry->count--;
+        _sched_waiting[entry->cls]--;
+      }
+      else
+      {
+        entry->tail = p;
+        link        = &p->next;
+      }
+    }
+  }
+
+  portEXIT_CRITICAL(&_sched_mux);
+
+  while (removed)
+  {
+    lwip_event_packet_t * next = removed->next;
+
+    _drop_async_event(removed);
+    removed = next;
+  }
+}
+
+/////////////////////////////////////////////
+
+static inline bool _async_class_ready(uint8_t cls)
+{
+  return uxQueueMessagesWaiting(_async_queues[cls]) || _sched_ring_count[cls];
+}
+
+/////////////////////////////////////////////
+
+static inline bool _async_ready()
+{
+  for (int i = 0; i < ASYNC_PRIORITY_CLASSES; i++)
+  {
+    if (_async_class_ready(i))
+    {
+      return true;
+    }
+  }
+
+  return (_sched_turn >= 0);
+}
+
+/////////////////////////////////////////////
+
+// In the async task: the class to serve next, -1 if none has anything waiting
+static int _async_pick()
+{
+  int pick = -1;
+
+  for (int i = 0; i < ASYNC_PRIORITY_CLASSES; i++)
+  {
+    uint8_t cls = _async_class_order[i];
+
+    if (!_async_class_ready(cls))
+    {
+      _async_passed[cls] = 0;
+    }
+    else if (pick < 0)
+    {
+      pick = cls;
+    }
+    else if (_async_passed[cls] >= ASYNC_TCP_SSL_PRIORITY_AGING && _async_passed[pick] < ASYNC_TCP_SSL_PRIORITY_AGING)
+    {
+      ASYNC_METRIC_ADD(_async_metrics.queue_aged, 1);
+
+      pick = cls;
+    }
+  }
+
+  if (pick < 0)
+  {
+    return -1;
+  }
+
+  // Everyone waiting but the one served was passed over once more
+  for (int cls = 0; cls < ASYNC_PRIORITY_CLASSES; cls++)
+  {
+    if (cls == pick)
+    {
+      _async_passed[cls] = 0;
+    }
+    else if (_async_class_ready(cls) && _async_passed[cls] < 0xFF)
+    {
+      _async_passed[cls]++;
+    }
+  }
+
+  return pick;
+}
+
+/////////////////////////////////////////////
+
+// In the async task: one event from the class queues or the connection having its turn. Only waits
+// when there's nothing to do, the semaphore counts may be off as events get removed
+static bool _get_async_event(lwip_event_packet_t ** e, TickType_t wait)
+{
+  if (!_async_queue_sem)
+  {
+    return false;
+  }
+
+  if (xSemaphoreTake(_async_queue_sem, _async_ready() ? 0 : wait) != pdTRUE && !_async_ready())
+  {
+    return false;
+  }
+
+  while (true)
+  {
+    if (_sched_turn >= 0 && _sched_take(e))
+    {
+      __atomic_fetch_sub(&_async_queued, 1, __ATOMIC_RELAXED);
+
+      return true;
+    }
+
+    int pick = _async_pick();
+
+    if (pick < 0)
+    {
+      return false;
+    }
+
+    // Control events first, they are few and short
+    if (uxQueueMessagesWaiting(_async_queues[pick]))
+    {
+      if (xQueueReceive(_async_queues[pick], e, 0) != pdPASS)
+      {
+        return false;
+      }
+
+      __atomic_fetch_sub(&_async_queued, 1, __ATOMIC_RELAXED);
+
+      return true;
+    }
+
+    portENTER_CRITICAL(&_sched_mux);
+
+    _sched_turn = _sched_ring[pick][_sched_ring_head[pick]];
+
+    _sched_ring_head[pick] = (_sched_ring_head[pick] + 1) % ASYNC_TCP_SSL_SCHED_ENTRIES;
+    _sched_ring_count[pick]--;
+
+    _sched[_sched_turn].deficit += ASYNC_TCP_SSL_QUANTUM;
+
+    portEXIT_CRITICAL(&_sched_mux);
+  }
+}
+
+/////////////////////////////////////////////
+
+static bool _remove_events_with_arg(xQueueHandle queue, void * arg)
+{
+  lwip_event_packet_t * first_packet = NULL;
+  lwip_event_packet_t * packet       = NULL;
+
+  if (!queue)
+  {
+    return false;
+  }
+
+  //figure out which is the first packet so we can keep the order
+  while (!first_packet)
+  {
+    if (xQueueReceive(queue, &first_packet, 0) != pdPASS)
+    {
+      return false;
+    }
+
+    //discard packet if matching
+    if (first_packet->arg == arg)
+    {
+      _drop_async_event(first_packet);
+      first_packet = NULL;
+      //return first packet to the back of the queue
+    }
+    else if (xQueueSend(queue, &first_packet, portMAX_DELAY) != pdPASS)
+    {
+      return false;
+    }
+  }
+
+  while (xQueuePeek(queue, &packet, 0) == pdPASS && packet != first_packet)
+  {
+    if (xQueueReceive(queue, &packet, 0) != pdPASS)
+    {
+      return false;
+    }
+
+    if (packet->arg == arg)
+    {
+      _drop_async_event(packet);
+      packet = NULL;
+    }
+    else if (xQueueSend(queue, &packet, portMAX_DELAY) != pdPASS)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////
+
+static void _handle_async_event(lwip_event_packet_t * e)
+{
+  ATCP_LOGDEBUG1("_handle_async_event: Task Name = ", pcTaskGetTaskName(xTaskGetCurrentTaskHandle()));
+
+  // Only the async task handles events
+  _async_metrics.events[e->event]++;
+
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
+  AsyncSSLEventLatency * latency = &_event_latency[e->event];
+  uint32_t started = (uint32_t) esp_timer_get_time();
+
+  _latency_add(latency->queued, &latency->queued_max, started - e->queued_at);
+#endif
+
+  if (e->event == LWIP_TCP_CLEAR)
+  {
+    for (int i = 0; i < ASYNC_PRIORITY_CLASSES; i++)
+    {
+      _remove_events_with_arg(_async_queues[i], e->arg);
+    }
+
+    _sched_remove(e->arg);
+  }
+  else if (e->event == LWIP_TCP_RECV)
+  {
+    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_RECV =", (uint32_t)(uintptr_t) e->recv.pcb);
+    AsyncSSLClient::_s_recv(e->arg, e->recv.pcb, e->recv.pb, e->recv.err);
+  }
+  else if (e->event == LWIP_TCP_FIN)
+  {
+    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_FIN =", (uint32_t)(uintptr_t) e->fin.pcb);
+    AsyncSSLClient::_s_fin(e->arg, e->fin.pcb, e->fin.err);
+  }
+  else if (e->event == LWIP_TCP_SENT)
+  {
+    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_SENT =", (uint32_t)(uintptr_t) e->sent.pcb);
+    AsyncSSLClient::_s_sent(e->arg, e->sent.pcb, e->sent.len, e->sent.acked);
+  }
+  else if (e->event == LWIP_TCP_POLL)
+  {
+    ATCP_HEXLOGDEBUG1("_handle_async_event: LWIP_TCP_POLL =", (uint32_t)(uintptr_t) e->poll.pcb);
+    AsyncSSLClient::_s_poll(e->arg, e->poll.pcb);
+  }
+  else if (e->event == LWIP_TCP_ERROR)
+  {
+    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_ERROR =", (uint32_t)(uintptr_t) e->arg);
+    ATCP_LOGINFO1("_handle_async_event: LWIP_TCP_ERROR = ", e->error.err);
+    AsyncSSLClient::_s_error(e->arg, e->error.err);
+  }
+  else if (e->event == LWIP_TCP_CONNECTED)
+  {
+    ATCP_HEXLOGINFO2("_handle_async_event: LWIP_TCP_CONNECTED =", (uint32_t)(uintptr_t) e->arg, (uint32_t)(uintptr_t) e->connected.pcb);
+    ATCP_LOGINFO1("_handle_async_event: LWIP_TCP_CONNECTED = ", e->connected.err);
+    AsyncSSLClient::_s_connected(e->arg, e->connected.pcb, e->connected.err);
+  }
+  else if (e->event == LWIP_TCP_ACCEPT)
+  {
+    ATCP_HEXLOGINFO2("_handle_async_event: LWIP_TCP_ACCEPT =", (uint32_t)(uintptr_t) e->arg, (uint32_t)(uintptr_t) e->accept.client);
+    AsyncSSLServer::_s_accepted(e->arg, e->accept.client);
+  }
+  else if (e->event == LWIP_TCP_DNS)
+  {
+    ATCP_HEXLOGINFO1("_handle_async_event: LWIP_TCP_DNS =", (uint32_t)(uintptr_t) e->arg);
+    ATCP_LOGINFO3("_handle_async_event: LWIP_TCP_DNS, name =", e->dns.name, ", IP =", ipaddr_ntoa(&e->dns.addr));
+
+    if (e->dns.cached)
+      AsyncSSLClient::_s_dns_cache_found(e->dns.name, &e->dns.addr, e->arg);
+    else
+      AsyncSSLClient::_s_dns_found(e->dns.name, &e->dns.addr, e->arg, e->dns.resolved);
+  }
+  else if (e->event == LWIP_TCP_HANDSHAKE)
+  {
+    // Nothing to do, the turns are handed out after each event below
+    ATCP_LOGINFO("_handle_async_event: LWIP_TCP_HANDSHAKE");
+  }
+  else if (e->event == LWIP_TCP_TIMER)
+  {
+    // Nothing to do, the service task only had to wake up and recompute its wait
+  }
+  else if (e->event == LWIP_TCP_ACK)
+  {
+    AsyncSSLClient::_s_ack(e->arg, e->ack.len);
+  }
+
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
+  _latency_add(latency->handler, &latency->handler_max, (uint32_t) esp_timer_get_time() - started);
+#endif
+
+  free((void*)(e));
+}
+
+/////////////////////////////////////////////
+
+static void _async_service_task(void *pvParameters)
+{
+  lwip_event_packet_t * packet = NULL;
+  TickType_t wait = portMAX_DELAY;
+
+  for (;;)
+  {
+    bool got = _get_async_event(&packet, wait);
+
+    // Timeouts are due even when events keep coming in
+    wait = AsyncSSLClient::_s_timers(millis());
+
+    if (got)
+    {
+#if CONFIG_ASYNC_TCP_USE_WDT
+
+      if (esp_task_wdt_add(NULL) != ESP_OK)
+      {
+        ATCP_LOGERROR("Failed to add async task to WDT");
+      }
+
+#endif
+
+      if (packet)
+        _handle_async_event(packet);
+      else
+      {
+        ATCP_LOGERROR("_async_service_task, NUL packet");
+      }
+
+#if CONFIG_ASYNC_TCP_USE_WDT
+
+      if (esp_task_wdt_delete(NULL) != ESP_OK)
+      {
+        ATCP_LOGERROR("Failed to remove loop task from WDT");
+      }
+
+#endif
+    }
+
+    // Handshake turns freed by the timers or the event, or woken up by LWIP_TCP_HANDSHAKE
+    AsyncSSLClient::_s_handshake_turn();
+  }
+
+  vTaskDelete(NULL);
+  _async_service_task_handle = NULL;
+}
+
+/////////////////////////////////////////////
+
+/*
+  static void _stop_async_task(){
+    if(_async_service_task_handle){
+        vTaskDelete(_async_service_task_handle);
+        _async_service_task_handle = NULL;
+    }
+  }
+*/
+
+/////////////////////////////////////////////
+
+static bool _start_async_task()
+{
+  if (!_init_async_event_queue())
+  {
+    return false;
+  }
+
+#if (ASYNC_TCP_SSL_LOG_RING > 0)
+  // Records logged before keep waiting in the ring, without the task the log just stays quiet
+  _start_log_task();
+#endif
+
+  if (!_async_service_task_handle)
+  {
+    xTaskCreateUniversal(_async_service_task, "async_tcp_ssl", CONFIG_ASYNC_TCP_STACK, NULL, CONFIG_ASYNC_TCP_PRIORITY,
+                         &_async_service_task_handle, CONFIG_ASYNC_TCP_RUNNING_CORE);
+
+    if (!_async_service_task_handle)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////
+
+/*
+   LwIP Callbacks
+
+   The following "_tcp_*" functions are called by LwIP on its thread. They all do nothing but
+   package the callback info into an event, which is queued for the async event task (see above).
+ * */
+
+static int8_t _tcp_clear_events(void * arg)
+{
+  // Right away: the service task may be in the middle of the client's turn
+  _sched_remove(arg);
+
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  e->event = LWIP_TCP_CLEAR;
+  e->arg = arg;
+
+  if (!_prepend_async_event(&e, ASYNC_PRIORITY_INTERACTIVE))
+  {
+    free((void*)(e));
+  }
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+static int8_t _tcp_connected(void * arg, tcp_pcb * pcb, int8_t err)
+{
+  ATCP_HEXLOGDEBUG1("_tcp_connected: pcb =", (uint32_t)(uintptr_t) pcb);
+
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  e->event = LWIP_TCP_CONNECTED;
+  e->arg = arg;
+  e->connected.pcb = pcb;
+  e->connected.err = err;
+
+  if (_sched_event(e, false) != ERR_OK)
+  {
+    free((void*)(e));
+  }
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+static int8_t _tcp_poll(void * arg, struct tcp_pcb * pcb)
+{
+  ATCP_HEXLOGDEBUG1("_tcp_poll: pcb =", (uint32_t)(uintptr_t) pcb);
+
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  e->event = LWIP_TCP_POLL;
+  e->arg = arg;
+  e->poll.pcb = pcb;
+
+  if (_sched_event(e, false) != ERR_OK)
+  {
+    free((void*)(e));
+  }
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+static int8_t _tcp_recv(void * arg, struct tcp_pcb * pcb, struct pbuf *pb, int8_t err)
+{
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  e->arg = arg;
+
+  if (pb)
+  {
+    ATCP_HEXLOGDEBUG1("_tcp_recv: pcb =", (uint32_t)(uintptr_t) pcb);
+
+    e->event = LWIP_TCP_RECV;
+    e->recv.pcb = pcb;
+    e->recv.pb = pb;
+    e->recv.err = err;
+  }
+  else
+  {
+    ATCP_HEXLOGDEBUG1("_tcp_recv: failed, pcb =", (uint32_t)(uintptr_t) pcb);
+
+    e->event = LWIP_TCP_FIN;
+    e->fin.pcb = pcb;
+    e->fin.err = err;
+    //close the PCB in LwIP thread
+    AsyncSSLClient::_s_lwip_fin(e->arg, e->fin.pcb, e->fin.err);
+  }
+
+  // Too much waiting already: lwIP keeps pb as refused data and offers it again later
+  if (_sched_event(e, pb != NULL) != ERR_OK)
+  {
+    free((void*)(e));
+
+    return pb ? ERR_MEM : ERR_OK;
+  }
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+static int8_t _tcp_sent(void * arg, struct tcp_pcb * pcb, uint16_t len)
+{
+  ATCP_HEXLOGDEBUG1("_tcp_sent: pcb =", (uint32_t)(uintptr_t) pcb);
+
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  e->event = LWIP_TCP_SENT;
+  e->arg = arg;
+  e->sent.pcb = pcb;
+  e->sent.len = len;
+  e->sent.acked = pcb->lastack;
+
+  if (_sched_event(e, false) != ERR_OK)
+  {
+    free((void*)(e));
+  }
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+static void _tcp_error(void * arg, int8_t err)
+{
+  ATCP_HEXLOGDEBUG1("_tcp_error: arg =", (uint32_t)(uintptr_t) arg);
+
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  e->event = LWIP_TCP_ERROR;
+  e->arg = arg;
+  e->error.err = err;
+
+  if (_sched_event(e, false) != ERR_OK)
+  {
+    free((void*)(e));
+  }
+}
+
+/////////////////////////////////////////////
+
+// Not a LwIP callback: wakes the service task up when the first timer is armed from another task
+static void _tcp_timer_wake()
+{
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+
+  if (!e)
+  {
+    return;
+  }
+
+  e->event = LWIP_TCP_TIMER;
+  e->arg = NULL;
+
+  if (!_send_async_event(&e))
+  {
+    free((void*)(e));
+  }
+}
+
+/////////////////////////////////////////////
+
+// Not a LwIP callback: a handshake turn became free in another task and there are waiters. Only wakes
+// the async task up, without it the turn waits for its next event or timer
+static void _tcp_handshake_turn()
+{
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+
+  if (!e)
+  {
+    return;
+  }
+
+  e->event = LWIP_TCP_HANDSHAKE;
+  e->arg = NULL;
+
+  if (!_send_async_event(&e))
+  {
+    free((void*)(e));
+  }
+}
+
+/////////////////////////////////////////////
+
+// Not a LwIP callback: ack() of a secure connection outside the async task, which owns its held records
+static bool _tcp_ack_event(void * arg, size_t len, uint8_t cls)
+{
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+
+  if (!e)
+  {
+    return false;
+  }
+
+  e->event   = LWIP_TCP_ACK;
+  e->arg     = arg;
+  e->ack.len = len;
+
+  if (!_send_async_event(&e, cls))
+  {
+    free((void*)(e));
+
+    return false;
+  }
+
+  return true;
+}
+/////////////////////////////////////////////
+
+static void _tcp_dns_event(const char * name, struct ip_addr * ipaddr, void * arg, bool cached, uint8_t resolved)
+{
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+
+  ATCP_LOGDEBUG3("_tcp_dns_found: name =", name, ", IP =", ipaddr_ntoa(ipaddr));
+  ATCP_HEXLOGDEBUG1("_tcp_dns_found: arg =", (uint32_t)(uintptr_t) arg);
+
+  e->event = LWIP_TCP_DNS;
+  e->arg = arg;
+  e->dns.name = name;
+  e->dns.cached = cached;
+  e->dns.resolved = resolved;
+
+  if (ipaddr)
+  {
+    memcpy(&e->dns.addr, ipaddr, sizeof(struct ip_addr));
+  }
+  else
+  {
+    memset(&e->dns.addr, 0, sizeof(e->dns.addr));
+  }
+
+  if (!_send_async_event(&e, cached ? ASYNC_PRIORITY_NORMAL : _async_class(arg)))
+  {
+    free((void*)(e));
+  }
+}
+
+/////////////////////////////////////////////
+
+static void _tcp_dns_found(const char * name, struct ip_addr * ipaddr, void * arg)
+{
+  _tcp_dns_event(name, ipaddr, arg, false, 0xFF);
+}
+
+/////////////////////////////////////////////
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+
+// Uncached dual-stack lookups: the client is the arg of both, the callback tells the families apart
+static void _tcp_dns_found_v4(const char * name, struct ip_addr * ipaddr, void * arg)
+{
+  _tcp_dns_event(name, ipaddr, arg, false, 1 << ASYNC_IP_FAMILY_V4);
+}
+
+/////////////////////////////////////////////
+
+static void _tcp_dns_found_v6(const char * name, struct ip_addr * ipaddr, void * arg)
+{
+  _tcp_dns_event(name, ipaddr, arg, false, 1 << ASYNC_IP_FAMILY_V6);
+}
+
+#endif
+
+/////////////////////////////////////////////
+
+#if (ASYNC_DNS_CACHE_SIZE > 0)
+
+static void _tcp_dns_cache_found(const char * name, struct ip_addr * ipaddr, void * entry)
+{
+  _tcp_dns_event(name, ipaddr, entry, true, 0);
+}
+
+#endif
+
+/////////////////////////////////////////////
+
+//Used to switch out from LwIP thread
+static int8_t _tcp_accept(void * arg, AsyncSSLClient * client)
+{
+  lwip_event_packet_t * e = (lwip_event_packet_t *) malloc(sizeof(lwip_event_packet_t));
+  e->event = LWIP_TCP_ACCEPT;
+  e->arg = arg;
+  e->accept.client = client;
+
+  if (!_prepend_async_event(&e))
+  {
+    free((void*)(e));
+
+    // KH Test Memory Leak
+    if (client)
+    {
+      ATCP_LOGDEBUG("AsyncTCP_SSL: _tcp_accept: Delete Client");
+      delete (client);
+      client = nullptr;
+    }
+
+    //////
+  }
+
+  return ERR_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   TCP/IP API Calls
+
+   The following functions provide stubs to call into LwIP's TCP api functions on the LwIP thread
+   itself. This ensures there are no race conditions between the application and LwIP.
+   The way it works is that the `_tcp_xxx` functions synchronously call the corresponding
+   `_tcp_xxx_api` functions on the LwIP thread using a `tcp_api_call` mechanism provided by LwIP.
+   The `_tcp_xxx_api` function then finally calls the actual `tcp_xxx` function in LwIP and returns
+   the result.
+ * */
+
+#include "lwip/priv/tcpip_priv.h"
+
+typedef struct
+{
+  struct tcpip_api_call_data call;
+  tcp_pcb * pcb;
+  int32_t closed_slot;
+  int8_t err;
+
+  union
+  {
+    struct
+    {
+      const char* data;
+      size_t size;
+      uint8_t apiflags;
+      uint32_t end;       // snd_lbb after the write
+    } write;
+
+    struct
+    {
+      uint32_t lastack;
+      uint32_t snd_lbb;
+    } seq;
+
+    struct
+    {
+      bool on;
+      void * now;       // client to queue a LWIP_TCP_POLL for right away, or NULL
+    } poll;
+
+    size_t received;
+
+    struct
+    {
+      ip_addr_t * addr;
+      uint16_t port;
+      tcp_connected_fn cb;
+    } connect;
+
+    struct
+    {
+      ip_addr_t * addr;
+      uint16_t port;
+    } bind;
+
+    uint8_t backlog;
+
+    struct
+    {
+      AsyncSSLClient * client;
+      ip_addr_t * addr;
+      uint8_t resolved;
+    } race;
+  };
+} tcp_api_call_t;
+
+/////////////////////////////////////////////
+
+static err_t _tcp_output_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = ERR_CONN;
+
+  if (_closed_slot_open(msg->closed_slot))
+  {
+    msg->err = tcp_output(msg->pcb);
+  }
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static esp_err_t _tcp_output(tcp_pcb * pcb, int32_t closed_slot)
+{
+  if (!pcb)
+  {
+    return ERR_CONN;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = closed_slot;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_OUTPUT], 1);
+  tcpip_api_call(_tcp_output_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_write_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = ERR_CONN;
+
+  if (_closed_slot_open(msg->closed_slot))
+  {
+    msg->err        = tcp_write(msg->pcb, msg->write.data, msg->write.size, msg->write.apiflags);
+    msg->write.end  = msg->pcb->snd_lbb;
+  }
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+// end (if not NULL) is set to where the write ends in the send sequence, the write token
+static esp_err_t _tcp_write(tcp_pcb * pcb, int32_t closed_slot, const char* data, size_t size, uint8_t apiflags,
+                            uint32_t * end = NULL)
+{
+  if (!pcb)
+  {
+    return ERR_CONN;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb            = pcb;
+  msg.closed_slot    = closed_slot;
+  msg.write.data     = data;
+  msg.write.size     = size;
+  msg.write.apiflags = apiflags;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_WRITE], 1);
+  tcpip_api_call(_tcp_write_api, (struct tcpip_api_call_data*)&msg);
+
+  if (end && msg.err == ERR_OK)
+  {
+    *end = msg.write.end;
+  }
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_seq_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = ERR_CONN;
+
+  if (_closed_slot_open(msg->closed_slot))
+  {
+    msg->seq.lastack  = msg->pcb->lastack;
+    msg->seq.snd_lbb  = msg->pcb->snd_lbb;
+    msg->err          = ERR_OK;
+  }
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+// What the peer ACKed and where the queued data ends, for the write tokens. Only lwIP's thread may
+// read them from the pcb
+static esp_err_t _tcp_seq(tcp_pcb * pcb, int32_t closed_slot, uint32_t * lastack, uint32_t * snd_lbb)
+{
+  if (!pcb)
+  {
+    return ERR_CONN;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = closed_slot;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_SEQ], 1);
+  tcpip_api_call(_tcp_seq_api, (struct tcpip_api_call_data*)&msg);
+
+  if (msg.err == ERR_OK)
+  {
+    if (lastack)
+      *lastack = msg.seq.lastack;
+
+    if (snd_lbb)
+      *snd_lbb = msg.seq.snd_lbb;
+  }
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_poll_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = ERR_CONN;
+
+  if (_closed_slot_open(msg->closed_slot))
+  {
+    tcp_poll(msg->pcb, msg->poll.on ? &_tcp_poll : NULL, msg->poll.on ? 1 : 0);
+
+    if (msg->poll.on && msg->poll.now)
+    {
+      _tcp_poll(msg->poll.now, msg->pcb);
+    }
+
+    msg->err = ERR_OK;
+  }
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static esp_err_t _tcp_set_poll(tcp_pcb * pcb, int32_t closed_slot, bool on, void * now)
+{
+  if (!pcb)
+  {
+    return ERR_CONN;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = closed_slot;
+  msg.poll.on     = on;
+  msg.poll.now    = now;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_POLL], 1);
+  tcpip_api_call(_tcp_poll_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_recved_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = ERR_CONN;
+
+  if (_closed_slot_open(msg->closed_slot))
+  {
+    msg->err = 0;
+
+    tcp_recved(msg->pcb, msg->received);
+  }
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static esp_err_t _tcp_recved(tcp_pcb * pcb, int32_t closed_slot, size_t len)
+{
+  if (!pcb)
+  {
+    return ERR_CONN;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = closed_slot;
+  msg.received    = len;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_RECVED], 1);
+  tcpip_api_call(_tcp_recved_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_close_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = ERR_CONN;
+
+  if (_closed_slot_open(msg->closed_slot))
+  {
+    msg->err = tcp_close(msg->pcb);
+  }
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static esp_err_t _tcp_close(tcp_pcb * pcb, int32_t closed_slot)
+{
+  if (!pcb)
+  {
+    return ERR_CONN;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = closed_slot;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_CLOSE], 1);
+  tcpip_api_call(_tcp_close_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_abort_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = ERR_CONN;
+
+  if (_closed_slot_open(msg->closed_slot))
+  {
+    tcp_abort(msg->pcb);
+  }
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static esp_err_t _tcp_abort(tcp_pcb * pcb, int32_t closed_slot)
+{
+  if (!pcb)
+  {
+    return ERR_CONN;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = closed_slot;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_ABORT], 1);
+  tcpip_api_call(_tcp_abort_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_connect_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = tcp_connect(msg->pcb, msg->connect.addr, msg->connect.port, msg->connect.cb);
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static esp_err_t _tcp_connect(tcp_pcb * pcb, int32_t closed_slot, ip_addr_t * addr, uint16_t port, tcp_connected_fn cb)
+{
+  if (!pcb)
+  {
+    return ESP_FAIL;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb          = pcb;
+  msg.closed_slot  = closed_slot;
+  msg.connect.addr = addr;
+  msg.connect.port = port;
+  msg.connect.cb   = cb;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_CONNECT], 1);
+  tcpip_api_call(_tcp_connect_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_bind_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = tcp_bind(msg->pcb, msg->bind.addr, msg->bind.port);
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static esp_err_t _tcp_bind(tcp_pcb * pcb, ip_addr_t * addr, uint16_t port)
+{
+  if (!pcb)
+  {
+    return ESP_FAIL;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = INVALID_CLOSED_SLOT;
+  msg.bind.addr   = addr;
+  msg.bind.port   = port;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_BIND], 1);
+  tcpip_api_call(_tcp_bind_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err;
+}
+
+/////////////////////////////////////////////
+
+static err_t _tcp_listen_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+
+  msg->err = 0;
+
+  msg->pcb = tcp_listen_with_backlog(msg->pcb, msg->backlog);
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+static tcp_pcb * _tcp_listen_with_backlog(tcp_pcb * pcb, uint8_t backlog)
+{
+  if (!pcb)
+  {
+    return NULL;
+  }
+
+  tcp_api_call_t msg;
+
+  msg.pcb         = pcb;
+  msg.closed_slot = INVALID_CLOSED_SLOT;
+  msg.backlog     = backlog ? backlog : 0xFF;
+
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_LISTEN], 1);
+  tcpip_api_call(_tcp_listen_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.pcb;
+}
+
+/////////////////////////////////////////////
+
+// KH
+extern "C"
+{
+  // The following API stubs are for use in tcp_mbedtls.c
+  // They are callable from C and take a void* instead of an AsyncSSLClient*.
+
+  esp_err_t _tcp_output4ssl(tcp_pcb * pcb, void* client)
+  {
+    // KH
+    return _tcp_output(pcb, (reinterpret_cast<AsyncSSLClient *> (client) )->getClosed_Slot() );
+    //////
+  }
+
+  esp_err_t _tcp_write4ssl(tcp_pcb * pcb, const char* data, size_t size, uint8_t apiflags, void* client, uint32_t* end)
+  {
+    // KH
+    AsyncSSLClient * c = reinterpret_cast<AsyncSSLClient *> (client);
+
+    esp_err_t err = _tcp_write(pcb, c->getClosed_Slot(), data, size, apiflags, end);
+
+    if (err == ERR_OK)
+    {
+      ASYNC_CONN_METRIC_ADD(c, bytes_out, size);
+    }
+
+    return err;
+    //////
+  }
+
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Legacy Callbacks
+
+   The std::function onXxx() API as an AsyncSSLClientHandler. Only clients which use it pay for it.
+ * */
+
+class AsyncSSLCallbacks : public AsyncSSLClientHandler
+{
+  public:
+    AsyncSSLCallbacks()
+      : _connect_cb(0)
+      , _connect_cb_arg(0)
+      , _discard_cb(0)
+      , _discard_cb_arg(0)
+      , _sent_cb(0)
+      , _sent_cb_arg(0)
+      , _error_cb(0)
+      , _error_cb_arg(0)
+      , _recv_cb(0)
+      , _recv_cb_arg(0)
+      , _pb_cb(0)
+      , _pb_cb_arg(0)
+      , _timeout_cb(0)
+      , _timeout_cb_arg(0)
+      , _poll_cb(0)
+      , _poll_cb_arg(0)
+      , _write_cb(0)
+      , _write_cb_arg(0)
+    {}
+
+    void onConnect(AsyncSSLClient* client)
+    {
+      if (_connect_cb)
+        _connect_cb(_connect_cb_arg, client);
+    }
+
+    void onDisconnect(AsyncSSLClient* client)
+    {
+      if (_discard_cb)
+        _discard_cb(_discard_cb_arg, client);
+    }
+
+    void onAck(AsyncSSLClient* client, size_t len, uint32_t time)
+    {
+      if (_sent_cb)
+        _sent_cb(_sent_cb_arg, client, len, time);
+    }
+
+    void onError(AsyncSSLClient* client, int8_t error)
+    {
+      if (_error_cb)
+        _error_cb(_error_cb_arg, client, error);
+    }
+
+    void onData(AsyncSSLClient* client, void *data, size_t len)
+    {
+      if (_recv_cb)
+        _recv_cb(_recv_cb_arg, client, data, len);
+    }
+
+    bool onPacket(AsyncSSLClient* client, struct pbuf *pb)
+    {
+      if (!_pb_cb)
+        return false;
+
+      _pb_cb(_pb_cb_arg, client, pb);
+
+      return true;
+    }
+
+    void onTimeout(AsyncSSLClient* client, uint32_t time)
+    {
+      if (_timeout_cb)
+        _timeout_cb(_timeout_cb_arg, client, time);
+    }
+
+    void onPoll(AsyncSSLClient* client)
+    {
+      if (_poll_cb)
+        _poll_cb(_poll_cb_arg, client);
+    }
+
+    void onWriteComplete(AsyncSSLClient* client, AsyncSSLWriteToken token)
+    {
+      if (_write_cb)
+        _write_cb(_write_cb_arg, client, token);
+    }
+
+    AcConnectHandlerSSL   _connect_cb;
+    void*                 _connect_cb_arg;
+    AcConnectHandlerSSL   _discard_cb;
+    void*                 _discard_cb_arg;
+    AcAckHandlerSSL       _sent_cb;
+    void*                 _sent_cb_arg;
+    AcErrorHandlerSSL     _error_cb;
+    void*                 _error_cb_arg;
+    AcDataHandlerSSL      _recv_cb;
+    void*                 _recv_cb_arg;
+    AcPacketHandlerSSL    _pb_cb;
+    void*                 _pb_cb_arg;
+    AcTimeoutHandlerSSL   _timeout_cb;
+    void*                 _timeout_cb_arg;
+    AcConnectHandlerSSL   _poll_cb;
+    void*                 _poll_cb_arg;
+    AcWriteHandlerSSL     _write_cb;
+    void*                 _write_cb_arg;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Send State
+
+   What a client needs beyond add() / send(): the pending write completion tokens and the stream()
+   source. Allocated on first use, like the legacy callbacks. stream() claims the source with
+   stream_state, fills it in from its own task and hands it over by storing STREAM_RUNNING with
+   release order: the async task only reads it after loading that with acquire order.
+ * */
+
+typedef enum
+{
+  STREAM_IDLE,
+  STREAM_STAGED,      // stream() is filling in the source, in any task
+  STREAM_RUNNING      // the async task pulls from it
+} stream_state_t;
+
+struct AsyncSSLSendState
+{
+  AsyncSSLSendState()
+    : token_head(0)
+    , token_count(0)
+    , stream_state(STREAM_IDLE)
+    , stream_arg(NULL)
+    , stream_buf(NULL)
+    , stream_len(0)
+    , stream_end(0)
+    , stream_eof(false)
+  {}
+
+  ~AsyncSSLSendState()
+  {
+    ::free(stream_buf);
+  }
+
+  AsyncSSLWriteToken      token[ASYNC_TCP_SSL_WRITE_TOKENS];   // not ACKed yet, oldest first
+  uint8_t                 token_head;
+  uint8_t                 token_count;
+
+  uint8_t                 stream_state;     // stream_state_t, atomic: the fields below are the async task's once running
+  AcStreamSourceSSL       stream_source;
+  AcStreamDoneHandlerSSL  stream_done;
+  void*                   stream_arg;
+  uint8_t*                stream_buf;       // ASYNC_TCP_SSL_STREAM_CHUNK bytes, kept for the next stream()
+  size_t                  stream_len;       // pulled from the source but not added yet
+  AsyncSSLWriteToken      stream_end;       // end of the last record, once the source is exhausted
+  bool                    stream_eof;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////
+
+/*
+  Async TCP Client
+*/
+
+#if (ASYNC_TCP_SSL_CLIENT_POOL_SIZE > 0)
+
+/*
+   Client Pool
+
+   Free pool objects form a lock-free stack like the closed slots, so taking one in LwIP Thread never
+   blocks or touches the heap. Anything outside the pool goes to the regular heap.
+ * */
+
+#define CLIENT_POOL_NONE    0xFFFF
+
+typedef struct
+{
+  alignas(AsyncSSLClient) uint8_t bytes[sizeof(AsyncSSLClient)];
+} client_pool_obj_t;
+
+static client_pool_obj_t  _client_pool[ASYNC_TCP_SSL_CLIENT_POOL_SIZE];
+static uint16_t           _client_pool_next[ASYNC_TCP_SSL_CLIENT_POOL_SIZE];
+static uint32_t           _client_pool_head;    // (tag << 16) | index of the top free object
+static uint32_t           _client_pool_free = ASYNC_TCP_SSL_CLIENT_POOL_SIZE;
+
+static bool _client_pool_ready = []()
+{
+  for (int i = 0; i < ASYNC_TCP_SSL_CLIENT_POOL_SIZE; ++ i)
+  {
+    _client_pool_next[i] = (i + 1 < ASYNC_TCP_SSL_CLIENT_POOL_SIZE) ? i + 1 : CLIENT_POOL_NONE;
+  }
+
+  _client_pool_head = 0;
+
+  return true;
+}
+();
+
+/////////////////////////////////////////////
+
+void* AsyncSSLClient::operator new(size_t size)
+{
+  return ::operator new(size);
+}
+
+/////////////////////////////////////////////
+
+void* AsyncSSLClient::operator new(size_t size, const std::nothrow_t& tag) noexcept
+{
+  return ::operator new(size, tag);
+}
+
+/////////////////////////////////////////////
+
+void* AsyncSSLClient::operator new(size_t size, const AsyncSSLClientPool&) noexcept
+{
+  if (size > sizeof(client_pool_obj_t))
+  {
+    return NULL;
+  }
+
+  uint32_t head = __atomic_load_n(&_client_pool_head, __ATOMIC_ACQUIRE);
+  uint32_t next;
+  uint32_t index;
+
+  do
+  {
+    index = head & 0xFFFF;
+
+    if (index == CLIENT_POOL_NONE)
+    {
+      return NULL;
+    }
+
+    next = ((head & 0xFFFF0000) + 0x10000) | _client_pool_next[index];
+  } while (!__atomic_compare_exchange_n(&_client_pool_head, &head, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  __atomic_sub_fetch(&_client_pool_free, 1, __ATOMIC_RELAXED);
+
+  return &_client_pool[index];
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::operator delete(void* ptr)
+{
+  client_pool_obj_t * obj = (client_pool_obj_t *) ptr;
+
+  if (obj < &_client_pool[0] || obj >= &_client_pool[ASYNC_TCP_SSL_CLIENT_POOL_SIZE])
+  {
+    ::operator delete(ptr);
+
+    return;
+  }
+
+  uint32_t index = obj - &_client_pool[0];
+  uint32_t head  = __atomic_load_n(&_client_pool_head, __ATOMIC_ACQUIRE);
+  uint32_t next;
+
+  do
+  {
+    _client_pool_next[index] = head & 0xFFFF;
+    next = ((head & 0xFFFF0000) + 0x10000) | index;
+  } while (!__atomic_compare_exchange_n(&_client_pool_head, &head, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  __atomic_add_fetch(&_client_pool_free, 1, __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+  AsyncSSLClient::operator delete(ptr);
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::operator delete(void* ptr, const AsyncSSLClientPool&) noexcept
+{
+  AsyncSSLClient::operator delete(ptr);
+}
+
+/////////////////////////////////////////////
+
+size_t AsyncSSLClient::poolAvailable()
+{
+  return __atomic_load_n(&_client_pool_free, __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////////
+
+#endif
+
+// The optional per-connection metrics come on top of the budget
+static_assert(sizeof(AsyncSSLClient) <= ASYNC_TCP_SSL_CLIENT_SIZE_BUDGET + ASYNC_TCP_SSL_METRICS * sizeof(AsyncSSLConnMetrics),
+              "AsyncSSLClient grew beyond ASYNC_TCP_SSL_CLIENT_SIZE_BUDGET, check the member layout");
+
+#if ASYNC_TCP_SSL_SIZE_REPORT
+
+// Calling a deprecated function template makes the compiler print its argument, i.e. the client size
+template <size_t N>
+__attribute__((deprecated("this is the sizeof(AsyncSSLClient) report, see N")))
+size_t AsyncSSLClientSize()
+{
+  return N;
+}
+
+static const size_t _async_ssl_client_size = AsyncSSLClientSize<sizeof(AsyncSSLClient)>();
+
+#endif
+
+AsyncSSLClient::AsyncSSLClient(tcp_pcb* pcb)
+  : _hostname(NULL)
+  , _handler(NULL)
+  , _callbacks(NULL)
+  , _tx_state(NULL)
+  , _config(NULL)
+  , _admission(NULL)
+  , _hs_next(NULL)
+  , _tw_next(NULL)
+  , _tw_prev(NULL)
+  , _pcb_sent_at(0)
+  , _rx_ack_len(0)
+  , _rx_last_packet(0)
+  , _rx_since_timeout(0)
+  , _ack_timeout(ASYNC_MAX_ACK_TIME)
+  , _tw_deadline(0)
+  , _hs_started_at(0)
+  , _connect_port(0)
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+  , _race_pending(0)
+  , _race_won(false)
+  , _race_delayed(false)
+#endif
+  , _pcb_busy(false)
+  , _ack_pcb(true)
+    // SSL
+  , _pcb_secure(false)
+  , _handshake_done(true)
+  , _owns_config(false)
+  , _hs_state(HS_NONE)
+  , _tw_armed(false)
+  , _poll_enabled(false)
+  , _priority(ASYNC_PRIORITY_NORMAL)
+  , _sched_index(SCHED_NONE)
+    //////
+  , prev(NULL)
+  , next(NULL)
+{
+  _pcb = pcb;
+  _closed_slot = INVALID_CLOSED_SLOT;
+
+#if ASYNC_TCP_SSL_METRICS
+  memset(&_metrics, 0, sizeof(_metrics));
+#endif
+
+  for (int i = 0; i < ASYNC_IP_FAMILIES; i++)
+  {
+    _dns_entry[i] = NULL;
+    _dns_next[i]  = NULL;
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+    _attempts[i].client = this;
+    _attempts[i].pcb    = NULL;
+#endif
+  }
+
+  if (_pcb)
+  {
+    _allocate_closed_slot();
+    _rx_last_packet = millis();
+    tcp_arg(_pcb, this);
+    tcp_recv(_pcb, &_tcp_recv);
+    tcp_sent(_pcb, &_tcp_sent);
+    tcp_err(_pcb, &_tcp_error);
+    _set_poll(_pcb);
+  }
+}
+
+/////////////////////////////////////////////
+
+AsyncSSLClient::~AsyncSSLClient()
+{
+  // First, like in _close(): waits if the async task is starting this handshake right now
+  _handshake_release();
+
+  if (_pcb)
+  {
+    _close();
+  }
+
+  _dns_cache_cancel();
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+  _race_cancel();
+#endif
+
+  _timer_cancel();
+
+  _free_closed_slot();
+
+  delete _callbacks;
+  delete _tx_state;
+
+  AsyncSSLServer::_detach(_admission, true);
+
+  if (_owns_config)
+  {
+    delete _config;
+  }
+
+  ::free(_hostname);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Operators
+ * */
+
+AsyncSSLClient& AsyncSSLClient::operator=(const AsyncSSLClient& other)
+{
+  if (this == &other)
+  {
+    return *this;
+  }
+
+  if (_pcb)
+  {
+    _close();
+  }
+
+  _pcb = other._pcb;
+
+  // The slot moves with the pcb: other's handle goes stale, so it neither passes checks nor frees it
+  _free_closed_slot();
+
+  AsyncSSLClient & from = const_cast<AsyncSSLClient &>(other);
+  int32_t closed_slot   = __atomic_load_n(&from._closed_slot, __ATOMIC_ACQUIRE);
+
+  while (closed_slot != INVALID_CLOSED_SLOT && !((uint32_t) closed_slot & CLOSED_SLOT_STALE)
+         && !__atomic_compare_exchange_n(&from._closed_slot, &closed_slot, (int32_t) ((uint32_t) closed_slot | CLOSED_SLOT_STALE),
+                                         false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+  }
+
+  _closed_slot = closed_slot;
+
+  if (_pcb)
+  {
+    _rx_last_packet = millis();
+    tcp_arg(_pcb, this);
+    tcp_recv(_pcb, &_tcp_recv);
+    tcp_sent(_pcb, &_tcp_sent);
+    tcp_err(_pcb, &_tcp_error);
+    _set_poll(_pcb);
+
+    // SSL
+    if (tcp_ssl_has(_pcb))
+    {
+      _pcb_secure     = true;
+      _handshake_done = false;
+
+      tcp_ssl_arg(_pcb, this);
+      tcp_ssl_data(_pcb, &_s_data);
+      tcp_ssl_handshake(_pcb, &_s_handshake);
+      tcp_ssl_err(_pcb, &_s_ssl_error);
+    }
+    else
+    {
+      _pcb_secure = false;
+      _handshake_done = true;
+    }
+
+    //////
+  }
+
+  return *this;
+}
+
+/////////////////////////////////////////////
+
+bool AsyncSSLClient::operator==(const AsyncSSLClient &other)
+{
+  return (_pcb == other._pcb);
+}
+
+/////////////////////////////////////////////
+
+AsyncSSLClient & AsyncSSLClient::operator+=(const AsyncSSLClient &other)
+{
+  if (next == NULL)
+  {
+    next = (AsyncSSLClient*)(&other);
+    next->prev = this;
+  }
+  else
+  {
+    AsyncSSLClient *c = next;
+
+    while (c->next != NULL)
+    {
+      c = c->next;
+    }
+
+    c->next = (AsyncSSLClient*)(&other);
+    c->next->prev = c;
+  }
+
+  return *this;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Callback Setters
+ * */
+
+AsyncSSLCallbacks* AsyncSSLClient::_legacy_callbacks()
+{
+  if (!_callbacks)
+  {
+    _callbacks = new (std::nothrow) AsyncSSLCallbacks();
+
+    if (!_callbacks)
+    {
+      ATCP_LOGERROR("_legacy_callbacks: out of memory");
+
+      return NULL;
+    }
+  }
+
+  // A handler set with setHandler() wins until it's removed again
+  if (!_handler)
+  {
+    _handler = _callbacks;
+  }
+
+  return _callbacks;
+}
+
+/////////////////////////////////////////////
+
+AsyncSSLSendState* AsyncSSLClient::_send_state()
+{
+  if (!_tx_state)
+  {
+    _tx_state = new (std::nothrow) AsyncSSLSendState();
+
+    if (!_tx_state)
+    {
+      ATCP_LOGERROR("_send_state: out of memory");
+    }
+  }
+
+  return _tx_state;
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setHandler(AsyncSSLClientHandler* handler, bool poll)
+{
+  _handler      = handler ? handler : _callbacks;
+  _poll_enabled = handler ? poll : (_callbacks && _callbacks->_poll_cb);
+
+  _update_poll();
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onConnect(AcConnectHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_connect_cb     = cb;
+    cbs->_connect_cb_arg = arg;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onDisconnect(AcConnectHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_discard_cb     = cb;
+    cbs->_discard_cb_arg = arg;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onAck(AcAckHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_sent_cb     = cb;
+    cbs->_sent_cb_arg = arg;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onError(AcErrorHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_error_cb     = cb;
+    cbs->_error_cb_arg = arg;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onData(AcDataHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_recv_cb     = cb;
+    cbs->_recv_cb_arg = arg;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onPacket(AcPacketHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_pb_cb     = cb;
+    cbs->_pb_cb_arg = arg;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onTimeout(AcTimeoutHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_timeout_cb     = cb;
+    cbs->_timeout_cb_arg = arg;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onPoll(AcConnectHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_poll_cb     = cb;
+    cbs->_poll_cb_arg = arg;
+
+    if (_handler == cbs)
+    {
+      _poll_enabled = (cb != NULL);
+
+      _update_poll();
+    }
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::onWriteComplete(AcWriteHandlerSSL cb, void* arg)
+{
+  AsyncSSLCallbacks* cbs = _legacy_callbacks();
+
+  if (cbs)
+  {
+    cbs->_write_cb     = cb;
+    cbs->_write_cb_arg = arg;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Main Public Methods
+ * */
+
+bool AsyncSSLClient::connect(IPAddress ip, uint16_t port, bool secure)
+{
+  ip_addr_t addr;
+  addr.type = IPADDR_TYPE_V4;
+  addr.u_addr.ip4.addr = ip;
+
+  return _connect(&addr, port, secure);
+}
+
+/////////////////////////////////////////////
+
+#if LWIP_IPV6
+
+bool AsyncSSLClient::connect(IPv6Address ip, uint16_t port, bool secure)
+{
+  ip_addr_t addr;
+  addr.type = IPADDR_TYPE_V6;
+  memcpy(addr.u_addr.ip6.addr, static_cast<const uint32_t*>(ip), sizeof(addr.u_addr.ip6.addr));
+  addr.u_addr.ip6.zone = 0;
+
+  return _connect(&addr, port, secure);
+}
+
+#endif
+
+/////////////////////////////////////////////
+
+bool AsyncSSLClient::_connect(struct ip_addr *addr, uint16_t port, bool secure)
+{
+  if (_pcb)
+  {
+    ATCP_LOGWARN1("connect: already connected, state =", stateToString());
+
+    return false;
+  }
+
+  // Outgoing connections have no slot, a handle left from an earlier accepted one would fail the calls
+  _free_closed_slot();
+  _closed_slot = INVALID_CLOSED_SLOT;
+
+  if (!_start_async_task())
+  {
+    ATCP_LOGERROR("connect: failed to start task");
+
+    return false;
+  }
+
+  tcp_pcb* pcb = tcp_new_ip_type(IP_GET_TYPE(addr));
+
+  if (!pcb)
+  {
+    ATCP_LOGERROR("connect: NULL pcb");
+
+    return false;
+  }
+
+  // SSL
+  _pcb_secure = secure;
+  _handshake_done = !secure;
+  //////
+
+  tcp_arg(pcb, this);
+  tcp_err(pcb, &_tcp_error);
+  tcp_recv(pcb, &_tcp_recv);
+  tcp_sent(pcb, &_tcp_sent);
+  _set_poll(pcb);
+
+#if ASYNC_TCP_SSL_METRICS
+  // The start time until _connected() turns it into the duration
+  _metrics.connect_us = (uint32_t) esp_timer_get_time();
+#endif
+
+  _tcp_connect(pcb, _closed_slot, addr, port, (tcp_connected_fn)&_tcp_connected);
+
+  return true;
+}
+
+/////////////////////////////////////////////
+
+bool AsyncSSLClient::connect(const char* host, uint16_t port, bool secure)
+{
+  ip_addr_t addr;
+
+  if (!_start_async_task())
+  {
+    ATCP_LOGERROR("connect: failed to start task");
+
+    return false;
+  }
+
+  // Before anything is touched: a live connection keeps its host and TLS state
+  if (_pcb || _connect_pending())
+  {
+    ATCP_LOGWARN1("connect: already connected, state =", stateToString());
+
+    return false;
+  }
+
+  _connect_port = port;
+
+  _set_hostname(host);
+  _pcb_secure = secure;
+  _handshake_done = !secure;
+
+  _dns_cache_cancel();
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+
+  _race_cancel();
+
+  // Outgoing connections have no slot, see _connect()
+  _free_closed_slot();
+  _closed_slot = INVALID_CLOSED_SLOT;
+
+  // Nothing runs in LwIP Thread for this client until the first lookup is started
+  _race_won     = false;
+  _race_delayed = false;
+  _race_pending = (1 << ASYNC_IP_FAMILY_V6) | (1 << ASYNC_IP_FAMILY_V4);
+
+  // IPv6 first, so that it's the first attempt on the wire when both names are cached
+  const uint8_t families[] = { ASYNC_IP_FAMILY_V6, ASYNC_IP_FAMILY_V4 };
+  bool started = false;
+
+  for (int i = 0; i < 2; i++)
+  {
+    err_t err = _dns_cache_lookup(host, &addr, families[i]);
+
+    if (err == ERR_INPROGRESS)
+    {
+      started = true;
+    }
+    else
+    {
+      ATCP_LOGDEBUG3("connect: family =", families[i], ", err =", err);
+
+      // Done with this family: start its attempt now if we got an address
+      started = _race((err == ERR_OK) ? &addr : NULL, 1 << families[i]) || started;
+    }
+  }
+
+  if (started)
+  {
+    return true;
+  }
+
+  ATCP_LOGERROR1("connect: failed to resolve", host);
+
+  return false;
+
+#else
+
+  err_t err = _dns_cache_lookup(host, &addr, ASYNC_IP_FAMILY_ANY);
+
+  if (err == ERR_OK)
+  {
+    return _connect(&addr, port, secure);
+  }
+  else if (err == ERR_INPROGRESS)
+  {
+    return true;
+  }
+
+  ATCP_LOGERROR1("connect: error =", err);
+
+  return false;
+
+#endif
+}
+
+/////////////////////////////////////////////
+
+// A connect() by name still resolving, or racing its attempts: _pcb isn't set yet
+bool AsyncSSLClient::_connect_pending()
+{
+  for (int i = 0; i < ASYNC_IP_FAMILIES; i++)
+  {
+    if (_dns_entry[i])
+    {
+      return true;
+    }
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+
+    if (_attempts[i].pcb)
+    {
+      return true;
+    }
+
+#endif
+  }
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+  return (_race_pending != 0);
+#else
+  return false;
+#endif
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::close(bool now)
+{
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+  _race_cancel();
+#endif
+
+  if (_pcb)
+  {
+    ack(_rx_ack_len);
+  }
+
+  _close();
+}
+
+/////////////////////////////////////////////
+
+int8_t AsyncSSLClient::abort()
+{
+  if (_pcb)
+  {
+    _tcp_abort(_pcb, _closed_slot );
+    _pcb = NULL;
+  }
+
+  return ERR_ABRT;
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setRootCa(const char* rootca, const size_t len)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->root_ca     = rootca;
+    config->root_ca_len = len;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setClientCert(const char* cli_cert, const size_t len)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->cli_cert     = cli_cert;
+    config->cli_cert_len = len;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setClientKey(const char* cli_key, const size_t len)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->cli_key     = cli_key;
+    config->cli_key_len = len;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setPsk(const char* psk_ident, const char* psk)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->psk_ident = psk_ident;
+    config->psk       = psk;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setCipherSuites(const int* suites)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->ciphersuites = suites;
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setCurves(const mbedtls_ecp_group_id* curves)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->curves = curves;
+  }
+}
+
+/////////////////////////////////////////////
+
+bool AsyncSSLClient::setCaBundle(const uint8_t* bundle, size_t len)
+{
+  int count = tcp_ssl_ca_bundle_count(bundle, len);
+
+  if (count < 0)
+  {
+    ATCP_LOGERROR("setCaBundle: malformed bundle");
+
+    return false;
+  }
+
+  AsyncSSLConfig* config = _own_config();
+
+  if (!config)
+  {
+    return false;
+  }
+
+  ATCP_LOGINFO1("setCaBundle: roots =", count);
+
+  config->ca_bundle     = bundle;
+  config->ca_bundle_len = len;
+
+  return true;
+}
+
+/////////////////////////////////////////////
+
+// Only with a root CA or a CA bundle. Leaves are shared by all clients, ASYNC_TCP_SSL_VERIFY_CACHE_SIZE
+// No effect with mbedTLS 3, whose leaf usage and curve checks can only run inside its own chain check
+void AsyncSSLClient::setVerifyCache(bool enable)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->verify_cache = enable;
+  }
+}
+
+/////////////////////////////////////////////
+
+// Sessions are shared by all clients, ASYNC_TCP_SSL_SESSION_CACHE_SIZE. The server may refuse one
+void AsyncSSLClient::setSessionResumption(bool enable)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->resume = enable;
+  }
+}
+
+/////////////////////////////////////////////
+
+// Needs mbedTLS with MBEDTLS_SSL_EARLY_DATA and a TLS 1.3 ticket allowing it, otherwise add() returns 0
+// until onConnect(). 0-RTT data refused by the server is sent again after the handshake
+void AsyncSSLClient::setEarlyData(bool enable)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->early_data = enable;
+  }
+}
+
+/////////////////////////////////////////////
+
+// RFC 7918. onConnect() fires once the client's Finished is sent and add() / send() go out right away.
+// A bad server Finished then ends in onError() after onConnect(). Suites without forward secrecy or
+// an AEAD cipher, and resumed sessions, wait for the server's Finished as usual
+void AsyncSSLClient::setFalseStart(bool enable)
+{
+  AsyncSSLConfig* config = _own_config();
+
+  if (config)
+  {
+    config->false_start = enable;
+  }
+}
+
+/////////////////////////////////////////////
+
+// Read in LwIP Thread for every event, so only change it while no events of the client are queued.
+// Events already in the old class's queue could otherwise be handled after newer ones. A field of the
+// client, not of the config: setConfig() may swap that one from under LwIP Thread
+void AsyncSSLClient::setPriority(uint8_t priority)
+{
+  if (priority < ASYNC_PRIORITY_CLASSES)
+  {
+    _priority = priority;
+  }
+}
+
+/////////////////////////////////////////////
+
+const char* AsyncSSLClient::getCipherSuite()
+{
+  if (!_pcb || !_pcb_secure || !_handshake_done)
+  {
+    return NULL;
+  }
+
+  return tcp_ssl_get_ciphersuite(_pcb);
+}
+
+/////////////////////////////////////////////
+
+const char* AsyncSSLClient::getTlsVersion()
+{
+  if (!_pcb || !_pcb_secure || !_handshake_done)
+  {
+    return NULL;
+  }
+
+  return tcp_ssl_get_version(_pcb);
+}
+/////////////////////////////////////////////
+
+void AsyncSSLClient::setConfig(const AsyncSSLConfig* config)
+{
+  if (_owns_config)
+  {
+    delete _config;
+    _owns_config = false;
+  }
+
+  _config = config;
+}
+
+/////////////////////////////////////////////
+
+// The per-credential setters write into a private copy, so a shared config is never modified
+AsyncSSLConfig* AsyncSSLClient::_own_config()
+{
+  if (!_owns_config)
+  {
+    AsyncSSLConfig* config = new (std::nothrow) AsyncSSLConfig();
+
+    if (!config)
+    {
+      ATCP_LOGERROR("_own_config: out of memory");
+
+      return NULL;
+    }
+
+    if (_config)
+    {
+      *config = *_config;
+    }
+
+    _config      = config;
+    _owns_config = true;
+  }
+
+  return const_cast<AsyncSSLConfig*>(_config);
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::_set_hostname(const char* host)
+{
+  ::free(_hostname);
+  _hostname = NULL;
+
+  if (host && *host)
+  {
+    _hostname = strdup(host);
+  }
+}
+
+/////////////////////////////////////////////
+
+size_t AsyncSSLClient::space()
+{
+  if ((_pcb != NULL) && (_pcb->state == ESTABLISHED))
+  {
+    return tcp_sndbuf(_pcb);
+  }
+
+  return 0;
+}
+
+/////////////////////////////////////////////
+
+size_t AsyncSSLClient::add(const char* data, size_t size, uint8_t apiflags, AsyncSSLWriteToken* token)
+{
+  bool    failed  = false;
+  size_t  added   = _add(data, size, apiflags, token, &failed);
+
+  if (failed)
+  {
+    _close();
+  }
+
+  return added;
+}
+
+/////////////////////////////////////////////
+
+// add() without closing the connection on a TLS error: *failed is set instead, so that callers which
+// can't have the client freed under them close it last
+size_t AsyncSSLClient::_add(const char* data, size_t size, uint8_t apiflags, AsyncSSLWriteToken* token, bool* failed)
+{
+  if (!_pcb || size == 0 || data == NULL)
+  {
+    return 0;
+  }
+
+  size_t room = space();
+
+  if (!room)
+  {
+    return 0;
+  }
+
+  if (_pcb_secure)
+  {
+    size_t    plain = 0;
+    uint32_t  end   = 0;
+    int       sent  = tcp_ssl_write(_pcb, (uint8_t*)data, size, &plain, &end);
+
+    ASYNC_TCP_SSL_DEBUG("add() tcp_ssl_write size = %d\n", sent);
+
+    if (sent >= 0)
+    {
+      // The ciphertext was counted by _tcp_write4ssl(), the plaintext is what mbedtls took of it
+      if (sent > 0)
+      {
+        ASYNC_CONN_METRIC_ADD(this, plain_out, plain);
+
+        // Before onConnect() it's 0-RTT data, which may be sent again after the handshake
+        if (token && _handshake_done)
+        {
+          _track_write(token, end);
+        }
+        else if (token)
+        {
+          *token = ASYNC_WRITE_TOKEN_NONE;
+        }
+      }
+
+      // @ToDo: ???
+      //_tx_unacked_len += sent;
+      return sent;
+    }
+
+    ATCP_LOGINFO1("add() done, tcp_ssl_write size =", sent);
+
+    *failed = true;
+
+    return 0;
+  }
+
+  size_t will_send = (room < size) ? room : size;
+
+  uint32_t  end = 0;
+  int8_t    err = _tcp_write(_pcb, _closed_slot, data, will_send, apiflags, &end);
+
+  if (err != ERR_OK)
+  {
+    return 0;
+  }
+
+  ASYNC_CONN_METRIC_ADD(this, bytes_out, will_send);
+  ASYNC_CONN_METRIC_ADD(this, plain_out, will_send);
+
+  if (token)
+  {
+    _track_write(token, end);
+  }
+
+  return will_send;
+}
+
+/////////////////////////////////////////////
+
+bool AsyncSSLClient::writeComplete(AsyncSSLWriteToken token)
+{
+  uint32_t acked;
+
+  return (token != ASYNC_WRITE_TOKEN_NONE) && (_tcp_seq(_pcb, _closed_slot, &acked, NULL) == ERR_OK)
+         && ((int32_t) (acked - token) >= 0);
+}
+
+/////////////////////////////////////////////
+
+bool AsyncSSLClient::send()
+{
+  // 5 is also OK
+  vTaskDelay(1 / portTICK_PERIOD_MS);
+
+  return _output();
+}
+
+/////////////////////////////////////////////
+
+// send() without the delay, for the async task
+bool AsyncSSLClient::_output()
+{
+  int8_t err = _tcp_output(_pcb, _closed_slot);
+
+  if (err == ERR_OK)
+  {
+    _pcb_busy    = true;
+    _pcb_sent_at = millis();
+
+    if (_ack_timeout)
+    {
+      _timer_arm();
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+/////////////////////////////////////////////
+
+size_t AsyncSSLClient::ack(size_t len)
+{
+  if (len > _rx_ack_len)
+    len = _rx_ack_len;
+
+  // The held records are tcp_ssl_read()'s, in the async task: released there, by LWIP_TCP_ACK
+  if (len && _pcb_secure && xTaskGetCurrentTaskHandle() != _async_service_task_handle)
+  {
+    return _tcp_ack_event(this, len, _priority) ? len : 0;
+  }
+
+  if (len)
+  {
+    // Secure connections count plaintext, the TCP window opens by the ciphertext of the records consumed
+    size_t window = _pcb_secure ? tcp_ssl_rx_release(_pcb, len) : len;
+
+    if (window)
+    {
+      _tcp_recved(_pcb, _closed_slot, window);
+    }
+  }
+
+  _rx_ack_len -= len;
+
+  return len;
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::ackPacket(struct pbuf * pb)
+{
+  if (!pb)
+  {
+    return;
+  }
+
+  _tcp_recved(_pcb, _closed_slot, pb->len);
+  pbuf_free(pb);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Main Private Methods
+ * */
+
+int8_t AsyncSSLClient::_close()
+{
+  int8_t err = ERR_OK;
+
+  // First: if the async task is starting this handshake right now, waits for it to finish
+  _handshake_release();
+
+  if (_pcb)
+  {
+    if (_pcb_secure)
+    {
+      tcp_ssl_free(_pcb);
+    }
+
+    tcp_arg(_pcb, NULL);
+    tcp_sent(_pcb, NULL);
+    tcp_recv(_pcb, NULL);
+    tcp_err(_pcb, NULL);
+    tcp_poll(_pcb, NULL, 0);
+
+    _tcp_clear_events(this);
+
+    err = _tcp_close(_pcb, _closed_slot);
+
+    if (err != ERR_OK)
+    {
+      err = abort();
+    }
+
+    _pcb = NULL;
+
+    _handshake_finished(false);
+    _timer_cancel();
+    _stream_end(false);
+
+    if (_handler)
+    {
+      _handler->onDisconnect(this);
+    }
+  }
+  else
+  {
+    _handshake_finished(false);
+  }
+
+  return err;
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::_allocate_closed_slot()
+{
+  uint32_t head = __atomic_load_n(&_closed_head, __ATOMIC_ACQUIRE);
+  uint32_t next;
+  uint32_t index;
+
+  do
+  {
+    index = CLOSED_SLOT_INDEX(head);
+
+    if (index == CLOSED_SLOT_NONE)
+    {
+      ATCP_LOGERROR("_allocate_closed_slot: no free slot");
+
+      return;
+    }
+
+    next = ((head & 0xFFFF0000) + 0x10000) | _closed_next[index];
+  } while (!__atomic_compare_exchange_n(&_closed_head, &head, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  uint32_t gen = __atomic_add_fetch(&_closed_slots[index], 1, __ATOMIC_ACQ_REL);
+
+  _closed_slot = (int32_t) (((gen & 0x7FFF) << 16) | index);
+}
+
+/////////////////////////////////////////////
+
+// Can be reached from both LwIP Thread (_lwip_fin) and the async task (destructor), only one of them frees.
+// The handle stays, marked stale
+void AsyncSSLClient::_free_closed_slot()
+{
+  int32_t closed_slot = __atomic_load_n(&_closed_slot, __ATOMIC_ACQUIRE);
+
+  do
+  {
+    if (closed_slot == INVALID_CLOSED_SLOT || ((uint32_t) closed_slot & CLOSED_SLOT_STALE))
+    {
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&_closed_slot, &closed_slot, (int32_t) ((uint32_t) closed_slot | CLOSED_SLOT_STALE),
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  uint32_t index = CLOSED_SLOT_INDEX(closed_slot);
+
+  // Even again: from now on the old handle fails _closed_slot_open()
+  __atomic_add_fetch(&_closed_slots[index], 1, __ATOMIC_ACQ_REL);
+
+  uint32_t head = __atomic_load_n(&_closed_head, __ATOMIC_ACQUIRE);
+  uint32_t next;
+
+  do
+  {
+    _closed_next[index] = CLOSED_SLOT_INDEX(head);
+    next = ((head & 0xFFFF0000) + 0x10000) | index;
+  } while (!__atomic_compare_exchange_n(&_closed_head, &head, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Private Callbacks
+ * */
+
+int8_t AsyncSSLClient::_connected(void* pcb, int8_t err)
+{
+  _pcb = reinterpret_cast<tcp_pcb*>(pcb);
+
+  if (_pcb)
+  {
+    _rx_last_packet = millis();
+    _pcb_busy = false;
+
+    if (_tx_state)
+    {
+      _tx_state->token_count = 0;
+    }
+
+#if ASYNC_TCP_SSL_METRICS
+    _metrics.connect_us = (uint32_t) esp_timer_get_time() - _metrics.connect_us;
+#endif
+
+    if (_pcb_secure && _handshake_acquire())
+    {
+      if (_start_tls() != ERR_OK)
+      {
+        return ERR_ABRT;
+      }
+    }
+  }
+
+  _timer_arm();
+
+  // _connect_cb happens after SSL handshake if this is a secure connection
+  if (_handler && !_pcb_secure)
+  {
+    _handler->onConnect(this);
+  }
+
+  return ERR_OK;
+}
 
 /////////////////////////////////////////////
 
-static esp_err_t _tcp_close(tcp_pcb * pcb, int8_t closed_slot)
+int8_t AsyncSSLClient::_start_tls()
 {
-  if (!pcb)
+  bool err = false;
+
+  // Value-initialized: all NULL, 0 and false whatever fields AsyncSSLConfig has
+  static const AsyncSSLConfig no_config = {};
+
+  const AsyncSSLConfig* config = _config ? _config : &no_config;
+
+  // Lost the connection while waiting for the turn
+  if (!_pcb)
   {
-    return ERR_CONN;
+    _handshake_release();
+
+    return ERR_ABRT;
   }
 
-  tcp_api_call_t msg;
+  // The handshake timeout counts from here, not from the TCP connect
+  _rx_last_packet = millis();
 
-  msg.pcb         = pcb;
-  msg.closed_slot = closed_slot;
+#if ASYNC_TCP_SSL_METRICS
+  uint32_t setup_start = (uint32_t) esp_timer_get_time();
+#endif
 
-  tcpip_api_call(_tcp_close_api, (struct tcpip_api_call_data*)&msg);
+  const tcp_ssl_opts_t opts = { config->ciphersuites, config->curves, config->ca_bundle, config->ca_bundle_len,
+                                config->verify_cache, config->resume, config->early_data, config->false_start };
 
-  return msg.err;
+  if (config->psk_ident != NULL and config->psk != NULL)
+  {
+    err = tcp_ssl_new_psk_client(_pcb, this, config->psk_ident, config->psk, &opts) < 0;
+  }
+  else
+  {
+    err = tcp_ssl_new_client(_pcb, this, _hostname, config->root_ca, config->root_ca_len,
+                             config->cli_cert, config->cli_cert_len, config->cli_key, config->cli_key_len, &opts) < 0;
+  }
+
+#if ASYNC_TCP_SSL_METRICS
+  _metrics.tls_setup_us = (uint32_t) esp_timer_get_time() - setup_start;
+#endif
+
+  if (err)
+  {
+    ATCP_LOGERROR("_start_tls: error => closing");
+
+    _close();
+
+    return ERR_ABRT;
+  }
+
+  tcp_ssl_data(_pcb, &_s_data);
+  tcp_ssl_handshake(_pcb, &_s_handshake);
+  tcp_ssl_err(_pcb, &_s_ssl_error);
+
+#if ASYNC_TCP_SSL_METRICS
+  tcp_ssl_counters(_pcb, &_metrics.tls);
+#endif
+
+  // Never 0, that means no handshake running
+  _hs_started_at = _rx_last_packet | 1;
+  ASYNC_METRIC_ADD(_async_metrics.handshakes_started, 1);
+
+  _timer_arm();
+
+  return ERR_OK;
 }
 
 /////////////////////////////////////////////
 
-static err_t _tcp_abort_api(struct tcpip_api_call_data *api_call_msg)
+// Returns true if the handshake can start now, false if the client was queued for a later turn
+bool AsyncSSLClient::_handshake_acquire()
 {
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+  if (!_hs_max)
+  {
+    return true;
+  }
 
-  msg->err = ERR_CONN;
+  bool start = false;
+
+  xSemaphoreTakeRecursive(_hs_lock, portMAX_DELAY);
 
-  if (msg->closed_slot == INVALID_CLOSED_SLOT || !_closed_slots[msg->closed_slot])
+  // Nobody jumps the queue, even when a turn is free but its LWIP_TCP_HANDSHAKE is still queued
+  if (!_hs_head && _hs_active < _hs_max)
   {
-    tcp_abort(msg->pcb);
+    _hs_active++;
+    _hs_state = HS_HOLDING;
+    start     = true;
   }
+  else
+  {
+    _hs_state = HS_WAITING;
+    _hs_next  = NULL;
 
-  return msg->err;
+    if (_hs_tail)
+    {
+      _hs_tail->_hs_next = this;
+    }
+    else
+    {
+      _hs_head = this;
+    }
+
+    _hs_tail = this;
+  }
+
+  xSemaphoreGiveRecursive(_hs_lock);
+
+  if (!start)
+  {
+    ATCP_LOGINFO("_handshake_acquire: handshake limit reached, waiting");
+  }
+
+  return start;
 }
 
 /////////////////////////////////////////////
 
-static esp_err_t _tcp_abort(tcp_pcb * pcb, int8_t closed_slot)
+// Leaves the FIFO, or gives the turn back. Safe to call in any state
+void AsyncSSLClient::_handshake_release()
 {
-  if (!pcb)
+  if (_hs_state == HS_NONE)
   {
-    return ERR_CONN;
+    return;
   }
 
-  tcp_api_call_t msg;
+  bool wake = false;
 
-  msg.pcb         = pcb;
-  msg.closed_slot = closed_slot;
+  xSemaphoreTakeRecursive(_hs_lock, portMAX_DELAY);
 
-  tcpip_api_call(_tcp_abort_api, (struct tcpip_api_call_data*)&msg);
+  if (_hs_state == HS_WAITING)
+  {
+    AsyncSSLClient * prev = NULL;
 
-  return msg.err;
+    for (AsyncSSLClient * c = _hs_head; c; prev = c, c = c->_hs_next)
+    {
+      if (c == this)
+      {
+        if (prev)
+          prev->_hs_next = _hs_next;
+        else
+          _hs_head = _hs_next;
+
+        if (_hs_tail == this)
+          _hs_tail = prev;
+
+        break;
+      }
+    }
+  }
+  else if (_hs_head)
+  {
+    // Stays counted for the first waiter, see _s_handshake_turn()
+    _hs_turns++;
+    wake = true;
+  }
+  else
+  {
+    // Nobody waiting: the turn is free again
+    _hs_active--;
+  }
+
+  _hs_state = HS_NONE;
+  _hs_next  = NULL;
+
+  xSemaphoreGiveRecursive(_hs_lock);
+
+  // Not under the lock, and the async task never waits on its own queue: it hands the turn out itself
+  if (wake && xTaskGetCurrentTaskHandle() != _async_service_task_handle)
+  {
+    _tcp_handshake_turn();
+  }
 }
 
 /////////////////////////////////////////////
 
-static err_t _tcp_connect_api(struct tcpip_api_call_data *api_call_msg)
+// Accounts the TLS handshake started by _start_tls(), if one is still running
+void AsyncSSLClient::_handshake_finished(bool ok)
 {
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+  if (!_hs_started_at)
+  {
+    return;
+  }
 
-  msg->err = tcp_connect(msg->pcb, msg->connect.addr, msg->connect.port, msg->connect.cb);
+  uint32_t duration = millis() - _hs_started_at;
 
-  return msg->err;
+  _hs_started_at = 0;
+
+  if (!ok)
+  {
+    ASYNC_METRIC_ADD(_async_metrics.handshakes_failed, 1);
+
+    return;
+  }
+
+#if ASYNC_TCP_SSL_METRICS
+  _metrics.handshake_ms = duration;
+#endif
+
+  ASYNC_METRIC_ADD(_async_metrics.handshakes_ok, 1);
+  ASYNC_METRIC_ADD(_async_metrics.handshake_ms_total, duration);
+  _metric_max(&_async_metrics.handshake_ms_max, duration);
 }
 
 /////////////////////////////////////////////
 
-static esp_err_t _tcp_connect(tcp_pcb * pcb, int8_t closed_slot, ip_addr_t * addr, uint16_t port, tcp_connected_fn cb)
+void AsyncSSLClient::_error(int8_t err)
 {
-  if (!pcb)
+  if (_pcb)
   {
-    return ESP_FAIL;
+    if (_pcb_secure)
+    {
+      tcp_ssl_free(_pcb);
+    }
+
+    tcp_arg(_pcb, NULL);
+
+    if (_pcb->state == LISTEN)
+    {
+      tcp_sent(_pcb, NULL);
+      tcp_recv(_pcb, NULL);
+      tcp_err(_pcb, NULL);
+      tcp_poll(_pcb, NULL, 0);
+    }
+
+    _pcb = NULL;
   }
 
-  tcp_api_call_t msg;
+  _handshake_finished(false);
+  _handshake_release();
+  _timer_cancel();
+  _stream_end(false);
 
-  msg.pcb          = pcb;
-  msg.closed_slot  = closed_slot;
-  msg.connect.addr = addr;
-  msg.connect.port = port;
-  msg.connect.cb   = cb;
+  if (_handler)
+  {
+    _handler->onError(this, err);
+  }
+
+  if (_handler)
+  {
+    _handler->onDisconnect(this);
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::_ssl_error(int8_t err)
+{
+  _handshake_finished(false);
+
+  if (_handler)
+  {
+    _handler->onError(this, err + 64);
+  }
+}
+
+/////////////////////////////////////////////
+
+//In LwIP Thread
+int8_t AsyncSSLClient::_lwip_fin(tcp_pcb* pcb, int8_t err)
+{
+  if (!_pcb || pcb != _pcb)
+  {
+    ATCP_HEXLOGDEBUG2("_lwip_fin: pcb/_pcb =", (uint32_t)(uintptr_t) pcb, (uint32_t)(uintptr_t) _pcb);
+
+    return ERR_OK;
+  }
+
+  tcp_arg(_pcb, NULL);
+
+  if (_pcb->state == LISTEN)
+  {
+    tcp_sent(_pcb, NULL);
+    tcp_recv(_pcb, NULL);
+    tcp_err(_pcb, NULL);
+    tcp_poll(_pcb, NULL, 0);
+  }
+
+  if (tcp_close(_pcb) != ERR_OK)
+  {
+    tcp_abort(_pcb);
+  }
+
+  _free_closed_slot();
+  _pcb = NULL;
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+//In Async Thread
+int8_t AsyncSSLClient::_fin(tcp_pcb* pcb, int8_t err)
+{
+  _tcp_clear_events(this);
+  _stream_end(false);
+
+  if (_handler)
+  {
+    _handler->onDisconnect(this);
+  }
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+int8_t AsyncSSLClient::_sent(tcp_pcb* pcb, uint16_t len, uint32_t acked)
+{
+  _rx_last_packet = millis();
+
+  ATCP_LOGINFO1("_sent: len =", len);
+
+  _pcb_busy = false;
+
+  // The tail of refused 0-RTT data lwIP had no room for
+  if (_pcb_secure && tcp_ssl_flush(pcb) < 0)
+  {
+    ATCP_LOGERROR("_sent: tcp_ssl_flush failed");
+
+    _close();
+
+    return ERR_OK;
+  }
+
+  if (_tx_state)
+  {
+    _writes_acked(acked);
+
+    if (!_stream_pump())
+    {
+      return ERR_OK;
+    }
+  }
+
+  if (_handler)
+  {
+    _handler->onAck(this, len, (millis() - _pcb_sent_at));
+  }
+
+  return ERR_OK;
+}
+
+/////////////////////////////////////////////
+
+// Guards the token rings, filled by add() in any task and drained in async_service_task
+static portMUX_TYPE _tx_token_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// The token is where the write ends in lwIP's send sequence, so record headers, MACs and handshake
+// messages in between need no bookkeeping: the write is complete when the peer ACKed up to there. end
+// is snd_lbb as read in the tcpip_api_call which did the write
+void AsyncSSLClient::_track_write(AsyncSSLWriteToken* token, uint32_t end)
+{
+  *token = end;
+
+  AsyncSSLSendState* state = _send_state();
+
+  if (!state)
+  {
+    // writeComplete() still works
+    return;
+  }
+
+  portENTER_CRITICAL(&_tx_token_mux);
+
+  if (state->token_count < ASYNC_TCP_SSL_WRITE_TOKENS)
+  {
+    state->token_count++;
+  }
+
+  state->token[(state->token_head + state->token_count - 1) % ASYNC_TCP_SSL_WRITE_TOKENS] = *token;
+
+  portEXIT_CRITICAL(&_tx_token_mux);
+}
+
+/////////////////////////////////////////////
+
+// acked is the pcb's lastack, read on the lwIP thread when the ACK came
+void AsyncSSLClient::_writes_acked(uint32_t acked)
+{
+  if (!_pcb)
+  {
+    return;
+  }
+
+  AsyncSSLSendState*  state = _tx_state;
+
+  while (true)
+  {
+    portENTER_CRITICAL(&_tx_token_mux);
+
+    if (!state->token_count || ((int32_t) (acked - state->token[state->token_head]) < 0))
+    {
+      portEXIT_CRITICAL(&_tx_token_mux);
+
+      return;
+    }
+
+    AsyncSSLWriteToken token = state->token[state->token_head];
 
-  tcpip_api_call(_tcp_connect_api, (struct tcpip_api_call_data*)&msg);
+    state->token_head = (state->token_head + 1) % ASYNC_TCP_SSL_WRITE_TOKENS;
+    state->token_count--;
 
-  return msg.err;
+    portEXIT_CRITICAL(&_tx_token_mux);
+
+    if (_handler)
+    {
+      _handler->onWriteComplete(this, token);
+    }
+  }
 }
 
 /////////////////////////////////////////////
 
-static err_t _tcp_bind_api(struct tcpip_api_call_data *api_call_msg)
+int8_t AsyncSSLClient::_recv(tcp_pcb* pcb, pbuf* pb, int8_t err)
 {
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+  while (pb != NULL)
+  {
+    _rx_last_packet = millis();
 
-  msg->err = tcp_bind(msg->pcb, msg->bind.addr, msg->bind.port);
+    pbuf *nxt = pb->next;
+    pb->next  = NULL;
 
-  return msg->err;
-}
+    ASYNC_CONN_METRIC_ADD(this, bytes_in, pb->len);
 
-/////////////////////////////////////////////
+    if (_pcb_secure)
+    {
+      ATCP_LOGINFO1("_recv: tot_len =", pb->tot_len);
 
-static esp_err_t _tcp_bind(tcp_pcb * pcb, ip_addr_t * addr, uint16_t port)
-{
-  if (!pcb)
-  {
-    return ESP_FAIL;
-  }
+      // Less the ciphertext of the records onData() held with ackLater(), see _s_data()
+      size_t window = 0;
 
-  tcp_api_call_t msg;
+      int err = tcp_ssl_read(pcb, pb, &window);
 
-  msg.pcb         = pcb;
-  msg.closed_slot = INVALID_CLOSED_SLOT;
-  msg.bind.addr   = addr;
-  msg.bind.port   = port;
+      if (window)
+      {
+        _tcp_recved(pcb, _closed_slot, window);
+      }
 
-  tcpip_api_call(_tcp_bind_api, (struct tcpip_api_call_data*)&msg);
+      pbuf_free(pb);
 
-  return msg.err;
-}
+      // handle errors
+      if (err < 0)
+      {
+        if (err != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+        {
+          ATCP_LOGERROR1("_recv: err =", err);
 
-/////////////////////////////////////////////
+          _close();
+        }
 
-static err_t _tcp_listen_api(struct tcpip_api_call_data *api_call_msg)
-{
-  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+        return ERR_BUF; // for lack of a better error value
+      }
 
-  msg->err = 0;
+    }
+    else
+    {
+      //we should not ack before we assimilate the data
+      _ack_pcb = true;
 
-  msg->pcb = tcp_listen_with_backlog(msg->pcb, msg->backlog);
+      ASYNC_CONN_METRIC_ADD(this, plain_in, pb->len);
 
-  return msg->err;
+      if (!_handler || !_handler->onPacket(this, pb))
+      {
+        if (_handler)
+        {
+          _handler->onData(this, pb->payload, pb->len);
+        }
+
+        if (!_ack_pcb)
+        {
+          _rx_ack_len += pb->len;
+        }
+        else if (_pcb)
+        {
+          _tcp_recved(_pcb, _closed_slot, pb->len);
+        }
+
+        pbuf_free(pb);
+      }
+    }
+
+    pb = nxt;
+  }
+
+  return ERR_OK;
 }
 
 /////////////////////////////////////////////
 
-static tcp_pcb * _tcp_listen_with_backlog(tcp_pcb * pcb, uint8_t backlog)
+int8_t AsyncSSLClient::_poll(tcp_pcb* pcb)
 {
-  if (!pcb)
+  if (!_pcb)
   {
-    return NULL;
+    ATCP_LOGWARN("_poll: NULL pcb");
+
+    return ERR_OK;
   }
 
-  tcp_api_call_t msg;
+  if (pcb != _pcb)
+  {
+    ATCP_HEXLOGERROR2("_poll: diff pcb/_pcb =", (uint32_t)(uintptr_t) pcb, (uint32_t)(uintptr_t) _pcb);
 
-  msg.pcb         = pcb;
-  msg.closed_slot = INVALID_CLOSED_SLOT;
-  msg.backlog     = backlog ? backlog : 0xFF;
+    return ERR_OK;
+  }
 
-  tcpip_api_call(_tcp_listen_api, (struct tcpip_api_call_data*)&msg);
+  // Timeouts are handled by the timer wheel, see _timers()
+  if (!_stream_pump())
+  {
+    return ERR_OK;
+  }
 
-  return msg.pcb;
+  if (_handler && _poll_enabled)
+  {
+    _handler->onPoll(this);
+  }
+
+  return ERR_OK;
 }
 
 /////////////////////////////////////////////
 
-// KH
-extern "C"
+void AsyncSSLClient::_set_poll(tcp_pcb* pcb)
 {
-  // The following API stubs are for use in tcp_mbedtls.c
-  // They are callable from C and take a void* instead of an AsyncSSLClient*.
-
-  esp_err_t _tcp_output4ssl(tcp_pcb * pcb, void* client)
+  if (_poll_enabled || streaming())
   {
-    // KH
-    return _tcp_output(pcb, (reinterpret_cast<AsyncSSLClient *> (client) )->getClosed_Slot() );
-    //////
+    tcp_poll(pcb, &_tcp_poll, 1);
   }
-
-  esp_err_t _tcp_write4ssl(tcp_pcb * pcb, const char* data, size_t size, uint8_t apiflags, void* client)
+  else
   {
-    // KH
-    return _tcp_write(pcb, (reinterpret_cast<AsyncSSLClient *> (client) )->getClosed_Slot(), data, size, apiflags);
-    //////
+    tcp_poll(pcb, NULL, 0);
   }
-
 }
 
-//////////////////////////////////////////////////////////////////////////////////////
-
-/*
-  Async TCP Client
-*/
+/////////////////////////////////////////////
 
-AsyncSSLClient::AsyncSSLClient(tcp_pcb* pcb)
-  : _connect_cb(0)
-  , _connect_cb_arg(0)
-  , _discard_cb(0)
-  , _discard_cb_arg(0)
-  , _sent_cb(0)
-  , _sent_cb_arg(0)
-  , _error_cb(0)
-  , _error_cb_arg(0)
-  , _recv_cb(0)
-  , _recv_cb_arg(0)
-  , _pb_cb(0)
-  , _pb_cb_arg(0)
-  , _timeout_cb(0)
-  , _timeout_cb_arg(0)
-  , _pcb_busy(false)
-  , _pcb_sent_at(0)
-  , _ack_pcb(true)
-  , _rx_last_packet(0)
-  , _rx_since_timeout(0)
-  , _ack_timeout(ASYNC_MAX_ACK_TIME)
-  , _connect_port(0)
-    // SSL
-  , _root_ca_len(0)
-  , _root_ca(NULL)
-  , _cli_cert_len(0)
-  , _cli_cert(NULL)
-  , _cli_key_len(0)
-  , _cli_key(NULL)
-  , _pcb_secure(false)
-  , _handshake_done(true)
-  , _psk_ident(0)
-  , _psk(0)
-    //////
-  , prev(NULL)
-  , next(NULL)
+// _set_poll() from the application or the async task, through the LwIP thread
+void AsyncSSLClient::_update_poll(bool now)
 {
-  _pcb = pcb;
-  _closed_slot = INVALID_CLOSED_SLOT;
-
   if (_pcb)
   {
-    _allocate_closed_slot();
-    _rx_last_packet = millis();
-    tcp_arg(_pcb, this);
-    tcp_recv(_pcb, &_tcp_recv);
-    tcp_sent(_pcb, &_tcp_sent);
-    tcp_err(_pcb, &_tcp_error);
-    tcp_poll(_pcb, &_tcp_poll, 1);
+    _tcp_set_poll(_pcb, _closed_slot, _poll_enabled || streaming(), now ? this : NULL);
   }
 }
 
 /////////////////////////////////////////////
 
-AsyncSSLClient::~AsyncSSLClient()
+// In the async task, called by the timer wheel once the earliest deadline has passed
+void AsyncSSLClient::_timers()
 {
-  if (_pcb)
-  {
-    _close();
-  }
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
 
-  _free_closed_slot();
-}
+  // An attempt held back by the Connection Attempt Delay, _race_step() starts it when due
+  if (_race_delayed && !_race(NULL, 0))
+  {
+    _error(ERR_CONN);
 
-//////////////////////////////////////////////////////////////////////////////////////////
+    return;
+  }
 
-/*
-   Operators
- * */
+#endif
 
-AsyncSSLClient& AsyncSSLClient::operator=(const AsyncSSLClient& other)
-{
-  if (_pcb)
+  if (!_pcb)
   {
-    _close();
+    return;
   }
 
-  _pcb = other._pcb;
-  _closed_slot = other._closed_slot;
+  uint32_t now = millis();
 
-  if (_pcb)
+  // ACK Timeout
+  if (_pcb_busy && _ack_timeout && (now - _pcb_sent_at) >= _ack_timeout)
   {
-    _rx_last_packet = millis();
-    tcp_arg(_pcb, this);
-    tcp_recv(_pcb, &_tcp_recv);
-    tcp_sent(_pcb, &_tcp_sent);
-    tcp_err(_pcb, &_tcp_error);
-    tcp_poll(_pcb, &_tcp_poll, 1);
+    _pcb_busy = false;
 
-    // SSL
-    if (tcp_ssl_has(_pcb))
+    ATCP_LOGWARN1("_timers: ack timeout, state =", stateToString());
+
+    if (_handler)
+      _handler->onTimeout(this, (now - _pcb_sent_at));
+
+    // The handler may have closed us
+    if (!_pcb)
+      return;
+  }
+
+  // Still waiting for a handshake turn, _rx_last_packet is the time it was queued
+  if (_hs_state == HS_WAITING)
+  {
+    if ((now - _rx_last_packet) >= _hs_wait_timeout)
     {
-      _pcb_secure     = true;
-      _handshake_done = false;
+      ATCP_LOGWARN("_timers: no handshake turn in time");
 
-      tcp_ssl_arg(_pcb, this);
-      tcp_ssl_data(_pcb, &_s_data);
-      tcp_ssl_handshake(_pcb, &_s_handshake);
-      tcp_ssl_err(_pcb, &_s_ssl_error);
+      _handshake_release();
+
+      if (_handler)
+        _handler->onError(this, ERR_TIMEOUT);
+
+      _close();
+
+      return;
     }
-    else
+  }
+  else
+  {
+    // RX Timeout
+    if (_rx_since_timeout && (now - _rx_last_packet) >= (_rx_since_timeout * 1000))
     {
-      _pcb_secure = false;
-      _handshake_done = true;
+      ATCP_LOGWARN1("_timers: rx timeout, state =", stateToString());
+
+      _close();
+
+      return;
     }
 
-    //////
+    if (_pcb_secure && !_handshake_done && (now - _rx_last_packet) >= SSL_HANDSHAKE_TIMEOUT)
+    {
+      ATCP_LOGWARN1("_timers: ssl handshake timeout, state =", stateToString());
+
+      _close();
+
+      return;
+    }
   }
 
-  return *this;
+  _timer_arm();
 }
 
 /////////////////////////////////////////////
 
-bool AsyncSSLClient::operator==(const AsyncSSLClient &other)
+// Puts the client in the slot of its earliest deadline, unless it's already armed for an earlier one
+void AsyncSSLClient::_timer_arm()
 {
-  return (_pcb == other._pcb);
-}
+  bool      due       = false;
+  uint32_t  deadline  = 0;
 
-/////////////////////////////////////////////
+#define ASYNC_TIMER_CANDIDATE(t)    do { uint32_t _t = (t); if (!due || (int32_t)(_t - deadline) < 0) { deadline = _t; due = true; } } while (0)
 
-AsyncSSLClient & AsyncSSLClient::operator+=(const AsyncSSLClient &other)
-{
-  if (next == NULL)
+  if (!_pcb)
   {
-    next = (AsyncSSLClient*)(&other);
-    next->prev = this;
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+    // Racing connect attempts, _rx_last_packet is the start of the last one
+    if (_race_delayed)
+      ASYNC_TIMER_CANDIDATE(_rx_last_packet + ASYNC_TCP_SSL_ATTEMPT_DELAY);
+#endif
   }
   else
   {
-    AsyncSSLClient *c = next;
+    if (_pcb_busy && _ack_timeout)
+      ASYNC_TIMER_CANDIDATE(_pcb_sent_at + _ack_timeout);
 
-    while (c->next != NULL)
+    if (_hs_state == HS_WAITING)
     {
-      c = c->next;
+      ASYNC_TIMER_CANDIDATE(_rx_last_packet + _hs_wait_timeout);
     }
+    else
+    {
+      if (_rx_since_timeout)
+        ASYNC_TIMER_CANDIDATE(_rx_last_packet + _rx_since_timeout * 1000);
 
-    c->next = (AsyncSSLClient*)(&other);
-    c->next->prev = c;
+      if (_pcb_secure && !_handshake_done)
+        ASYNC_TIMER_CANDIDATE(_rx_last_packet + SSL_HANDSHAKE_TIMEOUT);
+    }
   }
 
-  return *this;
-}
+#undef ASYNC_TIMER_CANDIDATE
 
-//////////////////////////////////////////////////////////////////////////////////////////
+  if (!due)
+  {
+    return;
+  }
 
-/*
-   Callback Setters
- * */
+  bool wake = false;
 
-void AsyncSSLClient::onConnect(AcConnectHandlerSSL cb, void* arg)
-{
-  _connect_cb     = cb;
-  _connect_cb_arg = arg;
-}
+  portENTER_CRITICAL(&_tw_mux);
+
+  if (!_tw_armed || (int32_t)(deadline - _tw_deadline) < 0)
+  {
+    if (_tw_armed)
+    {
+      // Unlink from the later slot
+      if (_tw_prev)
+        _tw_prev->_tw_next = _tw_next;
+      else
+        _tw_slots[(_tw_deadline / ASYNC_TCP_SSL_TIMER_TICK) % ASYNC_TCP_SSL_TIMER_SLOTS] = _tw_next;
+
+      if (_tw_next)
+        _tw_next->_tw_prev = _tw_prev;
+    }
+    else
+    {
+      wake = (_tw_count++ == 0);
+    }
+
+    // Deadlines already behind the wheel go to the next slot it visits
+    uint32_t tick = deadline / ASYNC_TCP_SSL_TIMER_TICK;
+
+    if ((int32_t)(tick - _tw_tick) < 0)
+    {
+      tick        = _tw_tick;
+      deadline    = tick * ASYNC_TCP_SSL_TIMER_TICK;
+    }
 
-/////////////////////////////////////////////
+    AsyncSSLClient ** slot = &_tw_slots[tick % ASYNC_TCP_SSL_TIMER_SLOTS];
 
-void AsyncSSLClient::onDisconnect(AcConnectHandlerSSL cb, void* arg)
-{
-  _discard_cb     = cb;
-  _discard_cb_arg = arg;
-}
+    _tw_deadline  = deadline;
+    _tw_armed     = true;
+    _tw_prev      = NULL;
+    _tw_next      = *slot;
 
-/////////////////////////////////////////////
+    if (*slot)
+      (*slot)->_tw_prev = this;
 
-void AsyncSSLClient::onAck(AcAckHandlerSSL cb, void* arg)
-{
-  _sent_cb     = cb;
-  _sent_cb_arg = arg;
-}
+    *slot = this;
+  }
 
-/////////////////////////////////////////////
+  portEXIT_CRITICAL(&_tw_mux);
 
-void AsyncSSLClient::onError(AcErrorHandlerSSL cb, void* arg)
-{
-  _error_cb     = cb;
-  _error_cb_arg = arg;
+  // The service task may be blocked without timeout
+  if (wake && xTaskGetCurrentTaskHandle() != _async_service_task_handle)
+  {
+    _tcp_timer_wake();
+  }
 }
 
 /////////////////////////////////////////////
 
-void AsyncSSLClient::onData(AcDataHandlerSSL cb, void* arg)
+void AsyncSSLClient::_timer_cancel()
 {
-  _recv_cb     = cb;
-  _recv_cb_arg = arg;
-}
+  portENTER_CRITICAL(&_tw_mux);
 
-/////////////////////////////////////////////
+  if (_tw_armed)
+  {
+    if (_tw_prev)
+      _tw_prev->_tw_next = _tw_next;
+    else
+      _tw_slots[(_tw_deadline / ASYNC_TCP_SSL_TIMER_TICK) % ASYNC_TCP_SSL_TIMER_SLOTS] = _tw_next;
 
-void AsyncSSLClient::onPacket(AcPacketHandlerSSL cb, void* arg)
-{
-  _pb_cb     = cb;
-  _pb_cb_arg = arg;
-}
+    if (_tw_next)
+      _tw_next->_tw_prev = _tw_prev;
 
-/////////////////////////////////////////////
+    _tw_next  = NULL;
+    _tw_prev  = NULL;
+    _tw_armed = false;
+    _tw_count--;
+  }
 
-void AsyncSSLClient::onTimeout(AcTimeoutHandlerSSL cb, void* arg)
-{
-  _timeout_cb     = cb;
-  _timeout_cb_arg = arg;
+  portEXIT_CRITICAL(&_tw_mux);
 }
 
 /////////////////////////////////////////////
 
-void AsyncSSLClient::onPoll(AcConnectHandlerSSL cb, void* arg)
+// resolved: bitmask of the address families whose lookup just finished
+void AsyncSSLClient::_dns_found(struct ip_addr *ipaddr, uint8_t resolved)
 {
-  _poll_cb     = cb;
-  _poll_cb_arg = arg;
-}
-
-//////////////////////////////////////////////////////////////////////////////////////////
+  bool ok = (ipaddr && _ip_addr_valid(ipaddr));
 
-/*
-   Main Public Methods
- * */
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
 
-bool AsyncSSLClient::connect(IPAddress ip, uint16_t port, bool secure)
-{
-  if (_pcb)
+  // Still connecting over the other family, or waiting for its lookup
+  if (_race(ok ? ipaddr : NULL, resolved))
   {
-    ATCP_LOGWARN1("connect: already connected, state =", stateToString());
+    return;
+  }
 
-    return false;
+  ok = false;
+
+#else
+
+  if (ok)
+  {
+    _connect(ipaddr, _connect_port, _pcb_secure);
   }
 
-  if (!_start_async_task())
+#endif
+
+  if (!ok)
   {
-    ATCP_LOGERROR("connect: failed to start task");
+    if (_handler)
+    {
+      _handler->onError(this, -55);
+    }
 
-    return false;
+    if (_handler)
+    {
+      _handler->onDisconnect(this);
+    }
   }
+}
 
-  ip_addr_t addr;
-  addr.type = IPADDR_TYPE_V4;
-  addr.u_addr.ip4.addr = ip;
+/////////////////////////////////////////////
 
-  tcp_pcb* pcb = tcp_new_ip_type(IPADDR_TYPE_V4);
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
 
-  if (!pcb)
-  {
-    ATCP_LOGERROR("connect: NULL pcb");
+/*
+   Happy Eyeballs
 
-    return false;
-  }
+   Every family of a dual-stack connect(host) gets its own pcb as soon as its lookup finishes. Until
+   one of them connects, the pcbs use their AsyncSSLConnectAttempt as lwIP arg and the _s_race_*
+   callbacks. The winner is switched to the regular callbacks and the other attempt is aborted.
+   All of it runs in LwIP Thread, so it can't race with the attempts' own callbacks.
 
-  // SSL
-  _pcb_secure = secure;
-  _handshake_done = !secure;
-  //////
+   As RFC 8305 recommends, an attempt doesn't start while the other one has been in flight for less
+   than ASYNC_TCP_SSL_ATTEMPT_DELAY. Its pcb is held back unconnected (state CLOSED, the address in
+   remote_ip) with _race_delayed set, and the timer wheel calls _race_step() again when the delay is
+   over. The other attempt failing starts it right away.
+ * */
 
-  tcp_arg(pcb, this);
-  tcp_err(pcb, &_tcp_error);
-  tcp_recv(pcb, &_tcp_recv);
-  tcp_sent(pcb, &_tcp_sent);
-  tcp_poll(pcb, &_tcp_poll, 1);
+// Returns true if the connect is still going on: a lookup pending, an attempt in flight or done
+bool AsyncSSLClient::_race(struct ip_addr *addr, uint8_t resolved)
+{
+  tcp_api_call_t msg;
 
-  _tcp_connect(pcb, _closed_slot, &addr, port, (tcp_connected_fn)&_tcp_connected);
+  msg.pcb            = NULL;
+  msg.closed_slot    = INVALID_CLOSED_SLOT;
+  msg.race.client    = this;
+  msg.race.addr      = addr;
+  msg.race.resolved  = resolved;
 
-  return true;
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_RACE], 1);
+  tcpip_api_call(&_s_race_api, (struct tcpip_api_call_data*)&msg);
+
+  return msg.err == ERR_OK;
 }
 
 /////////////////////////////////////////////
 
-bool AsyncSSLClient::connect(const char* host, uint16_t port, bool secure)
+//In LwIP Thread
+bool AsyncSSLClient::_race_step(struct ip_addr *addr, uint8_t resolved)
 {
-  ip_addr_t addr;
+  _race_pending &= ~resolved;
 
-  if (!_start_async_task())
+  if (_race_won)
   {
-    ATCP_LOGERROR("connect: failed to start task");
+    return true;
+  }
 
-    return false;
+  if (addr)
+  {
+    AsyncSSLConnectAttempt * a = &_attempts[IP_IS_V6(addr) ? ASYNC_IP_FAMILY_V6 : ASYNC_IP_FAMILY_V4];
+
+    if (!a->pcb)
+    {
+      tcp_pcb * pcb = tcp_new_ip_type(IP_GET_TYPE(addr));
+
+      if (pcb)
+      {
+        tcp_arg(pcb, a);
+        tcp_err(pcb, (tcp_err_fn)&_s_race_error);
+
+        // Connected below, now or once the Connection Attempt Delay is over
+        ip_addr_copy(pcb->remote_ip, *addr);
+        a->pcb = pcb;
+      }
+    }
   }
 
-  err_t err = dns_gethostbyname(host, &addr, (dns_found_callback)&_tcp_dns_found, this);
+  bool connecting = false;
 
-  if (err == ERR_OK)
+  for (int i = 0; i < ASYNC_IP_FAMILIES; i++)
   {
-    _hostname = host;
-
-    return connect(IPAddress(addr.u_addr.ip4.addr), port, secure);
+    if (_attempts[i].pcb && _attempts[i].pcb->state != CLOSED)
+    {
+      connecting = true;
+    }
   }
-  else if (err == ERR_INPROGRESS)
+
+  _race_delayed = false;
+
+  // IPv6 first, as in connect()
+  const uint8_t families[] = { ASYNC_IP_FAMILY_V6, ASYNC_IP_FAMILY_V4 };
+
+  for (int i = 0; i < 2; i++)
   {
-    _connect_port = port;
+    AsyncSSLConnectAttempt * a = &_attempts[families[i]];
+    tcp_pcb * pcb = a->pcb;
 
-    _hostname = host;
-    _pcb_secure = secure;
-    _handshake_done = !secure;
+    if (!pcb || pcb->state != CLOSED)
+    {
+      continue;
+    }
 
-    return true;
-  }
+    if (connecting && (millis() - _rx_last_packet) < ASYNC_TCP_SSL_ATTEMPT_DELAY)
+    {
+      _race_delayed = true;
 
-  ATCP_LOGERROR1("connect: error =", err);
+      continue;
+    }
 
-  return false;
-}
+    ip_addr_t remote;
+    ip_addr_copy(remote, pcb->remote_ip);
 
-/////////////////////////////////////////////
+    if (tcp_connect(pcb, &remote, _connect_port, (tcp_connected_fn)&_s_race_connected) == ERR_OK)
+    {
+      connecting      = true;
+      _rx_last_packet = millis();
+    }
+    else
+    {
+      ATCP_LOGDEBUG1("_race_step: tcp_connect failed, IP =", ipaddr_ntoa(&remote));
 
-void AsyncSSLClient::close(bool now)
-{
-  if (_pcb)
-  {
-    _tcp_recved(_pcb, _closed_slot, _rx_ack_len);
-  }
+      a->pcb = NULL;
 
-  _close();
-}
+      tcp_arg(pcb, NULL);
+      tcp_err(pcb, NULL);
 
-/////////////////////////////////////////////
+      if (tcp_close(pcb) != ERR_OK)
+      {
+        tcp_abort(pcb);
+      }
+    }
+  }
 
-int8_t AsyncSSLClient::abort()
-{
-  if (_pcb)
+  if (_race_delayed)
   {
-    _tcp_abort(_pcb, _closed_slot );
-    _pcb = NULL;
+    _timer_arm();
   }
 
-  return ERR_ABRT;
+  for (int i = 0; i < ASYNC_IP_FAMILIES; i++)
+  {
+    if (_attempts[i].pcb)
+    {
+      return true;
+    }
+  }
+
+  return (_race_pending != 0);
 }
 
 /////////////////////////////////////////////
 
-void AsyncSSLClient::setRootCa(const char* rootca, const size_t len)
+void AsyncSSLClient::_race_cancel()
 {
-  _root_ca     = (char*)rootca;
-  _root_ca_len = len;
-}
+  if (!_race_pending && !_attempts[ASYNC_IP_FAMILY_V4].pcb && !_attempts[ASYNC_IP_FAMILY_V6].pcb)
+  {
+    return;
+  }
 
-/////////////////////////////////////////////
+  _dns_cache_cancel();
 
-void AsyncSSLClient::setClientCert(const char* cli_cert, const size_t len)
-{
-  _cli_cert     = (char*)cli_cert;
-  _cli_cert_len = len;
-}
+  // No lookup result can come in anymore, so nothing is pending. Pretend we won to abort the rest
+  tcp_api_call_t msg;
 
-/////////////////////////////////////////////
+  msg.pcb            = NULL;
+  msg.closed_slot    = INVALID_CLOSED_SLOT;
+  msg.race.client    = this;
+  msg.race.addr      = NULL;
+  msg.race.resolved  = 0xFF;
 
-void AsyncSSLClient::setClientKey(const char* cli_key, const size_t len)
-{
-  _cli_key     = (char*)cli_key;
-  _cli_key_len = len;
-}
+  _race_won = true;
 
-/////////////////////////////////////////////
+  ASYNC_METRIC_ADD(_async_metrics.api_calls[ASYNC_API_RACE], 1);
+  tcpip_api_call(&_s_race_api, (struct tcpip_api_call_data*)&msg);
 
-void AsyncSSLClient::setPsk(const char* psk_ident, const char* psk)
-{
-  _psk_ident = psk_ident;
-  _psk       = psk;
+  _tcp_clear_events(this);
 }
 
+#endif
 
 /////////////////////////////////////////////
 
-size_t AsyncSSLClient::space()
+// Returns ERR_OK with addr filled in on a cache hit, ERR_INPROGRESS if this client now waits for
+// a lookup (its own or one already in flight), or the dns_gethostbyname() error
+int8_t AsyncSSLClient::_dns_cache_lookup(const char* host, struct ip_addr *addr, uint8_t family)
 {
-  if ((_pcb != NULL) && (_pcb->state == ESTABLISHED))
-  {
-    return tcp_sndbuf(_pcb);
-  }
+#if LWIP_IPV6
+  uint8_t addrtype = (family == ASYNC_IP_FAMILY_V6) ? LWIP_DNS_ADDRTYPE_IPV6 :
+                     (family == ASYNC_IP_FAMILY_V4) ? LWIP_DNS_ADDRTYPE_IPV4 : LWIP_DNS_ADDRTYPE_DEFAULT;
+#else
+  uint8_t addrtype = LWIP_DNS_ADDRTYPE_DEFAULT;
+#endif
 
-  return 0;
-}
+#if (ASYNC_DNS_CACHE_SIZE > 0)
 
-/////////////////////////////////////////////
+  int slot = (family == ASYNC_IP_FAMILY_V6) ? ASYNC_IP_FAMILY_V6 : ASYNC_IP_FAMILY_V4;
 
-size_t AsyncSSLClient::add(const char* data, size_t size, uint8_t apiflags)
-{
-  if (!_pcb || size == 0 || data == NULL)
+  if (strlen(host) < ASYNC_DNS_CACHE_NAME_LEN)
   {
-    return 0;
-  }
+    xSemaphoreTakeRecursive(_dns_cache_lock, portMAX_DELAY);
 
-  size_t room = space();
+    uint32_t now = millis();
+    dns_cache_entry_t * entry  = NULL;
+    dns_cache_entry_t * victim = NULL;
 
-  if (!room)
-  {
-    return 0;
-  }
+    for (int i = 0; i < ASYNC_DNS_CACHE_SIZE; i++)
+    {
+      dns_cache_entry_t * e = &_dns_cache[i];
 
-  if (_pcb_secure)
-  {
-    int sent = tcp_ssl_write(_pcb, (uint8_t*)data, size);
+      if (e->state != DNS_ENTRY_FREE && e->family == family && !strcasecmp(e->name, host))
+      {
+        entry = e;
+        break;
+      }
 
-    ASYNC_TCP_SSL_DEBUG("add() tcp_ssl_write size = %d\n", sent);
+      // Entries still fanning out a failed result keep their waiters list until done
+      if (e->state != DNS_ENTRY_PENDING && !e->waiters
+          && (!victim || e->state < victim->state || (e->state == victim->state && e->stamp < victim->stamp)))
+      {
+        victim = e;
+      }
+    }
 
-    if (sent >= 0)
+    if (entry && entry->state == DNS_ENTRY_RESOLVED)
     {
-      // @ToDo: ???
-      //_tx_unacked_len += sent;
-      return sent;
-    }
+      // Revalidate through lwIP's table, which drops the record when its TTL runs out.
+      // Same locking as a miss: _tcp_dns_cache_found only queues an event
+      err_t err = dns_gethostbyname_addrtype(host, addr, (dns_found_callback)&_tcp_dns_cache_found, entry, addrtype);
 
-    ATCP_LOGINFO1("add() done, tcp_ssl_write size =", sent);
+      if (err == ERR_OK)
+      {
+        _dns_stats.hits++;
 
-    _close();
+        memcpy(&entry->addr, addr, sizeof(ip_addr_t));
+        entry->stamp = now;
+      }
+      else if (err == ERR_INPROGRESS)
+      {
+        // Expired in lwIP: the entry is pending again and later askers join this lookup
+        _dns_stats.misses++;
 
-    return 0;
-  }
+        entry->state = DNS_ENTRY_PENDING;
+        entry->stamp = now;
 
-  size_t will_send = (room < size) ? room : size;
+        _dns_entry[slot] = entry;
+        _dns_next[slot]  = entry->waiters;
+        entry->waiters   = this;
+      }
+      else
+      {
+        _dns_stats.lookups++;
+        _dns_stats.failures++;
 
-  int8_t err = ERR_OK;
+        if (!entry->waiters)
+          entry->state = DNS_ENTRY_FREE;
+      }
 
-  err = _tcp_write(_pcb, _closed_slot, data, will_send, apiflags);
+      xSemaphoreGiveRecursive(_dns_cache_lock);
 
-  if (err != ERR_OK)
-  {
-    return 0;
-  }
+      return err;
+    }
 
-  return will_send;
-}
+    if (entry)
+    {
+      _dns_stats.coalesced++;
 
-/////////////////////////////////////////////
+      _dns_entry[slot] = entry;
+      _dns_next[slot]  = entry->waiters;
+      entry->waiters   = this;
 
-bool AsyncSSLClient::send()
-{
-  // 5 is also OK
-  vTaskDelay(1 / portTICK_PERIOD_MS);
+      xSemaphoreGiveRecursive(_dns_cache_lock);
 
-  int8_t err = ERR_OK;
+      return ERR_INPROGRESS;
+    }
 
-  err = _tcp_output(_pcb, _closed_slot);
+    if (victim)
+    {
+      _dns_stats.misses++;
 
-  if (err == ERR_OK)
-  {
-    _pcb_busy    = true;
-    _pcb_sent_at = millis();
+      strcpy(victim->name, host);
+      victim->state   = DNS_ENTRY_PENDING;
+      victim->family  = family;
+      victim->stamp   = now;
+      victim->waiters = this;
 
-    return true;
-  }
+      _dns_entry[slot] = victim;
+      _dns_next[slot]  = NULL;
 
-  return false;
-}
+      // Lock is held so nobody can join before we know whether lwIP answered synchronously.
+      // _tcp_dns_cache_found only queues an event, it never takes the lock.
+      err_t err = dns_gethostbyname_addrtype(host, addr, (dns_found_callback)&_tcp_dns_cache_found, victim, addrtype);
 
-/////////////////////////////////////////////
+      if (err != ERR_INPROGRESS)
+      {
+        victim->waiters = NULL;
+        victim->state   = DNS_ENTRY_FREE;
 
-size_t AsyncSSLClient::ack(size_t len)
-{
-  if (len > _rx_ack_len)
-    len = _rx_ack_len;
+        _dns_entry[slot] = NULL;
 
-  if (len)
-  {
-    _tcp_recved(_pcb, _closed_slot, len);
-  }
+        _dns_stats.lookups++;
 
-  _rx_ack_len -= len;
+        if (err == ERR_OK)
+        {
+          memcpy(&victim->addr, addr, sizeof(ip_addr_t));
+          victim->state = DNS_ENTRY_RESOLVED;
+        }
+        else
+        {
+          _dns_stats.failures++;
+        }
+      }
 
-  return len;
-}
+      xSemaphoreGiveRecursive(_dns_cache_lock);
 
-/////////////////////////////////////////////
+      return err;
+    }
 
-void AsyncSSLClient::ackPacket(struct pbuf * pb)
-{
-  if (!pb)
-  {
-    return;
+    xSemaphoreGiveRecursive(_dns_cache_lock);
   }
 
-  _tcp_recved(_pcb, _closed_slot, pb->len);
-  pbuf_free(pb);
-}
+#endif
+
+  xSemaphoreTakeRecursive(_dns_cache_lock, portMAX_DELAY);
+  _dns_stats.bypassed++;
+  xSemaphoreGiveRecursive(_dns_cache_lock);
+
+  // Without the cache, this client is the lwIP arg and the callback tells which family is done
+  dns_found_callback found = (dns_found_callback)&_tcp_dns_found;
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+
+  if (family == ASYNC_IP_FAMILY_V4)
+    found = (dns_found_callback)&_tcp_dns_found_v4;
+  else if (family == ASYNC_IP_FAMILY_V6)
+    found = (dns_found_callback)&_tcp_dns_found_v6;
 
-//////////////////////////////////////////////////////////////////////////////////////////
+#endif
 
-/*
-   Main Private Methods
- * */
+  return dns_gethostbyname_addrtype(host, addr, found, this, addrtype);
+}
 
-int8_t AsyncSSLClient::_close()
+/////////////////////////////////////////////
+
+void AsyncSSLClient::_dns_cache_cancel()
 {
-  int8_t err = ERR_OK;
+#if (ASYNC_DNS_CACHE_SIZE > 0)
 
-  if (_pcb)
+  for (int slot = 0; slot < ASYNC_IP_FAMILIES; slot++)
   {
-    if (_pcb_secure)
+    if (!_dns_entry[slot])
     {
-      tcp_ssl_free(_pcb);
+      continue;
     }
 
-    tcp_arg(_pcb, NULL);
-    tcp_sent(_pcb, NULL);
-    tcp_recv(_pcb, NULL);
-    tcp_err(_pcb, NULL);
-    tcp_poll(_pcb, NULL, 0);
-
-    _tcp_clear_events(this);
+    xSemaphoreTakeRecursive(_dns_cache_lock, portMAX_DELAY);
 
-    err = _tcp_close(_pcb, _closed_slot);
+    dns_cache_entry_t * entry = (dns_cache_entry_t *) _dns_entry[slot];
 
-    if (err != ERR_OK)
+    if (entry)
     {
-      err = abort();
-    }
+      AsyncSSLClient ** c = &entry->waiters;
 
-    _pcb = NULL;
+      while (*c && *c != this)
+      {
+        c = &(*c)->_dns_next[slot];
+      }
 
-    if (_discard_cb)
-    {
-      _discard_cb(_discard_cb_arg, this);
+      if (*c)
+      {
+        *c = _dns_next[slot];
+      }
+
+      _dns_entry[slot] = NULL;
+      _dns_next[slot]  = NULL;
     }
+
+    xSemaphoreGiveRecursive(_dns_cache_lock);
   }
 
-  return err;
+#endif
 }
 
-/////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
 
-void AsyncSSLClient::_allocate_closed_slot()
+/*
+   Handshake Limit Public Methods
+ * */
+
+void AsyncSSLClient::setMaxHandshakes(uint16_t max_handshakes)
 {
-  xSemaphoreTake(_slots_lock, portMAX_DELAY);
+  xSemaphoreTakeRecursive(_hs_lock, portMAX_DELAY);
 
-  uint32_t closed_slot_min_index = 0;
+  _hs_max = max_handshakes;
 
-  for (int i = 0; i < _number_of_closed_slots; ++ i)
-  {
-    if ((_closed_slot == INVALID_CLOSED_SLOT || _closed_slots[i] <= closed_slot_min_index) && _closed_slots[i] != 0)
-    {
-      closed_slot_min_index = _closed_slots[i];
-      _closed_slot = i;
-    }
-  }
+  xSemaphoreGiveRecursive(_hs_lock);
+}
 
-  if (_closed_slot != INVALID_CLOSED_SLOT)
-  {
-    _closed_slots[_closed_slot] = 0;
-  }
+/////////////////////////////////////////////
 
-  xSemaphoreGive(_slots_lock);
+void AsyncSSLClient::setHandshakeWait(uint32_t timeout)
+{
+  _hs_wait_timeout = timeout;
 }
 
 /////////////////////////////////////////////
 
-void AsyncSSLClient::_free_closed_slot()
+uint16_t AsyncSSLClient::handshakesInFlight()
 {
-  if (_closed_slot != INVALID_CLOSED_SLOT)
-  {
-    _closed_slots[_closed_slot] = _closed_index;
-    _closed_slot = INVALID_CLOSED_SLOT;
-    _closed_index++;
-  }
+  xSemaphoreTakeRecursive(_hs_lock, portMAX_DELAY);
+
+  uint16_t active = _hs_active;
+
+  xSemaphoreGiveRecursive(_hs_lock);
+
+  return active;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 /*
-   Private Callbacks
+   Metrics Public Methods
  * */
 
-int8_t AsyncSSLClient::_connected(void* pcb, int8_t err)
+AsyncSSLMetrics AsyncSSLClient::getMetrics()
 {
-  _pcb = reinterpret_cast<tcp_pcb*>(pcb);
+  AsyncSSLMetrics metrics;
 
-  if (_pcb)
+  // Counter by counter, the copy may be torn against concurrent adds but each counter is whole
+  uint32_t * dst = (uint32_t *) &metrics;
+  uint32_t * src = (uint32_t *) &_async_metrics;
+
+  for (size_t i = 0; i < sizeof(AsyncSSLMetrics) / sizeof(uint32_t); i++)
   {
-    _rx_last_packet = millis();
-    _pcb_busy = false;
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
 
-    if (_pcb_secure)
-    {
-      bool err = false;
+  tcp_ssl_get_totals(&metrics.totals.tls);
 
-      if (_psk_ident != NULL and _psk != NULL)
-      {
-        err = tcp_ssl_new_psk_client(_pcb, this, _psk_ident, _psk) < 0;
-      }
-      else
-      {
-        err = tcp_ssl_new_client(_pcb, this, _hostname.empty() ? NULL : _hostname.c_str(),
-                                 _root_ca, _root_ca_len, _cli_cert, _cli_cert_len, _cli_key, _cli_key_len) < 0;
-      }
+  metrics.totals.handshake_ms = 0;
+  metrics.queue_depth         = __atomic_load_n(&_async_queued, __ATOMIC_RELAXED);
 
-      if (err)
-      {
-        ATCP_LOGERROR("_connected: error => closing");
+  for (int i = 0; i < ASYNC_PRIORITY_CLASSES; i++)
+  {
+    metrics.queue_class_depth[i] = _async_class_depth(i);
+  }
 
-        return _close();
-      }
+  return metrics;
+}
 
-      tcp_ssl_data(_pcb, &_s_data);
-      tcp_ssl_handshake(_pcb, &_s_handshake);
-      tcp_ssl_err(_pcb, &_s_ssl_error);
-    }
-  }
+/////////////////////////////////////////////
 
-  // _connect_cb happens after SSL handshake if this is a secure connection
-  if (_connect_cb && !_pcb_secure)
+void AsyncSSLClient::resetMetrics()
+{
+  uint32_t * counter = (uint32_t *) &_async_metrics;
+
+  for (size_t i = 0; i < sizeof(AsyncSSLMetrics) / sizeof(uint32_t); i++)
   {
-    _connect_cb(_connect_cb_arg, this);
+    __atomic_store_n(&counter[i], 0, __ATOMIC_RELAXED);
   }
 
-  return ERR_OK;
+  tcp_ssl_reset_totals();
 }
 
 /////////////////////////////////////////////
 
-void AsyncSSLClient::_error(int8_t err)
+const char * AsyncSSLClient::eventToString(uint8_t event)
 {
-  if (_pcb)
+  static const char * const names[ASYNC_TCP_SSL_EVENT_TYPES] =
   {
-    if (_pcb_secure)
-    {
-      tcp_ssl_free(_pcb);
-    }
+    "SENT", "RECV", "FIN", "ERROR", "POLL", "CLEAR", "ACCEPT", "CONNECTED", "DNS", "HANDSHAKE", "TIMER", "ACK"
+  };
 
-    tcp_arg(_pcb, NULL);
+  return (event < ASYNC_TCP_SSL_EVENT_TYPES) ? names[event] : "UNKNOWN";
+}
 
-    if (_pcb->state == LISTEN)
-    {
-      tcp_sent(_pcb, NULL);
-      tcp_recv(_pcb, NULL);
-      tcp_err(_pcb, NULL);
-      tcp_poll(_pcb, NULL, 0);
-    }
+/////////////////////////////////////////////
 
-    _pcb = NULL;
-  }
+#if (ASYNC_TCP_SSL_LATENCY_BUCKETS > 0)
 
-  if (_error_cb)
+bool AsyncSSLClient::getEventLatency(uint8_t event, AsyncSSLEventLatency& latency)
+{
+  if (event >= ASYNC_TCP_SSL_EVENT_TYPES)
   {
-    _error_cb(_error_cb_arg, this, err);
+    return false;
   }
 
-  if (_discard_cb)
-  {
-    _discard_cb(_discard_cb_arg, this);
-  }
+  portENTER_CRITICAL(&_latency_mux);
+
+  latency = _event_latency[event];
+
+  portEXIT_CRITICAL(&_latency_mux);
+
+  return true;
 }
 
 /////////////////////////////////////////////
 
-void AsyncSSLClient::_ssl_error(int8_t err)
+void AsyncSSLClient::resetEventLatency()
 {
-  if (_error_cb)
-  {
-    _error_cb(_error_cb_arg, this, err + 64);
-  }
+  portENTER_CRITICAL(&_latency_mux);
+
+  memset(_event_latency, 0, sizeof(_event_latency));
+
+  portEXIT_CRITICAL(&_latency_mux);
 }
 
 /////////////////////////////////////////////
 
-//In LwIP Thread
-int8_t AsyncSSLClient::_lwip_fin(tcp_pcb* pcb, int8_t err)
-{
-  if (!_pcb || pcb != _pcb)
-  {
-    ATCP_HEXLOGDEBUG2("_lwip_fin: pcb/_pcb =", (uint32_t)pcb, (uint32_t)_pcb);
+#endif
 
-    return ERR_OK;
-  }
+//////////////////////////////////////////////////////////////////////////////////////////
 
-  tcp_arg(_pcb, NULL);
+/*
+   DNS Cache Public Methods
+ * */
 
-  if (_pcb->state == LISTEN)
-  {
-    tcp_sent(_pcb, NULL);
-    tcp_recv(_pcb, NULL);
-    tcp_err(_pcb, NULL);
-    tcp_poll(_pcb, NULL, 0);
-  }
+AsyncSSLDnsStats AsyncSSLClient::getDnsStats()
+{
+  xSemaphoreTakeRecursive(_dns_cache_lock, portMAX_DELAY);
 
-  if (tcp_close(_pcb) != ERR_OK)
-  {
-    tcp_abort(_pcb);
-  }
+  AsyncSSLDnsStats stats = _dns_stats;
 
-  _free_closed_slot();
-  _pcb = NULL;
+  xSemaphoreGiveRecursive(_dns_cache_lock);
 
-  return ERR_OK;
+  return stats;
 }
 
 /////////////////////////////////////////////
 
-//In Async Thread
-int8_t AsyncSSLClient::_fin(tcp_pcb* pcb, int8_t err)
+void AsyncSSLClient::clearDnsCache()
 {
-  _tcp_clear_events(this);
+#if (ASYNC_DNS_CACHE_SIZE > 0)
+  xSemaphoreTakeRecursive(_dns_cache_lock, portMAX_DELAY);
 
-  if (_discard_cb)
+  for (int i = 0; i < ASYNC_DNS_CACHE_SIZE; i++)
   {
-    _discard_cb(_discard_cb_arg, this);
+    if (_dns_cache[i].state == DNS_ENTRY_RESOLVED)
+    {
+      _dns_cache[i].state = DNS_ENTRY_FREE;
+    }
   }
 
-  return ERR_OK;
+  xSemaphoreGiveRecursive(_dns_cache_lock);
+#endif
 }
 
-/////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Verified Certificate Cache Public Methods
+ * */
 
-int8_t AsyncSSLClient::_sent(tcp_pcb* pcb, uint16_t len)
+AsyncSSLVerifyStats AsyncSSLClient::getVerifyCacheStats()
 {
-  _rx_last_packet = millis();
+  AsyncSSLVerifyStats stats;
 
-  ATCP_LOGINFO1("_sent: len =", len);
+  tcp_ssl_get_verify_stats(&stats);
 
-  _pcb_busy = false;
+  return stats;
+}
 
-  if (_sent_cb)
-  {
-    _sent_cb(_sent_cb_arg, this, len, (millis() - _pcb_sent_at));
-  }
+/////////////////////////////////////////////
 
-  return ERR_OK;
+void AsyncSSLClient::clearVerifyCache()
+{
+  tcp_ssl_clear_verify_cache();
 }
 
 /////////////////////////////////////////////
 
-int8_t AsyncSSLClient::_recv(tcp_pcb* pcb, pbuf* pb, int8_t err)
+void AsyncSSLClient::clearSessionCache()
 {
-  while (pb != NULL)
-  {
-    _rx_last_packet = millis();
+  tcp_ssl_clear_sessions();
+}
 
-    pbuf *nxt = pb->next;
-    pb->next  = NULL;
+//////////////////////////////////////////////////////////////////////////////////////////
 
-    if (_pcb_secure)
-    {
-      ATCP_LOGINFO1("_recv: tot_len =", pb->tot_len);
+/*
+   Public Helper Methods
+ * */
 
-      int err = tcp_ssl_read(pcb, pb);
-      // tcp_ssl_read always processes the full pbuf, so ack all of it
+void AsyncSSLClient::stop()
+{
+  close(false);
+}
 
-      // KH
-      //_tcp_recved(pcb, pb->len);
-      _tcp_recved(pcb, _closed_slot, pb->len);
-      //////
+/////////////////////////////////////////////
 
-      pbuf_free(pb);
+bool AsyncSSLClient::free()
+{
+  if (!_pcb)
+  {
+    return true;
+  }
 
-      // handle errors
-      if (err < 0)
-      {
-        if (err != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
-        {
-          ATCP_LOGERROR1("_recv: err =", err);
+  if ( (_pcb->state == CLOSED) || (_pcb->state > ESTABLISHED) )
+  {
+    return true;
+  }
 
-          _close();
-        }
+  return false;
+}
 
-        return ERR_BUF; // for lack of a better error value
-      }
+/////////////////////////////////////////////
 
-    }
-    else
-    {
-      //we should not ack before we assimilate the data
-      _ack_pcb = true;
+size_t AsyncSSLClient::write(const char* data)
+{
+  if (data == NULL)
+  {
+    return 0;
+  }
 
-      if (_pb_cb)
-      {
-        _pb_cb(_pb_cb_arg, this, pb);
-      }
-      else
-      {
-        if (_recv_cb)
-        {
-          _recv_cb(_recv_cb_arg, this, pb->payload, pb->len);
-        }
+  return write(data, strlen(data));
+}
 
-        if (!_ack_pcb)
-        {
-          _rx_ack_len += pb->len;
-        }
-        else if (_pcb)
-        {
-          _tcp_recved(_pcb, _closed_slot, pb->len);
-        }
+/////////////////////////////////////////////
 
-        pbuf_free(pb);
-      }
-    }
+size_t AsyncSSLClient::write(const char* data, size_t size, uint8_t apiflags)
+{
+  return write(data, size, apiflags, NULL);
+}
 
-    pb = nxt;
+/////////////////////////////////////////////
+
+size_t AsyncSSLClient::write(const char* data, size_t size, uint8_t apiflags, AsyncSSLWriteToken* token)
+{
+  size_t will_send = add(data, size, apiflags, token);
+
+  if (!will_send || !send())
+  {
+    return 0;
   }
 
-  return ERR_OK;
+  return will_send;
 }
 
-/////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
 
-int8_t AsyncSSLClient::_poll(tcp_pcb* pcb)
+/*
+   Streaming Send
+
+   stream() pulls from its source in the async task only: on each ACK, on each poll while it runs,
+   and after onConnect(). Every pull asks for the plaintext of one record that fits in the send
+   window, so the only buffer is the client's ASYNC_TCP_SSL_STREAM_CHUNK staging buffer, which
+   mbedTLS encrypts from.
+ * */
+
+bool AsyncSSLClient::stream(AcStreamSourceSSL source, AcStreamDoneHandlerSSL done, void* arg)
 {
-  if (!_pcb)
+  if (!_pcb || !source)
   {
-    ATCP_LOGWARN("_poll: NULL pcb");
-
-    return ERR_OK;
+    return false;
   }
 
-  if (pcb != _pcb)
-  {
-    ATCP_HEXLOGERROR2("_poll: diff pcb/_pcb =", (uint32_t) pcb, (uint32_t) _pcb);
+  AsyncSSLSendState* state = _send_state();
+  uint8_t            idle  = STREAM_IDLE;
 
-    return ERR_OK;
+  if (!state || !__atomic_compare_exchange_n(&state->stream_state, &idle, (uint8_t) STREAM_STAGED, false,
+                                              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    return false;
   }
 
-  uint32_t now = millis();
-
-  // ACK Timeout
-  if (_pcb_busy && _ack_timeout && (now - _pcb_sent_at) >= _ack_timeout)
+  if (!state->stream_buf)
   {
-    _pcb_busy = false;
+    state->stream_buf = (uint8_t*) malloc(ASYNC_TCP_SSL_STREAM_CHUNK);
 
-    ATCP_LOGWARN1("_poll: ack timeout, state =", stateToString());
+    if (!state->stream_buf)
+    {
+      ATCP_LOGERROR("stream: out of memory");
 
-    if (_timeout_cb)
-      _timeout_cb(_timeout_cb_arg, this, (now - _pcb_sent_at));
+      __atomic_store_n(&state->stream_state, (uint8_t) STREAM_IDLE, __ATOMIC_RELEASE);
 
-    return ERR_OK;
+      return false;
+    }
   }
 
-  // RX Timeout
-  if (_rx_since_timeout && (now - _rx_last_packet) >= (_rx_since_timeout * 1000))
-  {
-    ATCP_LOGWARN1("_poll: rx timeout, state =", stateToString());
+  state->stream_source  = source;
+  state->stream_done    = done;
+  state->stream_arg     = arg;
+  state->stream_len     = 0;
+  state->stream_eof     = false;
 
-    _close();
-    return ERR_OK;
-  }
+  __atomic_store_n(&state->stream_state, (uint8_t) STREAM_RUNNING, __ATOMIC_RELEASE);
 
-  if (_pcb_secure && !_handshake_done && (now - _rx_last_packet) >= SSL_HANDSHAKE_TIMEOUT)
+  // From a callback the first records go out right away, else with a LWIP_TCP_POLL queued on the LwIP thread
+  if (xTaskGetCurrentTaskHandle() == _async_service_task_handle)
   {
-    ATCP_LOGWARN1("_poll: ssl handshake timeout, state =", stateToString());
-
-    _close();
-
-    return ERR_OK;
+    _update_poll();
+    _stream_pump();
   }
-
-  // Everything is fine
-  if (_poll_cb)
+  else
   {
-    _poll_cb(_poll_cb_arg, this);
+    _update_poll(true);
   }
 
-  return ERR_OK;
+  return true;
 }
 
 /////////////////////////////////////////////
 
-void AsyncSSLClient::_dns_found(struct ip_addr *ipaddr)
+bool AsyncSSLClient::stream(Stream& source, AcStreamDoneHandlerSSL done, void* arg)
 {
-  if (ipaddr && ipaddr->u_addr.ip4.addr)
-  {
-    connect(IPAddress(ipaddr->u_addr.ip4.addr), _connect_port, _pcb_secure);
-  }
-  else
+  Stream* from = &source;
+
+  return stream([from](void* a, AsyncSSLClient * c, uint8_t* buf, size_t len) -> int
   {
-    if (_error_cb)
-    {
-      _error_cb(_error_cb_arg, this, -55);
-    }
+    int available = from->available();
 
-    if (_discard_cb)
+    if (available <= 0)
     {
-      _discard_cb(_discard_cb_arg, this);
+      return -1;
     }
-  }
-}
 
-//////////////////////////////////////////////////////////////////////////////////////////
+    return from->readBytes((char*) buf, ((size_t) available < len) ? available : len);
+  }, done, arg);
+}
 
-/*
-   Public Helper Methods
- * */
+/////////////////////////////////////////////
 
-void AsyncSSLClient::stop()
+bool AsyncSSLClient::streaming()
 {
-  close(false);
+  return _tx_state && __atomic_load_n(&_tx_state->stream_state, __ATOMIC_ACQUIRE) != STREAM_IDLE;
 }
 
 /////////////////////////////////////////////
 
-bool AsyncSSLClient::free()
+// In the async task. false when a TLS error closed the connection, which may have freed the client:
+// the caller must not touch it then
+bool AsyncSSLClient::_stream_pump()
 {
-  if (!_pcb)
+  AsyncSSLSendState* state = _tx_state;
+
+  if (!state || __atomic_load_n(&state->stream_state, __ATOMIC_ACQUIRE) != STREAM_RUNNING || !_pcb || !_handshake_done)
   {
     return true;
   }
 
-  if ( (_pcb->state == CLOSED) || (_pcb->state > ESTABLISHED) )
+  bool added = false;
+
+  while (!state->stream_eof)
   {
-    return true;
+    size_t room = space();
+
+    if (_pcb_secure)
+    {
+      room = tcp_ssl_record_room(_pcb, room);
+    }
+
+    if (room > ASYNC_TCP_SSL_STREAM_CHUNK)
+    {
+      room = ASYNC_TCP_SSL_STREAM_CHUNK;
+    }
+
+    if (!state->stream_len)
+    {
+      int len = room ? state->stream_source(state->stream_arg, this, state->stream_buf, room) : 0;
+
+      if (len < 0)
+      {
+        state->stream_eof = true;
+        _tcp_seq(_pcb, _closed_slot, NULL, &state->stream_end);
+
+        break;
+      }
+
+      state->stream_len = ((size_t) len < room) ? len : room;
+    }
+
+    // Nothing from the source right now, or a record kept from before that doesn't fit yet
+    if (!state->stream_len || state->stream_len > room)
+    {
+      break;
+    }
+
+    bool failed = false;
+
+    if (!_add((const char*) state->stream_buf, state->stream_len, ASYNC_WRITE_FLAG_COPY, NULL, &failed))
+    {
+      if (failed)
+      {
+        _close();
+
+        return false;
+      }
+
+      // lwIP is out of memory, the record waits for the next turn
+      break;
+    }
+
+    state->stream_len = 0;
+    added             = true;
   }
 
-  return false;
-}
+  if (added)
+  {
+    _output();
+  }
 
-/////////////////////////////////////////////
+  uint32_t acked;
 
-size_t AsyncSSLClient::write(const char* data)
-{
-  if (data == NULL)
+  if (state->stream_eof && (_tcp_seq(_pcb, _closed_slot, &acked, NULL) == ERR_OK)
+      && ((int32_t) (acked - state->stream_end) >= 0))
   {
-    return 0;
+    _stream_end(true);
   }
 
-  return write(data, strlen(data));
+  return true;
 }
 
 /////////////////////////////////////////////
 
-size_t AsyncSSLClient::write(const char* data, size_t size, uint8_t apiflags)
+void AsyncSSLClient::_stream_end(bool complete)
 {
-  size_t will_send = add(data, size, apiflags);
+  AsyncSSLSendState* state = _tx_state;
 
-  if (!will_send || !send())
+  if (!state || __atomic_load_n(&state->stream_state, __ATOMIC_ACQUIRE) != STREAM_RUNNING)
   {
-    return 0;
+    return;
   }
 
-  return will_send;
+  AcStreamDoneHandlerSSL  done  = std::move(state->stream_done);
+  void*                   arg   = state->stream_arg;
+
+  state->stream_source  = NULL;
+  state->stream_done    = NULL;
+  state->stream_len     = 0;
+
+  // done may start the next stream()
+  __atomic_store_n(&state->stream_state, (uint8_t) STREAM_IDLE, __ATOMIC_RELEASE);
+
+  _update_poll();
+
+  if (done)
+  {
+    done(arg, this, complete);
+  }
 }
 
 /////////////////////////////////////////////
@@ -1875,6 +5344,8 @@ size_t AsyncSSLClient::write(const char* data, size_t size, uint8_t apiflags)
 void AsyncSSLClient::setRxTimeout(uint32_t timeout)
 {
   _rx_since_timeout = timeout;
+
+  _timer_arm();
 }
 
 /////////////////////////////////////////////
@@ -1896,6 +5367,8 @@ uint32_t AsyncSSLClient::getAckTimeout()
 void AsyncSSLClient::setAckTimeout(uint32_t timeout)
 {
   _ack_timeout = timeout;
+
+  _timer_arm();
 }
 
 /////////////////////////////////////////////
@@ -1950,6 +5423,15 @@ uint32_t AsyncSSLClient::getRemoteAddress()
     return 0;
   }
 
+#if LWIP_IPV6
+
+  if (IP_IS_V6(&_pcb->remote_ip))
+  {
+    return 0;
+  }
+
+#endif
+
   return _pcb->remote_ip.u_addr.ip4.addr;
 }
 
@@ -1974,6 +5456,15 @@ uint32_t AsyncSSLClient::getLocalAddress()
     return 0;
   }
 
+#if LWIP_IPV6
+
+  if (IP_IS_V6(&_pcb->local_ip))
+  {
+    return 0;
+  }
+
+#endif
+
   return _pcb->local_ip.u_addr.ip4.addr;
 }
 
@@ -1991,6 +5482,41 @@ uint16_t AsyncSSLClient::getLocalPort()
 
 /////////////////////////////////////////////
 
+#if LWIP_IPV6
+
+bool AsyncSSLClient::isIPv6()
+{
+  return (_pcb && IP_IS_V6(&_pcb->remote_ip));
+}
+
+/////////////////////////////////////////////
+
+IPv6Address AsyncSSLClient::remoteIP6()
+{
+  if (!isIPv6())
+  {
+    return IPv6Address();
+  }
+
+  return IPv6Address(_pcb->remote_ip.u_addr.ip6.addr);
+}
+
+/////////////////////////////////////////////
+
+IPv6Address AsyncSSLClient::localIP6()
+{
+  if (!_pcb || !IP_IS_V6(&_pcb->local_ip))
+  {
+    return IPv6Address();
+  }
+
+  return IPv6Address(_pcb->local_ip.u_addr.ip6.addr);
+}
+
+/////////////////////////////////////////////
+
+#endif
+
 IPAddress AsyncSSLClient::remoteIP()
 {
   return IPAddress(getRemoteAddress());
@@ -2176,41 +5702,207 @@ const char * AsyncSSLClient::stateToString()
     case SYN_RCVD:
       return "SYN Received";
 
-    case ESTABLISHED:
-      return "Established";
+    case ESTABLISHED:
+      return "Established";
+
+    case FIN_WAIT_1:
+      return "FIN Wait 1";
+
+    case FIN_WAIT_2:
+      return "FIN Wait 2";
+
+    case CLOSE_WAIT:
+      return "Close Wait";
+
+    case CLOSING:
+      return "Closing";
+
+    case LAST_ACK:
+      return "Last ACK";
+
+    case TIME_WAIT:
+      return "Time Wait";
+
+    default:
+      return "UNKNOWN";
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+   Static Callbacks (LwIP C2C++ interconnect)
+ * */
+
+void AsyncSSLClient::_s_dns_found(const char * name, struct ip_addr * ipaddr, void * arg, uint8_t resolved)
+{
+  reinterpret_cast<AsyncSSLClient*>(arg)->_dns_found(ipaddr, resolved);
+}
+
+/////////////////////////////////////////////
+
+#if ASYNC_TCP_SSL_HAPPY_EYEBALLS
+
+//In LwIP Thread
+int8_t AsyncSSLClient::_s_race_api(struct tcpip_api_call_data *api_call_msg)
+{
+  tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+  AsyncSSLClient * client = msg->race.client;
+
+  bool running = client->_race_step(msg->race.addr, msg->race.resolved);
+
+  // Cancelled: abort whatever is still connecting or held back
+  if (msg->race.resolved == 0xFF && !msg->race.addr)
+  {
+    client->_race_delayed = false;
+
+    for (int i = 0; i < ASYNC_IP_FAMILIES; i++)
+    {
+      tcp_pcb * pcb = client->_attempts[i].pcb;
+
+      if (pcb)
+      {
+        client->_attempts[i].pcb = NULL;
+
+        tcp_arg(pcb, NULL);
+        tcp_err(pcb, NULL);
+        tcp_abort(pcb);
+      }
+    }
+  }
+
+  msg->err = running ? ERR_OK : ERR_CONN;
+
+  return msg->err;
+}
+
+/////////////////////////////////////////////
+
+//In LwIP Thread
+int8_t AsyncSSLClient::_s_race_connected(void* arg, tcp_pcb* pcb, int8_t err)
+{
+  AsyncSSLConnectAttempt * a = (AsyncSSLConnectAttempt *) arg;
+  AsyncSSLClient * client = a->client;
+
+  ATCP_LOGDEBUG1("_s_race_connected: won over", IP_IS_V6(&pcb->remote_ip) ? "IPv6" : "IPv4");
+
+  client->_race_won     = true;
+  client->_race_delayed = false;
+  a->pcb = NULL;
+
+  for (int i = 0; i < ASYNC_IP_FAMILIES; i++)
+  {
+    tcp_pcb * other = client->_attempts[i].pcb;
+
+    if (other)
+    {
+      client->_attempts[i].pcb = NULL;
+
+      tcp_arg(other, NULL);
+      tcp_err(other, NULL);
+      tcp_abort(other);
+    }
+  }
+
+  tcp_arg(pcb, client);
+  tcp_err(pcb, &_tcp_error);
+  tcp_recv(pcb, &_tcp_recv);
+  tcp_sent(pcb, &_tcp_sent);
+  client->_set_poll(pcb);
+
+  return _tcp_connected(client, pcb, err);
+}
+
+/////////////////////////////////////////////
+
+//In LwIP Thread. The pcb is already freed by lwIP
+void AsyncSSLClient::_s_race_error(void *arg, int8_t err)
+{
+  AsyncSSLConnectAttempt * a = (AsyncSSLConnectAttempt *) arg;
+  AsyncSSLClient * client = a->client;
+
+  a->pcb = NULL;
+
+  ATCP_LOGDEBUG1("_s_race_error: attempt failed, err =", err);
+
+  // Last one standing reports the error as a regular connect failure
+  if (!client->_race_step(NULL, 0))
+  {
+    _tcp_error(client, err);
+  }
+}
+
+#endif
+
+/////////////////////////////////////////////
+
+// Fan the result of a cached lookup out to every client waiting on the entry
+void AsyncSSLClient::_s_dns_cache_found(const char * name, struct ip_addr * ipaddr, void * arg)
+{
+#if (ASYNC_DNS_CACHE_SIZE > 0)
+  dns_cache_entry_t * entry = (dns_cache_entry_t *) arg;
+
+  int     slot     = (entry->family == ASYNC_IP_FAMILY_V6) ? ASYNC_IP_FAMILY_V6 : ASYNC_IP_FAMILY_V4;
+  uint8_t resolved = (entry->family == ASYNC_IP_FAMILY_ANY) ? 0xFF : (1 << entry->family);
+
+  ip_addr_t result;
+  memcpy(&result, ipaddr, sizeof(ip_addr_t));
+
+  xSemaphoreTakeRecursive(_dns_cache_lock, portMAX_DELAY);
+
+  uint32_t now     = millis();
+  uint32_t latency = now - entry->stamp;
+
+  _dns_stats.lookups++;
+  _dns_stats.latency_total += latency;
+
+  if (latency > _dns_stats.latency_max)
+  {
+    _dns_stats.latency_max = latency;
+  }
+
+  if (_ip_addr_valid(&result))
+  {
+    memcpy(&entry->addr, &result, sizeof(ip_addr_t));
+    entry->state = DNS_ENTRY_RESOLVED;
+    entry->stamp = now;
+  }
+  else
+  {
+    _dns_stats.failures++;
+    entry->state = DNS_ENTRY_FREE;
+  }
+
+  xSemaphoreGiveRecursive(_dns_cache_lock);
 
-    case FIN_WAIT_1:
-      return "FIN Wait 1";
+  // Waiters are popped one at a time, so a client deleted meanwhile simply drops out of the list.
+  // Once the last one is popped the entry may be reused, so don't look at it again.
+  bool last = false;
 
-    case FIN_WAIT_2:
-      return "FIN Wait 2";
+  while (!last)
+  {
+    xSemaphoreTakeRecursive(_dns_cache_lock, portMAX_DELAY);
 
-    case CLOSE_WAIT:
-      return "Close Wait";
+    AsyncSSLClient * c = entry->waiters;
 
-    case CLOSING:
-      return "Closing";
+    if (c)
+    {
+      entry->waiters      = c->_dns_next[slot];
+      c->_dns_entry[slot] = NULL;
+      c->_dns_next[slot]  = NULL;
+    }
 
-    case LAST_ACK:
-      return "Last ACK";
+    last = (entry->waiters == NULL);
 
-    case TIME_WAIT:
-      return "Time Wait";
+    xSemaphoreGiveRecursive(_dns_cache_lock);
 
-    default:
-      return "UNKNOWN";
+    if (c)
+    {
+      c->_dns_found(&result, resolved);
+    }
   }
-}
 
-//////////////////////////////////////////////////////////////////////////////////////////
-
-/*
-   Static Callbacks (LwIP C2C++ interconnect)
- * */
-
-void AsyncSSLClient::_s_dns_found(const char * name, struct ip_addr * ipaddr, void * arg)
-{
-  reinterpret_cast<AsyncSSLClient*>(arg)->_dns_found(ipaddr);
+#endif
 }
 
 /////////////////////////////////////////////
@@ -2243,9 +5935,17 @@ int8_t AsyncSSLClient::_s_lwip_fin(void * arg, struct tcp_pcb * pcb, int8_t err)
 
 /////////////////////////////////////////////
 
-int8_t AsyncSSLClient::_s_sent(void * arg, struct tcp_pcb * pcb, uint16_t len)
+// In LwIP Thread, under _sched_mux
+uint16_t* AsyncSSLClient::_s_sched_index(void * arg)
 {
-  return reinterpret_cast<AsyncSSLClient*>(arg)->_sent(pcb, len);
+  return &reinterpret_cast<AsyncSSLClient*>(arg)->_sched_index;
+}
+
+/////////////////////////////////////////////
+
+int8_t AsyncSSLClient::_s_sent(void * arg, struct tcp_pcb * pcb, uint16_t len, uint32_t acked)
+{
+  return reinterpret_cast<AsyncSSLClient*>(arg)->_sent(pcb, len, acked);
 }
 
 /////////////////////////////////////////////
@@ -2268,8 +5968,28 @@ void AsyncSSLClient::_s_data(void *arg, struct tcp_pcb *tcp, uint8_t * data, siz
 {
   AsyncSSLClient *c = reinterpret_cast<AsyncSSLClient*>(arg);
 
-  if (c->_recv_cb)
-    c->_recv_cb(c->_recv_cb_arg, c, data, len);
+  ASYNC_CONN_METRIC_ADD(c, plain_in, len);
+
+  // ackLater() applies to this call only: its plaintext waits for ack(), its record's ciphertext with it
+  c->_ack_pcb = true;
+
+  if (c->_handler)
+    c->_handler->onData(c, data, len);
+
+  if (!c->_ack_pcb)
+  {
+    c->_rx_ack_len += len;
+    c->_ack_pcb     = true;
+
+    tcp_ssl_rx_hold(tcp, len);
+  }
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLClient::_s_ack(void *arg, size_t len)
+{
+  reinterpret_cast<AsyncSSLClient*>(arg)->ack(len);
 }
 
 /////////////////////////////////////////////
@@ -2279,8 +5999,142 @@ void AsyncSSLClient::_s_handshake(void *arg, struct tcp_pcb *tcp, struct tcp_ssl
   AsyncSSLClient *c  = reinterpret_cast<AsyncSSLClient*>(arg);
   c->_handshake_done = true;
 
-  if (c->_connect_cb)
-    c->_connect_cb(c->_connect_cb_arg, c);
+  c->_handshake_finished(true);
+  c->_handshake_release();
+
+  if (c->_handler)
+    c->_handler->onConnect(c);
+
+  c->_stream_pump();
+}
+
+/////////////////////////////////////////////
+
+// In the async task: runs the due timers and returns how long the service task may block
+TickType_t AsyncSSLClient::_s_timers(uint32_t now)
+{
+  uint32_t now_tick = now / ASYNC_TCP_SSL_TIMER_TICK;
+
+  portENTER_CRITICAL(&_tw_mux);
+
+  if (!_tw_count)
+  {
+    // Nothing to look at, the wheel can jump ahead
+    _tw_tick = now_tick;
+
+    portEXIT_CRITICAL(&_tw_mux);
+
+    return portMAX_DELAY;
+  }
+
+  // Behind by more than a turn (or millis() wrapped): one visit of every slot covers it
+  int32_t behind = (int32_t)(now_tick - _tw_tick);
+
+  if (behind < 0 || behind > ASYNC_TCP_SSL_TIMER_SLOTS)
+  {
+    _tw_tick = now_tick - ASYNC_TCP_SSL_TIMER_SLOTS;
+  }
+
+  while ((int32_t)(now_tick - _tw_tick) >= 0)
+  {
+    AsyncSSLClient ** slot = &_tw_slots[_tw_tick % ASYNC_TCP_SSL_TIMER_SLOTS];
+    AsyncSSLClient *  c    = *slot;
+
+    while (c && (int32_t)(c->_tw_deadline - now) > 0)
+    {
+      c = c->_tw_next;
+    }
+
+    if (!c)
+    {
+      _tw_tick++;
+      continue;
+    }
+
+    // Take it out and run it without the lock, it may re-arm, close or even delete itself
+    if (c->_tw_prev)
+      c->_tw_prev->_tw_next = c->_tw_next;
+    else
+      *slot = c->_tw_next;
+
+    if (c->_tw_next)
+      c->_tw_next->_tw_prev = c->_tw_prev;
+
+    c->_tw_next  = NULL;
+    c->_tw_prev  = NULL;
+    c->_tw_armed = false;
+    _tw_count--;
+
+    portEXIT_CRITICAL(&_tw_mux);
+
+    c->_timers();
+
+    portENTER_CRITICAL(&_tw_mux);
+  }
+
+  uint32_t count = _tw_count;
+
+  portEXIT_CRITICAL(&_tw_mux);
+
+  if (!count)
+  {
+    return portMAX_DELAY;
+  }
+
+  // Until the start of the next tick
+  uint32_t wait = (_tw_tick * ASYNC_TCP_SSL_TIMER_TICK) - millis();
+
+  if ((int32_t) wait <= 0)
+  {
+    return 0;
+  }
+
+  return pdMS_TO_TICKS(wait) + 1;
+}
+
+/////////////////////////////////////////////
+
+// In the async task, after each event: the turns freed by _handshake_release() go to the oldest
+// waiters. Under the lock until _start_tls() returns, which may free a turn again
+void AsyncSSLClient::_s_handshake_turn()
+{
+  if (!__atomic_load_n(&_hs_turns, __ATOMIC_RELAXED))
+  {
+    return;
+  }
+
+  xSemaphoreTakeRecursive(_hs_lock, portMAX_DELAY);
+
+  while (_hs_turns)
+  {
+    _hs_turns--;
+
+    AsyncSSLClient * c = _hs_head;
+
+    if (!c)
+    {
+      // All waiters left in the meantime
+      _hs_active--;
+
+      continue;
+    }
+
+    _hs_head = c->_hs_next;
+
+    if (!_hs_head)
+    {
+      _hs_tail = NULL;
+    }
+
+    c->_hs_next  = NULL;
+    c->_hs_state = HS_HOLDING;
+
+    ATCP_LOGINFO("_s_handshake_turn: starting queued handshake");
+
+    c->_start_tls();
+  }
+
+  xSemaphoreGiveRecursive(_hs_lock);
 }
 
 /////////////////////////////////////////////
@@ -2296,24 +6150,95 @@ void AsyncSSLClient::_s_ssl_error(void *arg, struct tcp_pcb *tcp, int8_t err)
   Async TCP Server
 */
 
+/*
+   Admission count
+
+   The accepted clients of a server, counted until they are deleted. Each of them holds a
+   reference, as does the server: the last one to go frees it.
+ * */
+
+struct AsyncSSLAdmission
+{
+  uint16_t  active;     // accepted clients not deleted yet
+  uint16_t  refs;       // the server and its accepted clients
+};
+
+/////////////////////////////////////////////
+
 AsyncSSLServer::AsyncSSLServer(IPAddress addr, uint16_t port)
   : _port(port)
   , _addr(addr)
+  , _addr_type(IPADDR_TYPE_V4)
+  , _noDelay(false)
+  , _pcb(0)
+  , _connect_cb(0)
+  , _connect_cb_arg(0)
+  , _priority_net(0)
+  , _priority_mask(0)
+  , _tokens(0)
+  , _tokens_at(0)
+  , _refused(0)
+  , _rate(0)
+  , _burst(0)
+  , _max_clients(0)
+  , _reserved_clients(0)
+  , _backlog(ASYNC_TCP_SSL_SERVER_BACKLOG)
+  , _admission(NULL)
+{}
+
+/////////////////////////////////////////////
+
+#if LWIP_IPV6
+
+AsyncSSLServer::AsyncSSLServer(IPv6Address addr, uint16_t port)
+  : _port(port)
+  , _addr((uint32_t) IPADDR_ANY)
+  , _addr6(addr)
+  , _addr_type(IPADDR_TYPE_V6)
   , _noDelay(false)
   , _pcb(0)
   , _connect_cb(0)
   , _connect_cb_arg(0)
+  , _priority_net(0)
+  , _priority_mask(0)
+  , _tokens(0)
+  , _tokens_at(0)
+  , _refused(0)
+  , _rate(0)
+  , _burst(0)
+  , _max_clients(0)
+  , _reserved_clients(0)
+  , _backlog(ASYNC_TCP_SSL_SERVER_BACKLOG)
+  , _admission(NULL)
 {}
 
 /////////////////////////////////////////////
 
+#endif
+
 AsyncSSLServer::AsyncSSLServer(uint16_t port)
   : _port(port)
   , _addr((uint32_t) IPADDR_ANY)
+#if LWIP_IPV6
+  , _addr_type(IPADDR_TYPE_ANY)
+#else
+  , _addr_type(IPADDR_TYPE_V4)
+#endif
   , _noDelay(false)
   , _pcb(0)
   , _connect_cb(0)
   , _connect_cb_arg(0)
+  , _priority_net(0)
+  , _priority_mask(0)
+  , _tokens(0)
+  , _tokens_at(0)
+  , _refused(0)
+  , _rate(0)
+  , _burst(0)
+  , _max_clients(0)
+  , _reserved_clients(0)
+  , _backlog(ASYNC_TCP_SSL_SERVER_BACKLOG)
+  , _admission(NULL)
 {}
 
 /////////////////////////////////////////////
@@ -2321,6 +6246,8 @@ AsyncSSLServer::AsyncSSLServer(uint16_t port)
 AsyncSSLServer::~AsyncSSLServer()
 {
   end();
+
+  _detach(_admission, false);
 }
 
 /////////////////////////////////////////////
@@ -2347,9 +6274,20 @@ void AsyncSSLServer::begin()
     return;
   }
 
+  // Before the listen pcb, _accept() reads it from then on. Without it, no count and no limit
+  if (!_admission)
+  {
+    _admission = new (std::nothrow) AsyncSSLAdmission();
+
+    if (_admission)
+    {
+      _admission->refs = 1;
+    }
+  }
+
   int8_t err;
 
-  _pcb = tcp_new_ip_type(IPADDR_TYPE_V4);
+  _pcb = tcp_new_ip_type(_addr_type);
 
   if (!_pcb)
   {
@@ -2360,8 +6298,21 @@ void AsyncSSLServer::begin()
 
   ip_addr_t local_addr;
 
-  local_addr.type            = IPADDR_TYPE_V4;
-  local_addr.u_addr.ip4.addr = (uint32_t) _addr;
+  memset(&local_addr, 0, sizeof(local_addr));
+  local_addr.type = _addr_type;
+
+#if LWIP_IPV6
+
+  if (_addr_type == IPADDR_TYPE_V6)
+  {
+    memcpy(local_addr.u_addr.ip6.addr, static_cast<const uint32_t*>(_addr6), sizeof(local_addr.u_addr.ip6.addr));
+  }
+  else
+#endif
+  {
+    // IPADDR_TYPE_ANY binds to both any addresses
+    local_addr.u_addr.ip4.addr = (uint32_t) _addr;
+  }
 
   err = _tcp_bind(_pcb, &local_addr, _port);
 
@@ -2374,9 +6325,7 @@ void AsyncSSLServer::begin()
     return;
   }
 
-  static uint8_t backlog = 5;
-
-  _pcb = _tcp_listen_with_backlog(_pcb, backlog);
+  _pcb = _tcp_listen_with_backlog(_pcb, _backlog);
 
   if (!_pcb)
   {
@@ -2412,18 +6361,51 @@ void AsyncSSLServer::end()
 //runs on LwIP thread
 int8_t AsyncSSLServer::_accept(tcp_pcb* pcb, int8_t err)
 {
-  ATCP_HEXLOGDEBUG1("_accept: pcb =", (uint32_t) pcb);
+  ATCP_HEXLOGDEBUG1("_accept: pcb =", (uint32_t)(uintptr_t) pcb);
 
   if (_connect_cb)
   {
-    AsyncSSLClient *c = new AsyncSSLClient(pcb);
+    if (!_admit(pcb))
+    {
+      // Refuse with a RST right away, the pcb is gone after tcp_abort()
+      tcp_abort(pcb);
+
+      return ERR_ABRT;
+    }
+
+#if (ASYNC_TCP_SSL_CLIENT_POOL_SIZE > 0)
+    AsyncSSLClient *c = new (AsyncSSLClientPool()) AsyncSSLClient(pcb);
+
+    if (!c)
+    {
+      ATCP_LOGWARN("_accept: client pool empty, refused");
+
+      _release();
+      _refused++;
+
+      tcp_abort(pcb);
+
+      return ERR_ABRT;
+    }
+#else
+    AsyncSSLClient *c = new (std::nothrow) AsyncSSLClient(pcb);
+#endif
 
     if (c)
     {
+      if (_admission)
+      {
+        __atomic_add_fetch(&_admission->refs, 1, __ATOMIC_RELAXED);
+
+        c->_admission = _admission;
+      }
+
       c->setNoDelay(_noDelay);
 
       return _tcp_accept(this, c);
     }
+
+    _release();
   }
 
   if (tcp_close(pcb) != ERR_OK)
@@ -2464,6 +6446,144 @@ bool AsyncSSLServer::getNoDelay()
 
 /////////////////////////////////////////////
 
+void AsyncSSLServer::setBacklog(uint8_t backlog)
+{
+  _backlog = backlog ? backlog : 1;
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLServer::setMaxClients(uint16_t max_clients)
+{
+  _max_clients = max_clients;
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLServer::setAcceptRate(uint16_t per_second, uint16_t burst)
+{
+  _rate      = per_second;
+  _burst     = burst ? burst : 1;
+  _tokens    = _burst * 1000;
+  _tokens_at = millis();
+}
+
+/////////////////////////////////////////////
+
+void AsyncSSLServer::setPriorityNetwork(IPAddress network, IPAddress mask, uint16_t reserved)
+{
+  _priority_mask    = (uint32_t) mask;
+  _priority_net     = (uint32_t) network & _priority_mask;
+  _reserved_clients = reserved;
+}
+
+/////////////////////////////////////////////
+
+uint16_t AsyncSSLServer::activeClients()
+{
+  return _admission ? __atomic_load_n(&_admission->active, __ATOMIC_RELAXED) : 0;
+}
+
+/////////////////////////////////////////////
+
+uint32_t AsyncSSLServer::refusedClients()
+{
+  return _refused;
+}
+
+/////////////////////////////////////////////
+
+//In LwIP Thread. Takes a client slot and an accept token, or nothing
+bool AsyncSSLServer::_admit(tcp_pcb* pcb)
+{
+  if (!_admission)
+  {
+    return true;
+  }
+
+  bool priority = _priority_mask && IP_IS_V4(&pcb->remote_ip)
+                  && ((pcb->remote_ip.u_addr.ip4.addr & _priority_mask) == _priority_net);
+
+  // Others can't take the clients reserved for the priority network
+  uint16_t limit  = _max_clients;
+
+  if (limit && !priority)
+  {
+    limit = (limit > _reserved_clients) ? limit - _reserved_clients : 0;
+  }
+
+  uint16_t active = __atomic_load_n(&_admission->active, __ATOMIC_RELAXED);
+
+  do
+  {
+    if (limit && active >= limit)
+    {
+      ATCP_LOGWARN1("_admit: max clients reached, refused", ipaddr_ntoa(&pcb->remote_ip));
+
+      _refused++;
+
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&_admission->active, &active, active + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  if (_rate && !priority)
+  {
+    uint32_t now     = millis();
+    uint64_t tokens  = _tokens + (uint64_t) (now - _tokens_at) * _rate;
+
+    _tokens_at = now;
+    _tokens    = (tokens > _burst * 1000U) ? _burst * 1000U : (uint32_t) tokens;
+
+    if (_tokens < 1000)
+    {
+      ATCP_LOGWARN1("_admit: accept rate exceeded, refused", ipaddr_ntoa(&pcb->remote_ip));
+
+      _release();
+      _refused++;
+
+      return false;
+    }
+
+    _tokens -= 1000;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////
+
+// An admitted connection got no client
+void AsyncSSLServer::_release()
+{
+  if (_admission)
+  {
+    __atomic_sub_fetch(&_admission->active, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/////////////////////////////////////////////
+
+// An accepted client (client) or the server is gone. The last of them frees the count
+void AsyncSSLServer::_detach(AsyncSSLAdmission* admission, bool client)
+{
+  if (!admission)
+  {
+    return;
+  }
+
+  if (client)
+  {
+    __atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_sub_fetch(&admission->refs, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    delete admission;
+  }
+}
+
+/////////////////////////////////////////////
+
 uint8_t AsyncSSLServer::status()
 {
   if (!_pcb)
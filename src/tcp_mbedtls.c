@@ -30,15 +30,54 @@
   #define _ASYNC_TCP_SSL_LOGLEVEL_       1
 #endif
 
+// mbedTLS 3 hides the handshake state and session fields used below
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
 #include "tcp_mbedtls.h"
 #include "lwip/tcp.h"
 #include "mbedtls/debug.h"
 #include "mbedtls/esp_debug.h"
+#include "mbedtls/md.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/ssl_ciphersuites.h"
+#include "mbedtls/version.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include <string.h>
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) && defined(MBEDTLS_PSA_CRYPTO_C)
+  #include "psa/crypto.h"
+#endif
+
+// tcp_ssl_verify_peer() runs the leaf checks mbedTLS does after the chain, internal in mbedTLS 3: there the
+// chain is always checked by mbedTLS itself
+#if (ASYNC_TCP_SSL_VERIFY_CACHE_SIZE > 0) && defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE) && (MBEDTLS_VERSION_NUMBER < 0x03000000)
+  #include "mbedtls/ssl_internal.h"
+  #define TCP_SSL_VERIFY_DEFERRED   1
+#else
+  #define TCP_SSL_VERIFY_DEFERRED   0
+#endif
+
+// The trust anchors digest keys the verify cache and the saved sessions
+#if TCP_SSL_VERIFY_DEFERRED || (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+  #define TCP_SSL_TRUST_DIGEST      1
+#else
+  #define TCP_SSL_TRUST_DIGEST      0
+#endif
+
+#if (MBEDTLS_VERSION_NUMBER >= 0x03000000)
+  // Renamed in mbedTLS 3
+  #define mbedtls_sha256_starts_ret     mbedtls_sha256_starts
+  #define mbedtls_sha256_update_ret     mbedtls_sha256_update
+  #define mbedtls_sha256_finish_ret     mbedtls_sha256_finish
+#endif
+
 // stubs to call LwIP's tcp functions on the LwIP thread itself, implemented in AsyncTCP.cpp
 extern esp_err_t _tcp_output4ssl(struct tcp_pcb * pcb, void* client);
-extern esp_err_t _tcp_write4ssl(struct tcp_pcb * pcb, const char* data, size_t size, uint8_t apiflags, void* client);
+extern esp_err_t _tcp_write4ssl(struct tcp_pcb * pcb, const char* data, size_t size, uint8_t apiflags, void* client,
+                                uint32_t* end);
 
 #define TCP_SSL_DEBUG(...)
 
@@ -85,6 +124,16 @@ static int handle_error(int err)
 
 static uint8_t _tcp_ssl_has_client = 0;
 
+// Receive flow control: held records tracked per connection. Past that, a record joins the newest one
+#define TCP_SSL_RX_RECORDS    8
+
+// A record whose plaintext the application hasn't consumed yet, and the ciphertext it came in
+typedef struct
+{
+  uint32_t plain;
+  uint32_t cipher;
+} tcp_ssl_rx_record_t;
+
 struct tcp_ssl_pcb
 {
   struct tcp_pcb            *tcp;
@@ -104,8 +153,26 @@ struct tcp_ssl_pcb
   tcp_ssl_handshake_cb_t    on_handshake;
   tcp_ssl_error_cb_t        on_error;
   size_t                    last_wr;
+  uint32_t                  last_end;     // lwIP's snd_lbb after the last record written, see tcp_ssl_write()
+  tcp_ssl_counters_t        *counters;    // per-connection record counters, may be NULL
+  const uint8_t             *ca_bundle;   // see tcp_ssl_opts_t, NULL for none
+  uint8_t                   trust[32];    // SHA-256 of root_ca and the CA bundle, keys the verify cache and sessions
+  bool                      verify_deferred;  // verify_cache: tcp_ssl_verify_peer() checks the chain
+  uint32_t                  session_key;  // resume: slot of the saved sessions, 0 when off
+  bool                      early_data;   // early_data: 0-RTT allowed by the config
+  uint8_t                   *early;       // plaintext sent as 0-RTT, resent if the server refuses it
+  size_t                    early_len;
+  bool                      false_start;    // false_start: allowed by the config
+  bool                      finished_sent;  // the client's Finished is written, the handshake is stepped for it
+  bool                      false_started;  // on_handshake called before the server's Finished
   struct pbuf               *tcp_pbuf;
   int                       pbuf_offset;
+  size_t                    rx_pulled;    // ciphertext read for the current record, see tcp_ssl_rx_hold()
+  size_t                    rx_kept;      // ciphertext of the pbuf being read that held records keep
+  bool                      rx_record_held; // the current record has an entry in rx_held
+  tcp_ssl_rx_record_t       rx_held[TCP_SSL_RX_RECORDS];  // oldest first, from rx_head
+  uint8_t                   rx_head;
+  uint8_t                   rx_count;
   struct tcp_ssl_pcb        *next;
 };
 
@@ -114,6 +181,78 @@ typedef struct tcp_ssl_pcb tcp_ssl_t;
 static tcp_ssl_t * tcp_ssl_array = NULL;
 static int tcp_ssl_next_fd       = 0;
 
+// Records of all connections. Reads and writes run in different tasks, hence the atomic adds
+static tcp_ssl_counters_t tcp_ssl_totals;
+
+// Empty trust list for connections trusting only a CA bundle: mbedTLS wants a CA chain to verify at all
+static mbedtls_x509_crt tcp_ssl_no_ca;
+
+#if (ASYNC_TCP_SSL_VERIFY_CACHE_SIZE > 0)
+
+typedef struct
+{
+  uint8_t   key[32];      // covers the leaf DER, so the leaf in hand carries the entry's validity
+  uint32_t  used;         // LRU stamp, 0 for a free slot
+} tcp_ssl_verified_t;
+
+static tcp_ssl_verified_t     tcp_ssl_verified[ASYNC_TCP_SSL_VERIFY_CACHE_SIZE];
+static uint32_t               tcp_ssl_verified_clock;
+static tcp_ssl_verify_stats_t tcp_ssl_verify_stats;
+static portMUX_TYPE           tcp_ssl_verify_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#endif
+
+#if (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+
+typedef struct
+{
+  uint32_t        key;        // see tcp_ssl_session_key()
+  uint8_t         trust[32];  // the trust anchors it was verified with, see tcp_ssl_trust_digest()
+  uint32_t        used;       // LRU stamp, 0 for a free slot
+  unsigned char   *data;      // mbedtls_ssl_session_save() output
+  size_t          len;
+} tcp_ssl_saved_t;
+
+// (De)serializing allocates, so the sessions are under a mutex rather than a portMUX
+static tcp_ssl_saved_t        tcp_ssl_sessions[ASYNC_TCP_SSL_SESSION_CACHE_SIZE];
+static uint32_t               tcp_ssl_sessions_clock;
+static SemaphoreHandle_t      tcp_ssl_sessions_lock;
+static portMUX_TYPE           tcp_ssl_sessions_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#endif
+
+/////////////////////////////////////////////
+
+// mbedTLS 3 has states past HANDSHAKE_OVER for TLS 1.3, and a function to tell
+static inline bool tcp_ssl_handshake_over(tcp_ssl_t *tcp_ssl)
+{
+#if (MBEDTLS_VERSION_NUMBER >= 0x03020000)
+  return mbedtls_ssl_is_handshake_over(&tcp_ssl->ssl_ctx);
+#else
+  return tcp_ssl->ssl_ctx.state == MBEDTLS_SSL_HANDSHAKE_OVER;
+#endif
+}
+
+/////////////////////////////////////////////
+
+static inline void tcp_ssl_count(tcp_ssl_t *tcp_ssl, bool in)
+{
+  if (in)
+  {
+    __atomic_fetch_add(&tcp_ssl_totals.records_in, 1, __ATOMIC_RELAXED);
+
+    if (tcp_ssl->counters)
+      tcp_ssl->counters->records_in++;
+  }
+  else
+  {
+    __atomic_fetch_add(&tcp_ssl_totals.records_out, 1, __ATOMIC_RELAXED);
+
+    if (tcp_ssl->counters)
+      tcp_ssl->counters->records_out++;
+  }
+}
+
 /////////////////////////////////////////////
 
 // tcp_ssl_recv attempts to read up to len bytes into buf from data already received.
@@ -133,6 +272,7 @@ int tcp_ssl_recv(void *ctx, unsigned char *buf, size_t len)
   recv_len = pbuf_copy_partial(tcp_ssl->tcp_pbuf, buf, len, tcp_ssl->pbuf_offset);
 
   tcp_ssl->pbuf_offset += recv_len;
+  tcp_ssl->rx_pulled   += recv_len;
 
   if (recv_len == 0)
   {
@@ -191,7 +331,7 @@ int tcp_ssl_send(void *ctx, const unsigned char *buf, size_t len)
 
   //TCP_SSL_DEBUG("tcp_ssl_send: tcp_write(%x, %x, %d, %x)\n", tcp_ssl->tcp, (char *)buf, tcp_len, tcp_ssl->arg);
 
-  err = _tcp_write4ssl(tcp_ssl->tcp, (char *)buf, tcp_len, TCP_WRITE_FLAG_COPY, tcp_ssl->arg);
+  err = _tcp_write4ssl(tcp_ssl->tcp, (char *)buf, tcp_len, TCP_WRITE_FLAG_COPY, tcp_ssl->arg, &tcp_ssl->last_end);
 
   if (err < ERR_OK)
   {
@@ -234,6 +374,820 @@ uint8_t tcp_ssl_has_client()
 
 /////////////////////////////////////////////
 
+static inline uint32_t tcp_ssl_le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+/////////////////////////////////////////////
+
+static inline uint32_t tcp_ssl_le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/////////////////////////////////////////////
+
+static uint32_t tcp_ssl_fnv1a(const uint8_t *data, size_t len)
+{
+  uint32_t hash = 2166136261u;
+
+  while (len--)
+  {
+    hash ^= *data++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/////////////////////////////////////////////
+
+// Number of roots in a CA bundle, -1 if it is malformed
+int tcp_ssl_ca_bundle_count(const uint8_t * bundle, size_t len)
+{
+  if (bundle == NULL || len < TCP_SSL_CA_BUNDLE_HEADER || memcmp(bundle, "ATCB", 4) != 0
+      || tcp_ssl_le16(bundle + 4) != TCP_SSL_CA_BUNDLE_VERSION)
+  {
+    return -1;
+  }
+
+  uint32_t count = tcp_ssl_le16(bundle + 6);
+
+  if (len < TCP_SSL_CA_BUNDLE_HEADER + count * TCP_SSL_CA_BUNDLE_ENTRY)
+  {
+    return -1;
+  }
+
+  const uint8_t *entry = bundle + TCP_SSL_CA_BUNDLE_HEADER;
+
+  for (uint32_t i = 0; i < count; i++, entry += TCP_SSL_CA_BUNDLE_ENTRY)
+  {
+    // Term by term against what is left, the sum could wrap a 32-bit size_t
+    size_t offset       = tcp_ssl_le32(entry + 4);
+    size_t subject_len  = tcp_ssl_le16(entry + 8);
+    size_t key_len      = tcp_ssl_le16(entry + 10);
+
+    if (offset > len || subject_len > len - offset || key_len > len - offset - subject_len
+        || (i > 0 && tcp_ssl_le32(entry) < tcp_ssl_le32(entry - TCP_SSL_CA_BUNDLE_ENTRY)))
+    {
+      return -1;
+    }
+  }
+
+  return count;
+}
+
+/////////////////////////////////////////////
+
+// Binary search of the index: the first entry whose subject hash is not below hash
+static uint32_t tcp_ssl_ca_bundle_lower(const uint8_t *bundle, uint32_t hash)
+{
+  const uint8_t *index = bundle + TCP_SSL_CA_BUNDLE_HEADER;
+  uint32_t      lo     = 0;
+  uint32_t      hi     = tcp_ssl_le16(bundle + 6);
+
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+
+    if (tcp_ssl_le32(index + mid * TCP_SSL_CA_BUNDLE_ENTRY) < hash)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/////////////////////////////////////////////
+
+// The next entry from *pos on with that subject, *pos is left past it. A bundle can hold several roots
+// with the same subject and different keys (a re-keyed root), so the caller goes on until one fits
+static bool tcp_ssl_ca_bundle_next(const uint8_t *bundle, const uint8_t *subject, size_t subject_len,
+                                   uint32_t hash, uint32_t *pos, const uint8_t **key, size_t *key_len)
+{
+  const uint8_t *index = bundle + TCP_SSL_CA_BUNDLE_HEADER;
+  uint32_t      count  = tcp_ssl_le16(bundle + 6);
+
+  while (*pos < count && tcp_ssl_le32(index + *pos * TCP_SSL_CA_BUNDLE_ENTRY) == hash)
+  {
+    const uint8_t *entry  = index + (*pos)++ * TCP_SSL_CA_BUNDLE_ENTRY;
+    const uint8_t *name   = bundle + tcp_ssl_le32(entry + 4);
+
+    if (tcp_ssl_le16(entry + 8) == subject_len && memcmp(name, subject, subject_len) == 0)
+    {
+      *key      = name + subject_len;
+      *key_len  = tcp_ssl_le16(entry + 10);
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/////////////////////////////////////////////
+
+// mbedtls_ssl_conf_verify() callback, called for each certificate of the chain from the top. When
+// mbedTLS found no trusted issuer for the top one, the issuer is looked up in the bundle and only its
+// public key is parsed, to check the signature. The bundle holds trust anchors only: like for
+// root_ca, the validity of the root itself is not checked
+static int tcp_ssl_ca_bundle_verify(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags)
+{
+  tcp_ssl_t *tcp_ssl = (tcp_ssl_t *) ctx;
+
+  if (!(*flags & MBEDTLS_X509_BADCERT_NOT_TRUSTED))
+  {
+    return 0;
+  }
+
+  const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type(crt->sig_md);
+  unsigned char           hash[MBEDTLS_MD_MAX_SIZE];
+
+  if (md_info == NULL || mbedtls_md(md_info, crt->tbs.p, crt->tbs.len, hash) != 0)
+  {
+    return 0;
+  }
+
+  const uint8_t *key;
+  size_t        key_len;
+  uint32_t      subject_hash  = tcp_ssl_fnv1a(crt->issuer_raw.p, crt->issuer_raw.len);
+  uint32_t      pos           = tcp_ssl_ca_bundle_lower(tcp_ssl->ca_bundle, subject_hash);
+  int           ret           = -1;
+
+  while (ret != 0 && tcp_ssl_ca_bundle_next(tcp_ssl->ca_bundle, crt->issuer_raw.p, crt->issuer_raw.len,
+                                            subject_hash, &pos, &key, &key_len))
+  {
+    mbedtls_pk_context pk;
+
+    mbedtls_pk_init(&pk);
+
+    ret = mbedtls_pk_parse_public_key(&pk, key, key_len);
+
+    if (ret == 0)
+    {
+      ret = mbedtls_pk_verify_ext(crt->sig_pk, crt->sig_opts, &pk, crt->sig_md, hash, mbedtls_md_get_size(md_info),
+                                  crt->sig.p, crt->sig.len);
+    }
+
+    mbedtls_pk_free(&pk);
+  }
+
+  if (ret == 0)
+  {
+    *flags &= ~MBEDTLS_X509_BADCERT_NOT_TRUSTED;
+  }
+
+  return 0;
+}
+
+/////////////////////////////////////////////
+
+#if TCP_SSL_TRUST_DIGEST
+
+// The trust anchors by content, not by address: a root_ca or bundle buffer reused for other roots must not
+// vouch for leaves, or sessions, checked against the old ones. Once per connection, when the verify cache
+// or session resumption is on
+static int tcp_ssl_trust_digest(tcp_ssl_t *tcp_ssl, const char *root_ca, size_t root_ca_len,
+                                const uint8_t *bundle, size_t bundle_len)
+{
+  // The lengths first, so that the root_ca bytes can't run into the bundle
+  const size_t            lens[2] = { root_ca ? root_ca_len : 0, bundle ? bundle_len : 0 };
+  mbedtls_sha256_context  ctx;
+
+  mbedtls_sha256_init(&ctx);
+
+  int ret = mbedtls_sha256_starts_ret(&ctx, 0);
+
+  if (ret == 0)
+    ret = mbedtls_sha256_update_ret(&ctx, (const unsigned char *) lens, sizeof(lens));
+
+  if (ret == 0 && lens[0])
+    ret = mbedtls_sha256_update_ret(&ctx, (const unsigned char *) root_ca, lens[0]);
+
+  if (ret == 0 && lens[1])
+    ret = mbedtls_sha256_update_ret(&ctx, bundle, lens[1]);
+
+  if (ret == 0)
+    ret = mbedtls_sha256_finish_ret(&ctx, tcp_ssl->trust);
+
+  mbedtls_sha256_free(&ctx);
+
+  return ret;
+}
+
+#endif
+
+/////////////////////////////////////////////
+
+#if TCP_SSL_VERIFY_DEFERRED
+
+/////////////////////////////////////////////
+
+static int tcp_ssl_verify_key(tcp_ssl_t *tcp_ssl, const mbedtls_x509_crt *leaf, uint8_t key[32])
+{
+  const char              *host    = tcp_ssl->ssl_ctx.hostname ? tcp_ssl->ssl_ctx.hostname : "";
+  mbedtls_sha256_context  ctx;
+
+  mbedtls_sha256_init(&ctx);
+
+  int ret = mbedtls_sha256_starts_ret(&ctx, 0);
+
+  if (ret == 0)
+    ret = mbedtls_sha256_update_ret(&ctx, tcp_ssl->trust, sizeof(tcp_ssl->trust));
+
+  // The host name with its NUL, so that it can't run into the leaf
+  if (ret == 0)
+    ret = mbedtls_sha256_update_ret(&ctx, (const unsigned char *) host, strlen(host) + 1);
+
+  if (ret == 0)
+    ret = mbedtls_sha256_update_ret(&ctx, leaf->raw.p, leaf->raw.len);
+
+  if (ret == 0)
+    ret = mbedtls_sha256_finish_ret(&ctx, key);
+
+  mbedtls_sha256_free(&ctx);
+
+  return ret;
+}
+
+/////////////////////////////////////////////
+
+static bool tcp_ssl_verified_lookup(const uint8_t key[32], bool valid)
+{
+  bool hit = false;
+
+  portENTER_CRITICAL(&tcp_ssl_verify_mux);
+
+  for (int i = 0; i < ASYNC_TCP_SSL_VERIFY_CACHE_SIZE; i++)
+  {
+    tcp_ssl_verified_t *entry = &tcp_ssl_verified[i];
+
+    if (entry->used && memcmp(entry->key, key, 32) == 0)
+    {
+      if (valid)
+      {
+        entry->used = ++tcp_ssl_verified_clock;
+        hit         = true;
+      }
+      else
+      {
+        entry->used = 0;
+        tcp_ssl_verify_stats.expired++;
+      }
+
+      break;
+    }
+  }
+
+  if (hit)
+    tcp_ssl_verify_stats.hits++;
+  else
+    tcp_ssl_verify_stats.misses++;
+
+  portEXIT_CRITICAL(&tcp_ssl_verify_mux);
+
+  return hit;
+}
+
+/////////////////////////////////////////////
+
+static void tcp_ssl_verified_store(const uint8_t key[32])
+{
+  portENTER_CRITICAL(&tcp_ssl_verify_mux);
+
+  tcp_ssl_verified_t *slot = &tcp_ssl_verified[0];
+
+  // A free slot, else the least recently used one
+  for (int i = 0; i < ASYNC_TCP_SSL_VERIFY_CACHE_SIZE && slot->used; i++)
+  {
+    if (tcp_ssl_verified[i].used < slot->used)
+    {
+      slot = &tcp_ssl_verified[i];
+    }
+  }
+
+  if (slot->used)
+    tcp_ssl_verify_stats.evicted++;
+
+  memcpy(slot->key, key, 32);
+  slot->used = ++tcp_ssl_verified_clock;
+  tcp_ssl_verify_stats.stored++;
+
+  portEXIT_CRITICAL(&tcp_ssl_verify_mux);
+}
+
+/////////////////////////////////////////////
+
+// What mbedTLS checks on the leaf after the chain, and no cached entry vouches for: the curve of an EC key
+// is one the client offered, and keyUsage/extKeyUsage allow the suite's key exchange and serverAuth
+static int tcp_ssl_verify_leaf(tcp_ssl_t *tcp_ssl, const mbedtls_x509_crt *leaf, uint32_t *flags)
+{
+  int ret = 0;
+
+#if defined(MBEDTLS_ECP_C)
+
+  if (mbedtls_pk_can_do(&leaf->pk, MBEDTLS_PK_ECKEY)
+      && mbedtls_ssl_check_curve(&tcp_ssl->ssl_ctx, mbedtls_pk_ec(leaf->pk)->grp.id) != 0)
+  {
+    *flags |= MBEDTLS_X509_BADCERT_BAD_KEY;
+    ret = MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE;
+  }
+
+#endif
+
+  const mbedtls_ssl_ciphersuite_t *suite =
+    mbedtls_ssl_ciphersuite_from_id(tcp_ssl->ssl_ctx.session_negotiate->ciphersuite);
+
+  if (suite == NULL || mbedtls_ssl_check_cert_usage(leaf, suite, MBEDTLS_SSL_IS_SERVER, flags) != 0)
+  {
+    ret = MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE;
+  }
+
+  return ret;
+}
+
+/////////////////////////////////////////////
+
+// Right after the server's Certificate message, in place of mbedTLS's own check (the connection runs
+// with MBEDTLS_SSL_VERIFY_NONE): a known, valid leaf skips the chain check, others get the full one
+// mbedTLS would have done, with root_ca and the CA bundle. The leaf checks run either way
+static int tcp_ssl_verify_peer(tcp_ssl_t *tcp_ssl)
+{
+  // mbedtls_ssl_get_peer_cert() only has it once the handshake is over
+  mbedtls_x509_crt *chain = tcp_ssl->ssl_ctx.session_negotiate->peer_cert;
+
+  if (chain == NULL)
+  {
+    return MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+  }
+
+  uint8_t   key[32];
+  uint32_t  flags = 0;
+  int       ret   = 0;
+  bool      keyed = (tcp_ssl_verify_key(tcp_ssl, chain, key) == 0);
+  bool      valid = !mbedtls_x509_time_is_past(&chain->valid_to) && !mbedtls_x509_time_is_future(&chain->valid_from);
+  bool      known = keyed && tcp_ssl_verified_lookup(key, valid);
+
+  if (!known)
+  {
+    ret = mbedtls_x509_crt_verify_with_profile(chain,
+                                               tcp_ssl->has_ca_cert ? &tcp_ssl->ca_cert : &tcp_ssl_no_ca, NULL,
+                                               tcp_ssl->ssl_conf.cert_profile, tcp_ssl->ssl_ctx.hostname, &flags,
+                                               tcp_ssl->ca_bundle ? tcp_ssl_ca_bundle_verify : NULL, tcp_ssl);
+  }
+
+  int leaf_ret = tcp_ssl_verify_leaf(tcp_ssl, chain, &flags);
+
+  tcp_ssl->ssl_ctx.session_negotiate->verify_result = flags;
+
+  if (ret != 0 || leaf_ret != 0)
+  {
+    mbedtls_ssl_send_alert_message(&tcp_ssl->ssl_ctx, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                   ret != 0 ? MBEDTLS_SSL_ALERT_MSG_BAD_CERT : MBEDTLS_SSL_ALERT_MSG_UNSUPPORTED_CERT);
+
+    return ret != 0 ? MBEDTLS_ERR_X509_CERT_VERIFY_FAILED : leaf_ret;
+  }
+
+  if (keyed && !known)
+  {
+    tcp_ssl_verified_store(key);
+  }
+
+  return 0;
+}
+
+#endif
+
+/////////////////////////////////////////////
+
+// mbedtls_ssl_handshake(), stepping through it when the chain check is deferred to tcp_ssl_verify_peer()
+// or the client's Finished is watched for False Start
+static int tcp_ssl_handshake_run(tcp_ssl_t *tcp_ssl)
+{
+  if (tcp_ssl->verify_deferred || tcp_ssl->false_start)
+  {
+    int ret = 0;
+
+    while (!tcp_ssl_handshake_over(tcp_ssl))
+    {
+      int state = tcp_ssl->ssl_ctx.state;
+
+      ret = mbedtls_ssl_handshake_step(&tcp_ssl->ssl_ctx);
+
+      // The state moves on before the Finished is flushed, which may be WANT_WRITE
+      if (state == MBEDTLS_SSL_CLIENT_FINISHED && tcp_ssl->ssl_ctx.state != state)
+      {
+        tcp_ssl->finished_sent = true;
+      }
+
+#if TCP_SSL_VERIFY_DEFERRED
+
+      if (ret == 0 && tcp_ssl->verify_deferred && state == MBEDTLS_SSL_SERVER_CERTIFICATE
+          && tcp_ssl->ssl_ctx.state != state)
+      {
+        ret = tcp_ssl_verify_peer(tcp_ssl);
+      }
+
+#endif
+
+      if (ret != 0)
+      {
+        break;
+      }
+    }
+
+    return ret;
+  }
+
+  return mbedtls_ssl_handshake(&tcp_ssl->ssl_ctx);
+}
+
+/////////////////////////////////////////////
+
+// RFC 7918: the client's Finished of a full TLS 1.2 handshake is out, with a forward secret key
+// exchange and an AEAD cipher. In an abbreviated handshake the client's Finished comes last anyway
+static bool tcp_ssl_false_start_ready(tcp_ssl_t *tcp_ssl)
+{
+  if (!tcp_ssl->false_start || tcp_ssl->false_started || !tcp_ssl->finished_sent || tcp_ssl->ssl_ctx.out_left != 0)
+  {
+    return false;
+  }
+
+  const mbedtls_ssl_ciphersuite_t *suite =
+    mbedtls_ssl_ciphersuite_from_id(tcp_ssl->ssl_ctx.session_negotiate->ciphersuite);
+
+  if (suite == NULL)
+  {
+    return false;
+  }
+
+  switch (suite->key_exchange)
+  {
+    case MBEDTLS_KEY_EXCHANGE_ECDHE_RSA:
+    case MBEDTLS_KEY_EXCHANGE_ECDHE_ECDSA:
+    case MBEDTLS_KEY_EXCHANGE_ECDHE_PSK:
+    case MBEDTLS_KEY_EXCHANGE_DHE_RSA:
+    case MBEDTLS_KEY_EXCHANGE_DHE_PSK:
+      break;
+
+    default:
+      return false;
+  }
+
+  const mbedtls_cipher_info_t *cipher = mbedtls_cipher_info_from_type((mbedtls_cipher_type_t) suite->cipher);
+
+  return (cipher != NULL) && (cipher->mode == MBEDTLS_MODE_GCM || cipher->mode == MBEDTLS_MODE_CCM
+                              || cipher->mode == MBEDTLS_MODE_CHACHAPOLY);
+}
+
+/////////////////////////////////////////////
+
+// mbedTLS has no False Start and writes application data only once the handshake is over. The client's
+// keys are in use since its ChangeCipherSpec, so the record is written as if it was. Like other writes,
+// not safe next to tcp_ssl_read() in another task: write from the client's callbacks
+static int tcp_ssl_write_false_start(tcp_ssl_t *tcp_ssl, uint8_t *data, size_t len)
+{
+  int state = tcp_ssl->ssl_ctx.state;
+
+  tcp_ssl->ssl_ctx.state = MBEDTLS_SSL_HANDSHAKE_OVER;
+
+  int rc = mbedtls_ssl_write(&tcp_ssl->ssl_ctx, data, len);
+
+  tcp_ssl->ssl_ctx.state = state;
+
+  return rc;
+}
+
+/////////////////////////////////////////////
+
+#if (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+
+static bool tcp_ssl_sessions_take()
+{
+  if (tcp_ssl_sessions_lock == NULL)
+  {
+    SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+
+    if (lock == NULL)
+    {
+      return false;
+    }
+
+    portENTER_CRITICAL(&tcp_ssl_sessions_mux);
+
+    if (tcp_ssl_sessions_lock == NULL)
+    {
+      tcp_ssl_sessions_lock = lock;
+      lock                  = NULL;
+    }
+
+    portEXIT_CRITICAL(&tcp_ssl_sessions_mux);
+
+    // Another task created it first
+    if (lock != NULL)
+    {
+      vSemaphoreDelete(lock);
+    }
+  }
+
+  return (xSemaphoreTake(tcp_ssl_sessions_lock, portMAX_DELAY) == pdTRUE);
+}
+
+/////////////////////////////////////////////
+
+// FNV-1a of the host name, or of the address without one, and the port. Never 0
+static uint32_t tcp_ssl_session_key(tcp_ssl_t *tcp_ssl, const char *hostname)
+{
+  char address[48];
+
+  if (hostname == NULL)
+  {
+    hostname = ipaddr_ntoa_r(&tcp_ssl->tcp->remote_ip, address, sizeof(address));
+
+    if (hostname == NULL)
+    {
+      return 0;
+    }
+  }
+
+  uint32_t key = tcp_ssl_fnv1a((const uint8_t *) hostname, strlen(hostname)) * 31 + tcp_ssl->tcp->remote_port;
+
+  return key ? key : 1;
+}
+
+/////////////////////////////////////////////
+
+// A saved session only resumes under the trust anchors that verified it: resuming skips the chain check
+static bool tcp_ssl_session_match(const tcp_ssl_saved_t *slot, const tcp_ssl_t *tcp_ssl)
+{
+  return slot->used && slot->key == tcp_ssl->session_key && memcmp(slot->trust, tcp_ssl->trust, 32) == 0;
+}
+
+/////////////////////////////////////////////
+
+// After mbedtls_ssl_setup(). The server may still refuse the session, which costs a full handshake
+static void tcp_ssl_session_offer(tcp_ssl_t *tcp_ssl)
+{
+  if (!tcp_ssl_sessions_take())
+  {
+    return;
+  }
+
+  for (int i = 0; i < ASYNC_TCP_SSL_SESSION_CACHE_SIZE; i++)
+  {
+    tcp_ssl_saved_t *slot = &tcp_ssl_sessions[i];
+
+    if (tcp_ssl_session_match(slot, tcp_ssl))
+    {
+      mbedtls_ssl_session session;
+
+      mbedtls_ssl_session_init(&session);
+
+      if (mbedtls_ssl_session_load(&session, slot->data, slot->len) == 0
+          && mbedtls_ssl_set_session(&tcp_ssl->ssl_ctx, &session) == 0)
+      {
+        slot->used = ++tcp_ssl_sessions_clock;
+      }
+      else
+      {
+        // Saved by another build or config
+        free(slot->data);
+        memset(slot, 0, sizeof(*slot));
+      }
+
+      mbedtls_ssl_session_free(&session);
+
+      break;
+    }
+  }
+
+  xSemaphoreGive(tcp_ssl_sessions_lock);
+}
+
+/////////////////////////////////////////////
+
+// TLS 1.2 once the handshake is over, TLS 1.3 for each NewSessionTicket, which comes after it. Only
+// sessions with a verified peer: MBEDTLS_SSL_VERIFY_OPTIONAL without a CA completes unverified ones
+static void tcp_ssl_session_store(tcp_ssl_t *tcp_ssl)
+{
+  if (!tcp_ssl->session_key || mbedtls_ssl_get_verify_result(&tcp_ssl->ssl_ctx) != 0)
+  {
+    return;
+  }
+
+  mbedtls_ssl_session session;
+  unsigned char       *data = NULL;
+  size_t              len   = 0;
+
+  mbedtls_ssl_session_init(&session);
+
+  if (mbedtls_ssl_get_session(&tcp_ssl->ssl_ctx, &session) == 0
+      && mbedtls_ssl_session_save(&session, NULL, 0, &len) == MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL
+      && (data = (unsigned char *) malloc(len)) != NULL
+      && mbedtls_ssl_session_save(&session, data, len, &len) != 0)
+  {
+    free(data);
+    data = NULL;
+  }
+
+  mbedtls_ssl_session_free(&session);
+
+  if (data == NULL)
+  {
+    return;
+  }
+
+  if (!tcp_ssl_sessions_take())
+  {
+    free(data);
+
+    return;
+  }
+
+  tcp_ssl_saved_t *slot = &tcp_ssl_sessions[0];
+
+  // The server's slot, else a free one, else the least recently used one
+  for (int i = 0; i < ASYNC_TCP_SSL_SESSION_CACHE_SIZE; i++)
+  {
+    tcp_ssl_saved_t *entry = &tcp_ssl_sessions[i];
+
+    if (tcp_ssl_session_match(entry, tcp_ssl))
+    {
+      slot = entry;
+
+      break;
+    }
+
+    if (entry->used < slot->used)
+    {
+      slot = entry;
+    }
+  }
+
+  unsigned char *old = slot->data;
+
+  slot->key   = tcp_ssl->session_key;
+  slot->used  = ++tcp_ssl_sessions_clock;
+  memcpy(slot->trust, tcp_ssl->trust, sizeof(slot->trust));
+  slot->data  = data;
+  slot->len   = len;
+
+  xSemaphoreGive(tcp_ssl_sessions_lock);
+
+  free(old);
+}
+
+#endif
+
+/////////////////////////////////////////////
+
+// Before the handshake is over: 0-RTT data when the resumed TLS 1.3 session allows it. Returns 0 when
+// it doesn't, the data has to wait for the handshake then
+static int tcp_ssl_write_early(tcp_ssl_t *tcp_ssl, uint8_t *data, size_t len, size_t *plain)
+{
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+
+  // Only with the ClientHello out and the handshake waiting for the ServerHello, outside tcp_ssl_read():
+  // mbedtls_ssl_write_early_data() steps the handshake itself before that
+  if (tcp_ssl->early_data && tcp_ssl->tcp_pbuf == NULL && tcp_ssl->ssl_ctx.state == MBEDTLS_SSL_SERVER_HELLO
+      && tcp_ssl->ssl_ctx.out_left == 0)
+  {
+    int rc = mbedtls_ssl_write_early_data(&tcp_ssl->ssl_ctx, data, len);
+
+    // MBEDTLS_ERR_SSL_CANNOT_WRITE_EARLY_DATA: no ticket allowing it, or past the point in the handshake
+    if (rc > 0)
+    {
+      // Kept in case the server refuses it. Already sent, so without room the connection fails
+      uint8_t *early = (uint8_t *) realloc(tcp_ssl->early, tcp_ssl->early_len + rc);
+
+      if (early == NULL)
+      {
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+      }
+
+      tcp_ssl->early = early;
+
+      memcpy(tcp_ssl->early + tcp_ssl->early_len, data, rc);
+      tcp_ssl->early_len += rc;
+
+      tcp_ssl_count(tcp_ssl, false);
+
+      if (plain)
+      {
+        *plain = rc;
+      }
+
+      return tcp_ssl->last_wr;
+    }
+  }
+
+#endif
+
+  return 0;
+}
+
+/////////////////////////////////////////////
+
+// Once the handshake is over. The server drops 0-RTT data it refused: that is sent again, as 1-RTT data.
+// When lwIP has no room for all of it, the unsent tail is kept for the next tcp_ssl_write() or
+// tcp_ssl_flush(), and MBEDTLS_ERR_SSL_WANT_WRITE returned: the application saw that data accepted
+static int tcp_ssl_early_done(tcp_ssl_t *tcp_ssl)
+{
+  int rc = 0;
+
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+
+  if (tcp_ssl->early == NULL)
+  {
+    return 0;
+  }
+
+  if (tcp_ssl->early_len && mbedtls_ssl_get_early_data_status(&tcp_ssl->ssl_ctx) != MBEDTLS_SSL_EARLY_DATA_STATUS_ACCEPTED)
+  {
+    size_t offset = 0;
+
+    while (offset < tcp_ssl->early_len)
+    {
+      rc = mbedtls_ssl_write(&tcp_ssl->ssl_ctx, tcp_ssl->early + offset, tcp_ssl->early_len - offset);
+
+      if (rc <= 0)
+      {
+        break;
+      }
+
+      tcp_ssl_count(tcp_ssl, false);
+      offset += rc;
+    }
+
+    // mbedTLS wants the same data again after WANT_WRITE, it has the record pending
+    if (offset < tcp_ssl->early_len && (rc == 0 || rc == MBEDTLS_ERR_SSL_WANT_WRITE || rc == MBEDTLS_ERR_SSL_WANT_READ))
+    {
+      memmove(tcp_ssl->early, tcp_ssl->early + offset, tcp_ssl->early_len - offset);
+      tcp_ssl->early_len -= offset;
+
+      return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+  }
+
+  free(tcp_ssl->early);
+  tcp_ssl->early      = NULL;
+  tcp_ssl->early_len  = 0;
+
+#endif
+
+  return (rc < 0) ? rc : 0;
+}
+
+/////////////////////////////////////////////
+
+// Before mbedtls_ssl_setup(), which keeps a pointer to the config
+static void tcp_ssl_conf_opts(mbedtls_ssl_config *conf, const tcp_ssl_opts_t* opts)
+{
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) && defined(MBEDTLS_SSL_PROTO_TLS1_2)
+
+#if defined(MBEDTLS_PSA_CRYPTO_C)
+  // TLS 1.3 runs on PSA crypto. Calls after the first one do nothing
+  psa_crypto_init();
+#endif
+
+  mbedtls_ssl_conf_min_tls_version(conf, MBEDTLS_SSL_VERSION_TLS1_2);
+  mbedtls_ssl_conf_max_tls_version(conf, ASYNC_TCP_SSL_TLS1_3 ? MBEDTLS_SSL_VERSION_TLS1_3 : MBEDTLS_SSL_VERSION_TLS1_2);
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED)
+  // Since mbedTLS 3.6.1 clients ignore TLS 1.3 tickets unless asked for them
+  mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(conf, MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED);
+#endif
+
+#endif
+
+  if (opts == NULL)
+  {
+    return;
+  }
+
+  if (opts->ciphersuites != NULL)
+  {
+    mbedtls_ssl_conf_ciphersuites(conf, opts->ciphersuites);
+  }
+
+#if defined(MBEDTLS_ECP_C)
+
+  if (opts->curves != NULL)
+  {
+    mbedtls_ssl_conf_curves(conf, opts->curves);
+  }
+
+#endif
+}
+
+/////////////////////////////////////////////
+
 tcp_ssl_t * tcp_ssl_new(struct tcp_pcb *tcp, void* arg)
 {
 
@@ -256,8 +1210,24 @@ tcp_ssl_t * tcp_ssl_new(struct tcp_pcb *tcp, void* arg)
   new_item->on_data         = NULL;
   new_item->on_handshake    = NULL;
   new_item->on_error        = NULL;
+  new_item->counters        = NULL;
+  new_item->last_end        = 0;
+  new_item->ca_bundle       = NULL;
+  new_item->verify_deferred = false;
+  new_item->session_key     = 0;
+  new_item->early_data      = false;
+  new_item->early           = NULL;
+  new_item->early_len       = 0;
+  new_item->false_start     = false;
+  new_item->finished_sent   = false;
+  new_item->false_started   = false;
   new_item->tcp_pbuf        = NULL;
   new_item->pbuf_offset     = 0;
+  new_item->rx_pulled       = 0;
+  new_item->rx_kept         = 0;
+  new_item->rx_record_held  = false;
+  new_item->rx_head         = 0;
+  new_item->rx_count        = 0;
   new_item->next            = NULL;
   new_item->has_ca_cert     = false;
   new_item->has_client_cert = false;
@@ -302,7 +1272,8 @@ tcp_ssl_t* tcp_ssl_get(struct tcp_pcb *tcp)
 
 int tcp_ssl_new_client(struct tcp_pcb *tcp, void *arg, const char* hostname, const char* root_ca,
                        const size_t root_ca_len,
-                       const char* cli_cert, const size_t cli_cert_len, const char* cli_key, const size_t cli_key_len)
+                       const char* cli_cert, const size_t cli_cert_len, const char* cli_key, const size_t cli_key_len,
+                       const tcp_ssl_opts_t* opts)
 {
   tcp_ssl_t* tcp_ssl;
 
@@ -354,6 +1325,8 @@ int tcp_ssl_new_client(struct tcp_pcb *tcp, void *arg, const char* hostname, con
     return -1;
   }
 
+  tcp_ssl_conf_opts(&tcp_ssl->ssl_conf, opts);
+
   int ret = 0;
 
   if (tcp_ssl->has_ca_cert)
@@ -382,6 +1355,69 @@ int tcp_ssl_new_client(struct tcp_pcb *tcp, void *arg, const char* hostname, con
     mbedtls_ssl_conf_authmode(&tcp_ssl->ssl_conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
   }
 
+  if (opts != NULL && opts->ca_bundle != NULL)
+  {
+    if (tcp_ssl_ca_bundle_count(opts->ca_bundle, opts->ca_bundle_len) < 0)
+    {
+      //TCP_SSL_DEBUG("malformed CA bundle\n");
+
+      tcp_ssl_free(tcp);
+
+      return -1;
+    }
+
+    tcp_ssl->ca_bundle = opts->ca_bundle;
+
+    mbedtls_ssl_conf_authmode(&tcp_ssl->ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+
+    if (!tcp_ssl->has_ca_cert)
+    {
+      mbedtls_ssl_conf_ca_chain(&tcp_ssl->ssl_conf, &tcp_ssl_no_ca, NULL);
+    }
+
+    mbedtls_ssl_conf_verify(&tcp_ssl->ssl_conf, tcp_ssl_ca_bundle_verify, tcp_ssl);
+  }
+
+#if TCP_SSL_TRUST_DIGEST
+
+  bool trusted = (opts != NULL && (opts->verify_cache || opts->resume)
+                  && tcp_ssl_trust_digest(tcp_ssl, root_ca, root_ca_len, tcp_ssl->ca_bundle, opts->ca_bundle_len) == 0);
+
+#endif
+
+#if TCP_SSL_VERIFY_DEFERRED
+
+  // The chain is then checked by tcp_ssl_verify_peer(), which needs the peer's certificates kept
+  if (trusted && opts->verify_cache && (tcp_ssl->has_ca_cert || tcp_ssl->ca_bundle != NULL))
+  {
+    tcp_ssl->verify_deferred  = true;
+
+    mbedtls_ssl_conf_authmode(&tcp_ssl->ssl_conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+
+#endif
+
+  tcp_ssl->false_start = (opts != NULL && opts->false_start);
+
+#if (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+
+  if (trusted && opts->resume)
+  {
+    tcp_ssl->session_key = tcp_ssl_session_key(tcp_ssl, hostname);
+
+#if defined(MBEDTLS_SSL_EARLY_DATA)
+
+    if (opts->early_data)
+    {
+      mbedtls_ssl_conf_early_data(&tcp_ssl->ssl_conf, MBEDTLS_SSL_EARLY_DATA_ENABLED);
+      tcp_ssl->early_data = true;
+    }
+
+#endif
+  }
+
+#endif
+
   if (tcp_ssl->has_client_cert)
   {
     //TCP_SSL_DEBUG("loading client cert");
@@ -397,7 +1433,12 @@ int tcp_ssl_new_client(struct tcp_pcb *tcp, void *arg, const char* hostname, con
 
     //TCP_SSL_DEBUG("loading private key");
 
+#if (MBEDTLS_VERSION_NUMBER >= 0x03000000)
+    ret = mbedtls_pk_parse_key(&tcp_ssl->client_key, (const unsigned char *) cli_key, cli_key_len, NULL, 0,
+                               mbedtls_ctr_drbg_random, &tcp_ssl->drbg_ctx);
+#else
     ret = mbedtls_pk_parse_key(&tcp_ssl->client_key, (const unsigned char *) cli_key, cli_key_len, NULL, 0);
+#endif
 
     if (ret != 0)
     {
@@ -432,8 +1473,18 @@ int tcp_ssl_new_client(struct tcp_pcb *tcp, void *arg, const char* hostname, con
 
   mbedtls_ssl_set_bio(&tcp_ssl->ssl_ctx, (void*)tcp_ssl, tcp_ssl_send, tcp_ssl_recv, NULL);
 
+#if (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+
+  // After the host name, which mbedTLS 3 checks the session against
+  if (tcp_ssl->session_key)
+  {
+    tcp_ssl_session_offer(tcp_ssl);
+  }
+
+#endif
+
   // Start handshake.
-  ret = mbedtls_ssl_handshake(&tcp_ssl->ssl_ctx);
+  ret = tcp_ssl_handshake_run(tcp_ssl);
 
   if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
   {
@@ -450,7 +1501,8 @@ int tcp_ssl_new_client(struct tcp_pcb *tcp, void *arg, const char* hostname, con
 /////////////////////////////////////////////
 
 // Open an SSL connection using a PSK (pre-shared-key) cipher suite.
-int tcp_ssl_new_psk_client(struct tcp_pcb *tcp, void *arg, const char* psk_ident, const char* pskey)
+int tcp_ssl_new_psk_client(struct tcp_pcb *tcp, void *arg, const char* psk_ident, const char* pskey,
+                           const tcp_ssl_opts_t* opts)
 {
   tcp_ssl_t* tcp_ssl;
 
@@ -499,6 +1551,11 @@ int tcp_ssl_new_psk_client(struct tcp_pcb *tcp, void *arg, const char* psk_ident
     return -1;
   }
 
+  tcp_ssl_conf_opts(&tcp_ssl->ssl_conf, opts);
+
+  // ECDHE-PSK and DHE-PSK suites qualify
+  tcp_ssl->false_start = (opts != NULL && opts->false_start);
+
   //mbedtls_esp_enable_debug_log(&tcp_ssl->ssl_conf, 4); // 4=verbose
 
   int ret = 0;
@@ -567,7 +1624,7 @@ int tcp_ssl_new_psk_client(struct tcp_pcb *tcp, void *arg, const char* psk_ident
   mbedtls_ssl_set_bio(&tcp_ssl->ssl_ctx, (void*)tcp_ssl, tcp_ssl_send, tcp_ssl_recv, NULL);
 
   // Start handshake.
-  ret = mbedtls_ssl_handshake(&tcp_ssl->ssl_ctx);
+  ret = tcp_ssl_handshake_run(tcp_ssl);
 
   if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
   {
@@ -582,9 +1639,16 @@ int tcp_ssl_new_psk_client(struct tcp_pcb *tcp, void *arg, const char* psk_ident
 /////////////////////////////////////////////
 
 // tcp_ssl_write writes len bytes from data into the TLS connection. I.e., data is plaintext, gets
-// encrypted, and then transmitted on the TCP connection.
-int tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len)
+// encrypted, and then transmitted on the TCP connection. Returns the ciphertext queued, *plain (may be
+// NULL) is set to the plaintext mbedtls took, at most one record's worth. After 1-RTT data, *end (may be
+// NULL) is lwIP's snd_lbb after its record, as read with the write on the tcpip thread
+int tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len, size_t *plain, uint32_t *end)
 {
+  if (plain)
+  {
+    *plain = 0;
+  }
+
   //TCP_SSL_DEBUG("tcp_ssl_write(%x, %x, len=%d)\n", tcp, data, len);
 
   if (tcp == NULL)
@@ -601,7 +1665,32 @@ int tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len)
 
   tcp_ssl->last_wr = 0;
 
-  int rc = mbedtls_ssl_write(&tcp_ssl->ssl_ctx, data, len);
+  int rc;
+
+  if (tcp_ssl_handshake_over(tcp_ssl))
+  {
+    // Refused 0-RTT data first, the new data waits until all of it is out
+    rc = tcp_ssl_early_done(tcp_ssl);
+
+    if (rc == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      return 0;
+    }
+
+    if (rc == 0)
+    {
+      rc = mbedtls_ssl_write(&tcp_ssl->ssl_ctx, data, len);
+    }
+  }
+  else if (tcp_ssl->false_started)
+  {
+    rc = tcp_ssl_write_false_start(tcp_ssl, data, len);
+  }
+  else
+  {
+    // mbedtls_ssl_write() would drive the handshake from the caller's task, next to tcp_ssl_read()
+    return tcp_ssl_write_early(tcp_ssl, data, len, plain);
+  }
 
   if (rc < 0)
   {
@@ -620,12 +1709,45 @@ int tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len)
     return rc;
   }
 
+  // mbedtls_ssl_write() writes at most one record per call
+  tcp_ssl_count(tcp_ssl, false);
+
+  if (plain)
+  {
+    *plain = rc;
+  }
+
+  if (end && tcp_ssl->last_wr)
+  {
+    *end = tcp_ssl->last_end;
+  }
+
   return tcp_ssl->last_wr;
 }
 
 /////////////////////////////////////////////
 
+// On each ACK: writes what the TLS layer still holds back, the tail of the refused 0-RTT data. < 0 on error
+int tcp_ssl_flush(struct tcp_pcb *tcp)
+{
+  tcp_ssl_t * tcp_ssl = tcp_ssl_get(tcp);
+
+  if (tcp_ssl == NULL || tcp_ssl->early == NULL || !tcp_ssl_handshake_over(tcp_ssl))
+  {
+    return 0;
+  }
+
+  int rc = tcp_ssl_early_done(tcp_ssl);
+
+  return (rc == MBEDTLS_ERR_SSL_WANT_WRITE) ? 0 : rc;
+}
+
+/////////////////////////////////////////////
+
 /*
+  TLS 1.2 client states of mbedTLS 2. TLS 1.3 (mbedTLS 3) has its own, and further states past
+  HANDSHAKE_OVER: use tcp_ssl_handshake_over() rather than comparing with it.
+
   typedef enum
   {
   MBEDTLS_SSL_HELLO_REQUEST,
@@ -655,11 +1777,17 @@ int tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len)
 
 // tcp_ssl_read is a callback that reads from the TLS connection, i.e., it calls mbedtls, which then
 // tries to read from the TCP connection and decrypts it, tcp_ssl_read then calls the application's
-// onData callback with the decrypted data.
-int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p)
+// onData callback with the decrypted data. *window (may be NULL) is set to the ciphertext of p to
+// tcp_recved() now: all of it but what records held by tcp_ssl_rx_hold() keep.
+int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p, size_t *window)
 {
   //TCP_SSL_DEBUG("tcp_ssl_read(%x, %x)\n", tcp, p);
 
+  if (window)
+  {
+    *window = p ? p->tot_len : 0;
+  }
+
   if (tcp == NULL)
   {
     return -1;
@@ -686,14 +1814,17 @@ int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p)
 
   // TCP_SSL_DEBUG("READY TO READ SOME DATA\n");
 
-  tcp_ssl->tcp_pbuf    = p;
-  tcp_ssl->pbuf_offset = 0;
+  tcp_ssl->tcp_pbuf       = p;
+  tcp_ssl->pbuf_offset    = 0;
+  tcp_ssl->rx_pulled      = 0;
+  tcp_ssl->rx_kept        = 0;
+  tcp_ssl->rx_record_held = false;
 
   bool debugPrinted = false;
 
   do
   {
-    if (tcp_ssl->ssl_ctx.state != MBEDTLS_SSL_HANDSHAKE_OVER)
+    if (!tcp_ssl_handshake_over(tcp_ssl))
     {
       //KH to print once
       if (!debugPrinted)
@@ -703,10 +1834,14 @@ int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p)
         debugPrinted = true;
       }
 
-      int ret = mbedtls_ssl_handshake(&tcp_ssl->ssl_ctx);
+      int ret = tcp_ssl_handshake_run(tcp_ssl);
       //handle_error(ret);
 
-      if (ret == 0)
+      // False Start: the application goes first, the server's Finished is still checked when it arrives
+      bool opened = (ret == 0) ? !tcp_ssl->false_started
+                    : (ret == MBEDTLS_ERR_SSL_WANT_READ && tcp_ssl_false_start_ready(tcp_ssl));
+
+      if (opened)
       {
         //TCP_SSL_DEBUG("Protocol is %s, Ciphersuite is %s\n", mbedtls_ssl_get_version(&tcp_ssl->ssl_ctx), mbedtls_ssl_get_ciphersuite(&tcp_ssl->ssl_ctx));
 
@@ -729,7 +1864,40 @@ int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p)
 
         //////
 
-        if (tcp_ssl->on_handshake)
+        if (ret != 0)
+        {
+          tcp_ssl->false_started = true;
+
+          if (tcp_ssl->on_handshake)
+            tcp_ssl->on_handshake(tcp_ssl->arg, tcp_ssl->tcp, tcp_ssl);
+        }
+      }
+
+      if (ret == 0)
+      {
+#if (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        // TLS 1.3 tickets come after the handshake, see below
+        if (tcp_ssl->ssl_ctx.tls_version != MBEDTLS_SSL_VERSION_TLS1_3)
+#endif
+          tcp_ssl_session_store(tcp_ssl);
+
+#endif
+
+        int early = tcp_ssl_early_done(tcp_ssl);
+
+        if (early < 0 && early != MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+          handle_error(early);
+
+          if (tcp_ssl->on_error)
+            tcp_ssl->on_error(tcp_ssl->arg, tcp_ssl->tcp, early);
+
+          break;
+        }
+
+        if (opened && tcp_ssl->on_handshake)
           tcp_ssl->on_handshake(tcp_ssl->arg, tcp_ssl->tcp, tcp_ssl);
       }
       else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
@@ -757,6 +1925,21 @@ int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p)
         {
           break;
         }
+
+#if defined(MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+
+        // TLS 1.3: a ticket for the next connection, not an error
+        if (read_bytes == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET)
+        {
+#if (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+          tcp_ssl_session_store(tcp_ssl);
+#endif
+          read_bytes = 0;
+
+          continue;
+        }
+
+#endif
         else if (read_bytes != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
         {
           //TCP_SSL_DEBUG("tcp_ssl_read: read error: %d\n", read_bytes);
@@ -768,11 +1951,25 @@ int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p)
       }
       else if (read_bytes > 0)
       {
+        // A record counts once its last plaintext byte has been read
+        bool record_end = (mbedtls_ssl_get_bytes_avail(&tcp_ssl->ssl_ctx) == 0);
+
+        if (record_end)
+          tcp_ssl_count(tcp_ssl, true);
+
         if (tcp_ssl->on_data)
         {
           tcp_ssl->on_data(tcp_ssl->arg, tcp, read_buf, read_bytes);
         }
 
+        // mbedtls pulls a whole record before any of its plaintext, so what was pulled since the last
+        // record end is this one's, plus records without plaintext in front of it
+        if (record_end)
+        {
+          tcp_ssl->rx_pulled      = 0;
+          tcp_ssl->rx_record_held = false;
+        }
+
         total_bytes += read_bytes;
       }
     }
@@ -785,6 +1982,12 @@ int tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p)
 
   tcp_ssl->tcp_pbuf = NULL;
 
+  // The start of a record cut off by the end of p isn't held: the window must stay open for the rest
+  if (window)
+  {
+    *window = p->tot_len - tcp_ssl->rx_kept;
+  }
+
   return (total_bytes >= 0 ? 0 : total_bytes); // return error code
 }
 
@@ -826,6 +2029,7 @@ int tcp_ssl_free(struct tcp_pcb *tcp)
       mbedtls_pk_free(&item->client_key);
     }
 
+    free(item->early);
     free(item);
 
     return 0;
@@ -851,6 +2055,7 @@ int tcp_ssl_free(struct tcp_pcb *tcp)
   mbedtls_ssl_config_free(&i->ssl_conf);
   mbedtls_ctr_drbg_free(&i->drbg_ctx);
   mbedtls_entropy_free(&i->entropy_ctx);
+  free(i->early);
   free(i);
 
   return 0;
@@ -913,4 +2118,208 @@ void tcp_ssl_err(struct tcp_pcb *tcp, tcp_ssl_error_cb_t arg)
 
 /////////////////////////////////////////////
 
+void tcp_ssl_counters(struct tcp_pcb *tcp, tcp_ssl_counters_t * counters)
+{
+  tcp_ssl_t * item = tcp_ssl_get(tcp);
+
+  if (item)
+  {
+    item->counters = counters;
+  }
+}
+
+/////////////////////////////////////////////
+
+// Name of the negotiated suite, NULL before the handshake finished or False Started
+const char* tcp_ssl_get_ciphersuite(struct tcp_pcb *tcp)
+{
+  tcp_ssl_t * item = tcp_ssl_get(tcp);
+
+  if (item == NULL || !(tcp_ssl_handshake_over(item) || item->false_started))
+  {
+    return NULL;
+  }
+
+  return mbedtls_ssl_get_ciphersuite(&item->ssl_ctx);
+}
+
+/////////////////////////////////////////////
+
+// e.g. "TLSv1.3", NULL before the handshake finished
+const char* tcp_ssl_get_version(struct tcp_pcb *tcp)
+{
+  tcp_ssl_t * item = tcp_ssl_get(tcp);
+
+  if (item == NULL || !(tcp_ssl_handshake_over(item) || item->false_started))
+  {
+    return NULL;
+  }
+
+  return mbedtls_ssl_get_version(&item->ssl_ctx);
+}
+
+/////////////////////////////////////////////
+
+// Plaintext of the largest single record whose ciphertext fits in window bytes, 0 if none does
+size_t tcp_ssl_record_room(struct tcp_pcb *tcp, size_t window)
+{
+  tcp_ssl_t * item = tcp_ssl_get(tcp);
+
+  if (item == NULL)
+  {
+    return 0;
+  }
+
+  // Header, explicit IV, MAC or tag and worst case CBC padding of the current transform
+  int expansion = mbedtls_ssl_get_record_expansion(&item->ssl_ctx);
+
+  // Record size limit, lower with a negotiated max fragment length
+  int payload   = (int) mbedtls_ssl_get_max_out_record_payload(&item->ssl_ctx);
+
+  if (expansion < 0 || payload <= 0 || window <= (size_t) expansion)
+  {
+    return 0;
+  }
+
+  window -= expansion;
+
+  return (window < (size_t) payload) ? window : (size_t) payload;
+}
+
+/////////////////////////////////////////////
+
+// Receive flow control, called from on_data: the application hasn't consumed these plain bytes yet.
+// The record they belong to keeps its ciphertext out of the TCP window until tcp_ssl_rx_release()
+void tcp_ssl_rx_hold(struct tcp_pcb *tcp, size_t plain)
+{
+  tcp_ssl_t * item = tcp_ssl_get(tcp);
+
+  if (item == NULL || plain == 0)
+  {
+    return;
+  }
+
+  // One entry per record. With all of them in use, the record joins the newest, released with it
+  if ((!item->rx_record_held || item->rx_count == 0) && item->rx_count < TCP_SSL_RX_RECORDS)
+  {
+    tcp_ssl_rx_record_t * record = &item->rx_held[(item->rx_head + item->rx_count) % TCP_SSL_RX_RECORDS];
+
+    record->plain  = 0;
+    record->cipher = 0;
+
+    item->rx_count++;
+  }
+
+  tcp_ssl_rx_record_t * newest = &item->rx_held[(item->rx_head + item->rx_count - 1) % TCP_SSL_RX_RECORDS];
+
+  newest->plain  += plain;
+  newest->cipher += item->rx_pulled;
+
+  item->rx_kept       += item->rx_pulled;
+  item->rx_pulled      = 0;
+  item->rx_record_held = true;
+}
+
+/////////////////////////////////////////////
+
+// The application consumed plain bytes of the held plaintext, oldest first. Returns the ciphertext to
+// tcp_recved(): that of the records now consumed in full, nothing for one consumed in part
+size_t tcp_ssl_rx_release(struct tcp_pcb *tcp, size_t plain)
+{
+  tcp_ssl_t * item = tcp_ssl_get(tcp);
+  size_t window    = 0;
+
+  if (item == NULL)
+  {
+    return 0;
+  }
+
+  while (plain && item->rx_count)
+  {
+    tcp_ssl_rx_record_t * oldest = &item->rx_held[item->rx_head];
+
+    if (plain < oldest->plain)
+    {
+      oldest->plain -= plain;
+
+      break;
+    }
+
+    plain  -= oldest->plain;
+    window += oldest->cipher;
+
+    item->rx_head = (item->rx_head + 1) % TCP_SSL_RX_RECORDS;
+    item->rx_count--;
+  }
+
+  return window;
+}
+
+/////////////////////////////////////////////
+
+// Forgets the saved sessions: the next connections do full handshakes
+void tcp_ssl_clear_sessions()
+{
+#if (ASYNC_TCP_SSL_SESSION_CACHE_SIZE > 0)
+
+  if (!tcp_ssl_sessions_take())
+  {
+    return;
+  }
+
+  for (int i = 0; i < ASYNC_TCP_SSL_SESSION_CACHE_SIZE; i++)
+  {
+    free(tcp_ssl_sessions[i].data);
+  }
+
+  memset(tcp_ssl_sessions, 0, sizeof(tcp_ssl_sessions));
+
+  xSemaphoreGive(tcp_ssl_sessions_lock);
+
+#endif
+}
+
+/////////////////////////////////////////////
+
+void tcp_ssl_get_verify_stats(tcp_ssl_verify_stats_t * stats)
+{
+#if (ASYNC_TCP_SSL_VERIFY_CACHE_SIZE > 0)
+  portENTER_CRITICAL(&tcp_ssl_verify_mux);
+  *stats = tcp_ssl_verify_stats;
+  portEXIT_CRITICAL(&tcp_ssl_verify_mux);
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+/////////////////////////////////////////////
+
+// Forgets the leaves, the counters stay
+void tcp_ssl_clear_verify_cache()
+{
+#if (ASYNC_TCP_SSL_VERIFY_CACHE_SIZE > 0)
+  portENTER_CRITICAL(&tcp_ssl_verify_mux);
+  memset(tcp_ssl_verified, 0, sizeof(tcp_ssl_verified));
+  portEXIT_CRITICAL(&tcp_ssl_verify_mux);
+#endif
+}
+
+/////////////////////////////////////////////
+
+void tcp_ssl_get_totals(tcp_ssl_counters_t * totals)
+{
+  totals->records_in  = __atomic_load_n(&tcp_ssl_totals.records_in, __ATOMIC_RELAXED);
+  totals->records_out = __atomic_load_n(&tcp_ssl_totals.records_out, __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////////
+
+void tcp_ssl_reset_totals()
+{
+  __atomic_store_n(&tcp_ssl_totals.records_in, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&tcp_ssl_totals.records_out, 0, __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////////
+
 //#endif // ASYNC_TCP_SSL_ENABLED
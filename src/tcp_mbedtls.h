@@ -38,6 +38,7 @@
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
+#include "mbedtls/ecp.h"
 
 /////////////////////////////////////////////
 
@@ -63,15 +64,75 @@ typedef void (* tcp_ssl_data_cb_t)(void *arg, struct tcp_pcb *tcp, uint8_t * dat
 typedef void (* tcp_ssl_handshake_cb_t)(void *arg, struct tcp_pcb *tcp, struct tcp_ssl_pcb* ssl);
 typedef void (* tcp_ssl_error_cb_t)(void *arg, struct tcp_pcb *tcp, int8_t error);
 
+// TLS records, handshake records excluded
+typedef struct
+{
+  uint32_t records_in;
+  uint32_t records_out;
+} tcp_ssl_counters_t;
+
+// Handshake preferences and trust anchors. Nothing is copied. NULL keeps mbedTLS's defaults
+typedef struct
+{
+  const int *                   ciphersuites;   // mbedTLS suite ids (IANA numbers) in order of preference, 0-terminated
+  const mbedtls_ecp_group_id *  curves;         // ECDHE curves in order of preference, MBEDTLS_ECP_DP_NONE-terminated
+  const uint8_t *               ca_bundle;      // trusted roots from utils/gen_ca_bundle.py, in addition to root_ca
+  size_t                        ca_bundle_len;
+  bool                          verify_cache;   // skip the chain check for a leaf verified before, see below
+  bool                          resume;         // offer the session saved for this server, see below
+  bool                          early_data;     // with resume: TLS 1.3 0-RTT data from tcp_ssl_write() during the handshake
+  bool                          false_start;    // TLS 1.2 False Start (RFC 7918): on_handshake once the client's Finished is sent
+} tcp_ssl_opts_t;
+
+// Offer TLS 1.3 and fall back to 1.2, when mbedTLS has both (MBEDTLS_SSL_PROTO_TLS1_3, mbedTLS 3.2 and
+// later). 0 keeps to TLS 1.2. Compiled in tcp_mbedtls.c, so set it with a build flag
+#ifndef ASYNC_TCP_SSL_TLS1_3
+  #define ASYNC_TCP_SSL_TLS1_3              1
+#endif
+
+// Sessions saved for tcp_ssl_opts_t::resume, TLS 1.2 session ids or tickets and TLS 1.3 tickets. Shared
+// by all connections, keyed by host name (the address without one), port and the trust anchors. Only
+// sessions with a verified peer are saved. Default 4, 0 to disable
+#ifndef ASYNC_TCP_SSL_SESSION_CACHE_SIZE
+  #define ASYNC_TCP_SSL_SESSION_CACHE_SIZE  4
+#endif
+
+// Leaf certificates remembered after a full chain check, for tcp_ssl_opts_t::verify_cache. Shared by all
+// connections, keyed by the SHA-256 of the trust anchors, the host name and the leaf DER. Compiled in
+// tcp_mbedtls.c, so set it with a build flag. Default 8 leaves, 0 to disable
+#ifndef ASYNC_TCP_SSL_VERIFY_CACHE_SIZE
+  #define ASYNC_TCP_SSL_VERIFY_CACHE_SIZE   8
+#endif
+
+typedef struct
+{
+  uint32_t hits;            // chain checks skipped for a known leaf
+  uint32_t misses;          // full chain checks
+  uint32_t stored;          // leaves added after a successful check
+  uint32_t expired;         // known leaves refused, outside their validity
+  uint32_t evicted;         // leaves dropped to make room
+} tcp_ssl_verify_stats_t;
+
+// CA bundle format, all numbers little endian:
+//   "ATCB", u16 version, u16 count
+//   count index entries sorted by hash: u32 FNV-1a of the subject DER, u32 offset, u16 subject length, u16 key length
+//   at each offset the subject Name DER followed by the SubjectPublicKeyInfo DER
+#define TCP_SSL_CA_BUNDLE_VERSION         1
+#define TCP_SSL_CA_BUNDLE_HEADER          8
+#define TCP_SSL_CA_BUNDLE_ENTRY           12
+
 /////////////////////////////////////////////
 
 uint8_t tcp_ssl_has_client();
 int     tcp_ssl_new_client(struct tcp_pcb *tcp, void *arg, const char* hostname, const char* root_ca,
                            const size_t root_ca_len,
-                           const char* cli_cert, const size_t cli_cert_len, const char* cli_key, const size_t cli_key_len);
-int     tcp_ssl_new_psk_client(struct tcp_pcb *tcp, void *arg, const char* psk_ident, const char* psk);
-int     tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len);
-int     tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p);
+                           const char* cli_cert, const size_t cli_cert_len, const char* cli_key, const size_t cli_key_len,
+                           const tcp_ssl_opts_t* opts);
+int     tcp_ssl_new_psk_client(struct tcp_pcb *tcp, void *arg, const char* psk_ident, const char* psk,
+                               const tcp_ssl_opts_t* opts);
+int     tcp_ssl_write(struct tcp_pcb *tcp, uint8_t *data, size_t len, size_t *plain, uint32_t *end);
+int     tcp_ssl_flush(struct tcp_pcb *tcp);
+int     tcp_ssl_read(struct tcp_pcb *tcp, struct pbuf *p, size_t *window);
 int     tcp_ssl_handshake_step(struct tcp_pcb *tcp);
 int     tcp_ssl_free(struct tcp_pcb *tcp);
 bool    tcp_ssl_has(struct tcp_pcb *tcp);
@@ -79,6 +140,18 @@ void    tcp_ssl_arg(struct tcp_pcb *tcp, void * arg);
 void    tcp_ssl_data(struct tcp_pcb *tcp, tcp_ssl_data_cb_t arg);
 void    tcp_ssl_handshake(struct tcp_pcb *tcp, tcp_ssl_handshake_cb_t arg);
 void    tcp_ssl_err(struct tcp_pcb *tcp, tcp_ssl_error_cb_t arg);
+void    tcp_ssl_counters(struct tcp_pcb *tcp, tcp_ssl_counters_t * counters);
+const char* tcp_ssl_get_ciphersuite(struct tcp_pcb *tcp);
+const char* tcp_ssl_get_version(struct tcp_pcb *tcp);
+size_t  tcp_ssl_record_room(struct tcp_pcb *tcp, size_t window);
+void    tcp_ssl_rx_hold(struct tcp_pcb *tcp, size_t plain);
+size_t  tcp_ssl_rx_release(struct tcp_pcb *tcp, size_t plain);
+void    tcp_ssl_clear_sessions();
+int     tcp_ssl_ca_bundle_count(const uint8_t * bundle, size_t len);
+void    tcp_ssl_get_verify_stats(tcp_ssl_verify_stats_t * stats);
+void    tcp_ssl_clear_verify_cache();
+void    tcp_ssl_get_totals(tcp_ssl_counters_t * totals);
+void    tcp_ssl_reset_totals();
 
 /////////////////////////////////////////////
 
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""Converts a PEM bundle of root certificates (e.g. Mozilla's cacert.pem) into the binary CA bundle of
+AsyncTCP_SSL, for AsyncSSLClient::setCaBundle().
+
+Only the subject name and public key of each root are kept, indexed by a hash of the subject. The
+library reads the bundle in place and parses just the key of the issuer a server's chain ends at.
+The format is described with tcp_ssl_opts_t in src/tcp_mbedtls.h.
+
+  gen_ca_bundle.py cacert.pem -o ca_bundle.bin
+  gen_ca_bundle.py cacert.pem --header ca_bundle.h --name ca_bundle
+
+No dependencies beyond Python 3.
+"""
+
+import argparse
+import base64
+import re
+import struct
+import sys
+
+MAGIC   = b"ATCB"
+VERSION = 1
+HEADER  = 8
+ENTRY   = 12
+
+PEM_RE  = re.compile(rb"-----BEGIN CERTIFICATE-----(.+?)-----END CERTIFICATE-----", re.S)
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def read_tlv(der, pos):
+    """Returns (tag, value start, end) of the DER element at pos."""
+    tag = der[pos]
+    length = der[pos + 1]
+    pos += 2
+    if length & 0x80:
+        count = length & 0x7F
+        length = int.from_bytes(der[pos:pos + count], "big")
+        pos += count
+    return tag, pos, pos + length
+
+
+def children(der, start, end):
+    """Yields the raw DER of each element between start and end."""
+    while start < end:
+        _, _, elem_end = read_tlv(der, start)
+        yield der[start:elem_end]
+        start = elem_end
+
+
+def subject_and_key(der):
+    """Raw DER of the subject Name and the SubjectPublicKeyInfo of a certificate."""
+    _, cert_start, cert_end = read_tlv(der, 0)
+    _, tbs_start, tbs_end = read_tlv(der, cert_start)
+    fields = list(children(der, tbs_start, tbs_end))
+    if fields[0][0] == 0xA0:        # [0] version
+        fields = fields[1:]
+    # serialNumber, signature, issuer, validity, subject, subjectPublicKeyInfo
+    return fields[4], fields[5]
+
+
+def build(certs):
+    entries = {}
+    for der in certs:
+        subject, key = subject_and_key(der)
+        entries[(subject, key)] = fnv1a(subject)
+
+    if len(entries) > 0xFFFF:
+        sys.exit("too many certificates: %d" % len(entries))
+
+    ordered = sorted(entries.items(), key=lambda item: (item[1], item[0][0]))
+    index = bytearray(MAGIC + struct.pack("<HH", VERSION, len(ordered)))
+    data = bytearray()
+    offset = HEADER + ENTRY * len(ordered)
+
+    for (subject, key), h in ordered:
+        if len(subject) > 0xFFFF or len(key) > 0xFFFF:
+            sys.exit("certificate too large")
+        index += struct.pack("<IIHH", h, offset + len(data), len(subject), len(key))
+        data += subject + key
+
+    return bytes(index + data), len(ordered)
+
+
+def write_header(path, name, bundle, count, source):
+    with open(path, "w") as out:
+        out.write("// Generated by utils/gen_ca_bundle.py from %s: %d roots, %d bytes\n\n" % (source, count, len(bundle)))
+        out.write("#pragma once\n\n#include <stdint.h>\n#include <stddef.h>\n\n")
+        out.write("static const uint8_t %s[] =\n{\n" % name)
+        for i in range(0, len(bundle), 16):
+            out.write("  " + ", ".join("0x%02x" % b for b in bundle[i:i + 16]) + ",\n")
+        out.write("};\n\nstatic const size_t %s_len = sizeof(%s);\n" % (name, name))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a PEM CA bundle into AsyncTCP_SSL's binary CA bundle")
+    parser.add_argument("pem", nargs="+", help="PEM files with the root certificates")
+    parser.add_argument("-o", "--output", help="binary bundle to write")
+    parser.add_argument("--header", help="C header to write, with the bundle as an array")
+    parser.add_argument("--name", default="ca_bundle", help="array name in the C header")
+    args = parser.parse_args()
+
+    if not args.output and not args.header:
+        parser.error("give --output and/or --header")
+
+    certs = []
+    for path in args.pem:
+        with open(path, "rb") as f:
+            for block in PEM_RE.findall(f.read()):
+                certs.append(base64.b64decode(b"".join(block.split())))
+
+    bundle, count = build(certs)
+
+    if args.output:
+        with open(args.output, "wb") as out:
+            out.write(bundle)
+
+    if args.header:
+        write_header(args.header, args.name, bundle, count, ", ".join(args.pem))
+
+    print("%d roots, %d bytes" % (count, len(bundle)))
+
+
+if __name__ == "__main__":
+    main()